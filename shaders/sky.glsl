@@ -4,18 +4,22 @@ layout (location = 0) in vec3 Position;
 layout (location = 1) in vec2 TexCoord;
 layout (location = 2) in vec2 Lightmap;
 
-layout (location = 0) uniform mat4 ProjectionMatrix;
-layout (location = 1) uniform mat4 ViewMatrix;
-layout (location = 2) uniform mat4 ModelMatrix;
-layout (location = 3) uniform vec3 CameraPosition;
+// per frame, shared by every map shader, see frame_uniforms
+layout (std140, binding = 0) uniform Frame
+{
+    mat4 WorldViewProjectionMatrix;
+    mat4 WorldMatrix;
+    vec3 CameraPosition;
+    float Time;
+    vec4 LightStyles[16];
+};
 
 out vec3 SkyTexCoord;
 
 void main()
 {
-    SkyTexCoord = mat3(ModelMatrix) * Position - CameraPosition;
-    mat4 ModelViewProjectionMatrix = ProjectionMatrix * ViewMatrix * ModelMatrix;
-    gl_Position = ModelViewProjectionMatrix * vec4(Position, 1.0);
+    SkyTexCoord = vec3(WorldMatrix * vec4(Position, 1.0)) - CameraPosition;
+    gl_Position = WorldViewProjectionMatrix * vec4(Position, 1.0);
 }
 
 #fragment
@@ -24,9 +28,33 @@ out vec4 FragColor;
 
 in vec3 SkyTexCoord;
 
-uniform float Time;
+layout (std140, binding = 0) uniform Frame
+{
+    mat4 WorldViewProjectionMatrix;
+    mat4 WorldMatrix;
+    vec3 CameraPosition;
+    float Time;
+    vec4 LightStyles[16];
+};
+
 uniform sampler2D Texture0;
 uniform sampler2D Texture2;
+uniform sampler2D Palette;
+uniform int Paletted;
+
+vec4 SampleSky(sampler2D Layer, vec2 UV, out bool Transparent)
+{
+    vec4 Color = texture(Layer, UV);
+    if (Paletted != 0)
+    {
+        // index 0 is the see through color of the sky's front layer
+        int Index = int(Color.r * 255.0 + 0.5);
+        Transparent = Index == 0;
+        return texelFetch(Palette, ivec2(Index, 0), 0);
+    }
+    Transparent = (Color.r + Color.g + Color.b) < 0.1;
+    return Color;
+}
 
 void main()
 {
@@ -36,11 +64,12 @@ void main()
     SkyDir.y *= StretchFactor;
     SkyDir = normalize(SkyDir) * StretchFactor;
     vec2 SkyUV = vec2(SkyDir.x + Scroll, SkyDir.z - Scroll);
-    FragColor = texture(Texture0, SkyUV);
-    if ((FragColor.r + FragColor.g + FragColor.b) < 0.1)
+    bool Transparent;
+    FragColor = SampleSky(Texture0, SkyUV, Transparent);
+    if (Transparent)
     {
         Scroll = Time / 16.0;
         SkyUV = vec2(SkyDir.x + Scroll, SkyDir.z - Scroll);
-        FragColor = texture(Texture2, SkyUV);
+        FragColor = SampleSky(Texture2, SkyUV, Transparent);
     }
 }
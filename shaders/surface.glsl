@@ -3,35 +3,78 @@
 layout (location = 0) in vec3 VertPosition;
 layout (location = 1) in vec2 VertTexCoord;
 layout (location = 2) in vec2 VertLightmap;
+layout (location = 3) in uint VertInfo;
 
-layout (location = 0) uniform mat4 ProjectionMatrix;
-layout (location = 1) uniform mat4 ViewMatrix;
-layout (location = 2) uniform mat4 ModelMatrix;
+// per frame, shared by every map shader, see frame_uniforms
+layout (std140, binding = 0) uniform Frame
+{
+    mat4 WorldViewProjectionMatrix;
+    mat4 WorldMatrix;
+    vec3 CameraPosition;
+    float Time;
+    vec4 LightStyles[16];
+};
+
+uniform sampler2DArray Texture0;
+uniform sampler2D SurfaceInfo;
+uniform float TexCoordScale;
 
-out vec2 UV;
-out vec2 LightmapUV;
+out vec3 UV;
+out vec3 LightmapUV;
+flat out uvec4 Styles;
 
 void main()
 {
-    mat4 ModelViewProjectionMatrix = ProjectionMatrix * ViewMatrix * ModelMatrix;
-    gl_Position = ModelViewProjectionMatrix * vec4(VertPosition, 1.0);
-    UV = VertTexCoord;
-    LightmapUV = VertLightmap;
+    gl_Position = WorldViewProjectionMatrix * vec4(VertPosition, 1.0);
+    // 256 entries a row, each the styles then the layer and lightmap page
+    ivec2 Entry = ivec2(int(VertInfo & 255u) * 2, int(VertInfo >> 8));
+    uvec4 Info = uvec4(texelFetch(SurfaceInfo, Entry + ivec2(1, 0), 0) * 255.0 + 0.5);
+    UV = vec3(VertTexCoord * TexCoordScale / vec2(textureSize(Texture0, 0).xy), float(Info.x));
+    LightmapUV = vec3(VertLightmap, float(Info.y));
+    Styles = uvec4(texelFetch(SurfaceInfo, Entry, 0) * 255.0 + 0.5);
 }
 
 #fragment
 #version 460 core
 out vec4 FragColor;
 
-in vec2 UV;
-in vec2 LightmapUV;
+in vec3 UV;
+in vec3 LightmapUV;
+flat in uvec4 Styles;
 
-uniform sampler2D Texture0;
-uniform sampler2D Texture1;
+uniform sampler2DArray Texture0;
+uniform sampler2DArray Texture1;
+uniform sampler2DArray Texture2;
+uniform sampler2D Palette;
+uniform int Paletted;
+
+layout (std140, binding = 0) uniform Frame
+{
+    mat4 WorldViewProjectionMatrix;
+    mat4 WorldMatrix;
+    vec3 CameraPosition;
+    float Time;
+    vec4 LightStyles[16];
+};
 
 void main()
 {
+    // each channel holds one style of the face, scaled by its current value
+    // the 64 style values are packed four to a vec4
+    vec4 Scales = vec4(LightStyles[Styles.x >> 2u][Styles.x & 3u], LightStyles[Styles.y >> 2u][Styles.y & 3u],
+                       LightStyles[Styles.z >> 2u][Styles.z & 3u], LightStyles[Styles.w >> 2u][Styles.w & 3u]);
+    float Light = dot(texture(Texture1, LightmapUV), Scales);
+    // dynamic lights add on top of every style
+    Light += texture(Texture2, LightmapUV).r;
+    vec4 LightColor = vec4(vec3(Light), 1.0);
+    if (Paletted != 0)
+    {
+        // the last 32 palette entries are fullbright and ignore the lightmap
+        int Index = int(texture(Texture0, UV).r * 255.0 + 0.5);
+        vec4 BaseColor = texelFetch(Palette, ivec2(Index, 0), 0);
+        FragColor = Index >= 224 ? BaseColor : (BaseColor * 2.0) * LightColor;
+        return;
+    }
     vec4 BaseColor = texture(Texture0, UV);
-    vec4 LightColor = vec4(texture(Texture1, LightmapUV).rrr, 1.0);
     FragColor = (BaseColor * 2.0) * LightColor;
 }
@@ -3,17 +3,25 @@
 layout (location = 0) in vec3 VertPosition;
 layout (location = 1) in vec2 VertTexCoord;
 
-layout (location = 0) uniform mat4 ProjectionMatrix;
-layout (location = 1) uniform mat4 ViewMatrix;
-layout (location = 2) uniform mat4 ModelMatrix;
+// per frame, shared by every map shader, see frame_uniforms
+layout (std140, binding = 0) uniform Frame
+{
+    mat4 WorldViewProjectionMatrix;
+    mat4 WorldMatrix;
+    vec3 CameraPosition;
+    float Time;
+    vec4 LightStyles[16];
+};
+
+uniform sampler2D Texture0;
+uniform float TexCoordScale;
 
 out vec2 UV;
 
 void main()
 {
-    mat4 ModelViewProjectionMatrix = ProjectionMatrix * ViewMatrix * ModelMatrix;
-    gl_Position = ModelViewProjectionMatrix * vec4(VertPosition, 1.0);
-    UV = VertTexCoord;
+    gl_Position = WorldViewProjectionMatrix * vec4(VertPosition, 1.0);
+    UV = VertTexCoord * TexCoordScale / vec2(textureSize(Texture0, 0));
 }
 
 #fragment
@@ -23,7 +31,17 @@ out vec4 FragColor;
 in vec2 UV;
 
 uniform sampler2D Texture0;
-uniform float Time;
+uniform sampler2D Palette;
+uniform int Paletted;
+
+layout (std140, binding = 0) uniform Frame
+{
+    mat4 WorldViewProjectionMatrix;
+    mat4 WorldMatrix;
+    vec3 CameraPosition;
+    float Time;
+    vec4 LightStyles[16];
+};
 
 void main()
 {
@@ -34,6 +52,10 @@ void main()
 
     // Sample the texture with distorted UVs
     vec4 BaseColor = texture(Texture0, DistortedUV);
+    if (Paletted != 0)
+    {
+        BaseColor = texelFetch(Palette, ivec2(int(BaseColor.r * 255.0 + 0.5), 0), 0);
+    }
     FragColor = BaseColor;
 }
 
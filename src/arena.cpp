@@ -0,0 +1,80 @@
+#include "arena.h"
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+#ifdef WINDOWS
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <mutex>
+
+#define ARENA_COMMIT_SIZE (1ull << 20)
+
+static std::mutex commit_mutex;
+
+static uint8_t *reserveMemory(size_t size) {
+    return (uint8_t *)VirtualAlloc(0, size, MEM_RESERVE, PAGE_NOACCESS);
+}
+
+static bool commitMemory(arena *a, size_t end) {
+    std::lock_guard<std::mutex> lock(commit_mutex);
+    if (end <= a->committed) return true;
+    size_t new_committed = (end + ARENA_COMMIT_SIZE - 1) & ~(ARENA_COMMIT_SIZE - 1);
+    if (new_committed > a->reserved) new_committed = a->reserved;
+    if (!VirtualAlloc(a->base + a->committed, new_committed - a->committed, MEM_COMMIT, PAGE_READWRITE)) return false;
+    a->committed = new_committed;
+    return true;
+}
+
+static void releaseMemory(uint8_t *base, size_t) {
+    VirtualFree(base, 0, MEM_RELEASE);
+}
+
+#else
+#include <sys/mman.h>
+
+static uint8_t *reserveMemory(size_t size) {
+    // lazily backed by zero pages, nothing is charged until it is written
+    void *base = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    return base == MAP_FAILED ? 0 : (uint8_t *)base;
+}
+
+static bool commitMemory(arena *, size_t) {
+    return true;
+}
+
+static void releaseMemory(uint8_t *base, size_t size) {
+    munmap(base, size);
+}
+#endif
+
+bool arenaInit(arena *a, size_t reserve) {
+    *a = {};
+    a->base = reserveMemory(reserve);
+    if (!a->base) return false;
+    a->reserved = reserve;
+    return true;
+}
+
+void *arenaAlloc(arena *a, size_t size, size_t align) {
+    std::atomic_ref<size_t> used(a->used);
+    size_t offset = used.load(std::memory_order_relaxed);
+    size_t start;
+    do {
+        start = (offset + align - 1) & ~(align - 1);
+    } while (!used.compare_exchange_weak(offset, start + size, std::memory_order_relaxed));
+
+    if (start + size > a->reserved || !commitMemory(a, start + size)) {
+        // a map that does not fit in the reservation can not be loaded anyway
+        std::cerr << "arena: out of memory" << std::endl;
+        abort();
+    }
+    return a->base + start;
+}
+
+// one call hands every page back, no matter how many allocations were made
+void arenaRelease(arena *a) {
+    if (a->base) releaseMemory(a->base, a->reserved);
+    *a = {};
+}
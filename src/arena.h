@@ -0,0 +1,24 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+// bump allocator over one big reservation of address space, pages are only
+// backed by memory once touched and everything is returned in one release
+struct arena {
+    uint8_t *base;
+    size_t reserved;
+    size_t used;      // bumped atomically, loader threads share an arena
+    size_t committed; // only tracked where commit is explicit
+};
+
+#define ARENA_DEFAULT_RESERVE (4ull << 30)
+
+bool arenaInit(arena *a, size_t reserve = ARENA_DEFAULT_RESERVE);
+void *arenaAlloc(arena *a, size_t size, size_t align = 16);
+void arenaRelease(arena *a);
+
+// zero initialized array of count elements
+template <typename T>
+T *arenaPush(arena *a, size_t count) {
+    return (T *)arenaAlloc(a, sizeof(T) * count, alignof(T) > 16 ? alignof(T) : 16);
+}
@@ -0,0 +1,87 @@
+#include "atlas.h"
+#include <cstring>
+
+void atlasInit(atlas_page *page, int width, int height, skyline_segment *segments) {
+    page->width = width;
+    page->height = height;
+    page->used_height = 0;
+    page->num_segments = 1;
+    page->segments = segments;
+    page->segments[0] = { 0, 0, width };
+}
+
+// height the block would rest at if its left edge sat on segment idx, -1 if
+// it does not fit there
+static int restingHeight(const atlas_page *page, int idx, int width, int height) {
+    if (page->segments[idx].x + width > page->width) return -1;
+
+    int y = 0;
+    int remaining = width;
+    for (int i = idx; remaining > 0; i++) {
+        const skyline_segment &seg = page->segments[i];
+        if (seg.y > y) y = seg.y;
+        if (y + height > page->height) return -1;
+        remaining -= seg.width;
+    }
+    return y;
+}
+
+bool atlasPack(atlas_page *page, int width, int height, int *x, int *y) {
+    if (width <= 0 || height <= 0) return false;
+
+    // lowest resting height wins, the narrower segment breaks ties so wide
+    // gaps stay open for wide blocks
+    int best = -1;
+    int best_y = page->height;
+    int best_width = page->width + 1;
+    for (int i = 0; i < page->num_segments; i++) {
+        int seg_y = restingHeight(page, i, width, height);
+        if (seg_y < 0) continue;
+        if (seg_y < best_y || (seg_y == best_y && page->segments[i].width < best_width)) {
+            best = i;
+            best_y = seg_y;
+            best_width = page->segments[i].width;
+        }
+    }
+    if (best == -1) return false;
+
+    *x = page->segments[best].x;
+    *y = best_y;
+
+    // the block becomes a new segment, whatever it covers is trimmed away
+    skyline_segment placed = { *x, best_y + height, width };
+    int end = *x + width;
+    int last = best;
+    while (last < page->num_segments && page->segments[last].x + page->segments[last].width <= end) {
+        last++;
+    }
+    // last is the first segment that reaches past the block, if any
+    int num_removed = last - best;
+    if (last < page->num_segments && page->segments[last].x < end) {
+        skyline_segment &seg = page->segments[last];
+        seg.width -= end - seg.x;
+        seg.x = end;
+    }
+
+    int num_inserted = 1;
+    memmove(page->segments + best + num_inserted, page->segments + best + num_removed,
+            sizeof(skyline_segment) * (page->num_segments - best - num_removed));
+    page->segments[best] = placed;
+    page->num_segments += num_inserted - num_removed;
+
+    // neighbours at the same height collapse into one segment
+    for (int i = 0; i + 1 < page->num_segments;) {
+        skyline_segment &a = page->segments[i];
+        skyline_segment &b = page->segments[i + 1];
+        if (a.y == b.y) {
+            a.width += b.width;
+            memmove(page->segments + i + 1, page->segments + i + 2, sizeof(skyline_segment) * (page->num_segments - i - 2));
+            page->num_segments--;
+        } else {
+            i++;
+        }
+    }
+
+    if (placed.y > page->used_height) page->used_height = placed.y;
+    return true;
+}
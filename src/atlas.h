@@ -0,0 +1,21 @@
+#pragma once
+#include <cstdint>
+
+// skyline bottom left packer, the skyline is kept as a sorted list of
+// segments so placing a block only walks the current outline
+struct skyline_segment {
+    int32_t x;
+    int32_t y;
+    int32_t width;
+};
+
+struct atlas_page {
+    int32_t width;
+    int32_t height;
+    int32_t used_height;
+    int32_t num_segments;
+    skyline_segment *segments; // room for width segments
+};
+
+void atlasInit(atlas_page *page, int width, int height, skyline_segment *segments);
+bool atlasPack(atlas_page *page, int width, int height, int *x, int *y);
@@ -0,0 +1,696 @@
+#include "bench.h"
+#include "palette.h"
+#include "map.h"
+#include "vcache.h"
+#include "trace.h"
+#include "cache.h"
+#include <SDL.h>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+
+#define BENCH_MIN_SECONDS 0.5
+
+struct bench_case {
+    const char *name;
+    bool (*run)(const char *map_path);
+};
+
+static double secondsSince(uint64_t start) {
+    return (double)(SDL_GetPerformanceCounter() - start) / (double)SDL_GetPerformanceFrequency();
+}
+
+// deterministic filler so runs are comparable
+static uint32_t nextRandom(uint32_t *state) {
+    *state = *state * 1664525u + 1013904223u;
+    return *state >> 8;
+}
+
+static const uint8_t *naive_palette;
+
+// the original loop, one three byte palette entry copied per texel
+static void expandPaletteNaive(const uint8_t *indices, int count, const uint32_t *, uint8_t *rgb_out) {
+    for (int i = 0; i < count; i++) {
+        const uint8_t *c = naive_palette + indices[i] * 3;
+        rgb_out[i * 3 + 0] = c[0];
+        rgb_out[i * 3 + 1] = c[1];
+        rgb_out[i * 3 + 2] = c[2];
+    }
+}
+
+static double timePalette(palette_expand_fn fn, const uint8_t *indices, int count, const uint32_t *lut, uint8_t *out) {
+    int64_t texels = 0;
+    uint64_t start = SDL_GetPerformanceCounter();
+    do {
+        fn(indices, count, lut, out);
+        texels += count;
+    } while (secondsSince(start) < BENCH_MIN_SECONDS);
+    return (double)texels / secondsSince(start);
+}
+
+// a full set of 256x256 textures, the size most wads are made of
+static bool benchPalette(const char *) {
+    const int count = 256 * 256 * 16;
+    uint8_t *indices = (uint8_t *)malloc(count);
+    uint8_t *expected = (uint8_t *)malloc(count * 3);
+    uint8_t *out = (uint8_t *)malloc(count * 3);
+
+    uint32_t seed = 1;
+    uint8_t palette[256 * 3];
+    for (int i = 0; i < 256 * 3; i++) palette[i] = (uint8_t)nextRandom(&seed);
+    for (int i = 0; i < count; i++) indices[i] = (uint8_t)nextRandom(&seed);
+
+    uint32_t lut[256];
+    buildPaletteLUT(palette, lut);
+    naive_palette = palette;
+    for (int i = 0; i < count; i++) {
+        memcpy(expected + i * 3, palette + indices[i] * 3, 3);
+    }
+
+    struct {
+        const char *name;
+        palette_expand_fn fn;
+    } kernels[] = {
+        { "naive", expandPaletteNaive },
+        { "generic", expandPaletteGeneric },
+        { getPaletteKernelName(), expandPalette },
+    };
+
+    bool ok = true;
+    for (auto &kernel : kernels) {
+        // odd lengths exercise the scalar tails
+        memset(out, 0, count * 3);
+        kernel.fn(indices, count - 7, lut, out);
+        bool match = memcmp(out, expected, (count - 7) * 3) == 0;
+        ok = ok && match;
+
+        double rate = timePalette(kernel.fn, indices, count, lut, out);
+        SDL_Log("palette %-8s %8.1f Mtexels/s%s\n", kernel.name, rate / 1e6, match ? "" : "  MISMATCH");
+    }
+
+    free(indices);
+    free(expected);
+    free(out);
+    return ok;
+}
+
+// the cpu half of a load, enough for anything that does not draw
+static bool loadMapData(const char *map_path, map_build *build) {
+    if (!map_path) {
+        SDL_Log("this benchmark needs a map\n");
+        return false;
+    }
+    if (!arenaInit(&loaded_map.memory) || !arenaInit(&loaded_map.scratch)) return false;
+
+    bsp_file bsp;
+    if (!loadBinaryFile(map_path, &loaded_map.file) || !openBSP(loaded_map.file, &bsp) || !mapInitBSP(bsp)) {
+        SDL_Log("failed to load %s\n", map_path);
+        mapRelease();
+        return false;
+    }
+    mapAssignTextureSlots();
+    *build = {};
+    mapBuildMeshes(build);
+    mapInitVisibility();
+    return true;
+}
+
+static void timeDynamicLights(const glm::vec3 *centers, int num_lights) {
+    const dynamic_lightmap &dl = loaded_map.dlights;
+    int num_frames = 0;
+    int64_t num_lit = 0;
+    int64_t num_dirty = 0;
+    int64_t num_rects = 0;
+    int64_t num_luxels = 0;
+    uint64_t start = SDL_GetPerformanceCounter();
+    do {
+        dynamic_light lights[MAP_MAX_DYNAMIC_LIGHTS];
+        float t = (float)num_frames / 60.0f;
+        for (int i = 0; i < num_lights; i++) {
+            float angle = t * 2.0f + (float)i;
+            lights[i].origin = centers[i] + glm::vec3(cosf(angle), sinf(angle), 0.0f) * 64.0f;
+            lights[i].radius = 250.0f;
+        }
+        mapUpdateDynamicLights(lights, num_lights);
+
+        num_frames++;
+        num_lit += dl.num_lit[0];
+        num_dirty += dl.num_dirty;
+        num_rects += dl.num_rects;
+        for (int i = 0; i < dl.num_rects; i++) {
+            num_luxels += (int64_t)dl.rects[i].width * dl.rects[i].height;
+        }
+    } while (secondsSince(start) < BENCH_MIN_SECONDS);
+    double seconds = secondsSince(start);
+
+    double atlas_kb = (double)dl.width * dl.height * dl.num_pages / 1024.0;
+    SDL_Log("dlights %2d lights %8.1f us/frame, %5.0f surfaces lit, %5.0f blocks in %4.0f uploads, %5.1f of %.1f KB\n",
+            num_lights, seconds * 1e6 / num_frames, (double)num_lit / num_frames, (double)num_dirty / num_frames,
+            (double)num_rects / num_frames, (double)num_luxels / num_frames / 1024.0, atlas_kb);
+}
+
+// lights circling just in front of random surfaces, up to 32 like a busy
+// fight, the cost should follow the surfaces lit and not the map
+static bool benchDynamicLights(const char *map_path) {
+    map_build build;
+    if (!loadMapData(map_path, &build)) return false;
+    mapInitDynamicLights(build.lightmap_width, build.lightmap_height, build.num_lightmap_pages);
+
+    glm::vec3 centers[MAP_MAX_DYNAMIC_LIGHTS];
+    uint32_t seed = 1;
+    for (int i = 0; i < MAP_MAX_DYNAMIC_LIGHTS; i++) {
+        const surface &surf = loaded_map.surfaces[nextRandom(&seed) % loaded_map.num_surfaces];
+        const map_face &face = loaded_map.faces[surf.face];
+        const bsp_plane &plane = loaded_map.planes[face.plane];
+        glm::vec3 normal = face.side ? -plane.normal : plane.normal;
+        centers[i] = loaded_map.vertices[getVertexFromEdge(face.first_edge)] + normal * 32.0f;
+    }
+
+    SDL_Log("dlights %s, %d surfaces\n", map_path, loaded_map.num_surfaces);
+    const int light_counts[] = { 1, 4, 8, 16, MAP_MAX_DYNAMIC_LIGHTS };
+    for (int num_lights : light_counts) {
+        timeDynamicLights(centers, num_lights);
+    }
+    // none at all only pays for clearing what the last frame lit
+    timeDynamicLights(centers, 0);
+
+    mapRelease();
+    return true;
+}
+
+static void logMeshLayout(const char *name, int64_t num_verts, int64_t num_indices, int64_t transforms, int64_t num_tris) {
+    double vbo_kb = (double)(num_verts * sizeof(vertex)) / 1024.0;
+    double ibo_kb = (double)(num_indices * sizeof(uint32_t)) / 1024.0;
+    SDL_Log("mesh %-16s %7lld vertices %8.1f KB vbo %7.1f KB ibo %7lld vertex shader runs, %.3f per triangle\n", name,
+            (long long)num_verts, vbo_kb, ibo_kb, (long long)transforms, (double)transforms / (double)num_tris);
+}
+
+// what the world geometry costs to store and transform, the old expanded
+// triangle list and plain face fans are worked out from the surfaces
+static bool benchMesh(const char *map_path) {
+    map_build build;
+    if (!loadMapData(map_path, &build)) return false;
+
+    int64_t num_tris = build.num_indices / 3;
+    int64_t num_corners = 0;
+    for (int i = 0; i < loaded_map.num_surfaces; i++) {
+        num_corners += loaded_map.faces[loaded_map.surfaces[i].face].edge_count;
+    }
+
+    SDL_Log("mesh %s, %d surfaces, %lld triangles\n", map_path, loaded_map.num_surfaces, (long long)num_tris);
+    logMeshLayout("triangle list", num_tris * 3, 0, num_tris * 3, num_tris);
+    // a fan touches each of its corners on consecutive triangles
+    logMeshLayout("face fans", num_corners, build.num_indices, num_corners, num_tris);
+    const int cache_sizes[] = { 8, 16, VCACHE_SIZE };
+    for (int cache_size : cache_sizes) {
+        char name[32];
+        snprintf(name, sizeof(name), "optimized/%d", cache_size);
+        int64_t transforms = simulateVertexCache(build.indices, build.num_indices, build.num_verts, cache_size, &loaded_map.scratch);
+        logMeshLayout(name, build.num_verts, build.num_indices, transforms, num_tris);
+    }
+
+    mapRelease();
+    return true;
+}
+
+static void logVertexFormat(const char *name, int vertex_size, int64_t num_verts, int64_t transforms) {
+    SDL_Log("vertex %-7s %2d bytes, %8.1f KB vbo, %8.1f KB fetched per full draw\n", name, vertex_size,
+            (double)(num_verts * vertex_size) / 1024.0, (double)(transforms * vertex_size) / 1024.0);
+}
+
+// a warm load uploads what the cache hands back, so the build goes through
+// a cache file of its own and has to come back the same. textures are not
+// built here and are left out
+static bool checkCacheRoundTrip(const char *name, const map_build &build) {
+    map_build cold = build;
+    cold.num_textures = loaded_map.miptex_lump->miptex_count;
+    cold.textures = arenaPush<texture_data>(&loaded_map.scratch, cold.num_textures);
+    uint64_t cache_key = hashMemory(loaded_map.file.data, loaded_map.file.size) ^ ((uint64_t)build.format + 1) * 0x62656e6368ull;
+
+    mapped_file file;
+    map_build warm;
+    if (!writeMapCache(cache_key, loaded_map.file.size, &cold) ||
+        !openMapCache(cache_key, loaded_map.file.size, &file, &warm)) {
+        SDL_Log("vertex %-7s cache round trip failed\n", name);
+        removeMapCache(cache_key);
+        return false;
+    }
+    bool ok = warm.format == cold.format && warm.num_verts == cold.num_verts && warm.num_indices == cold.num_indices &&
+              warm.position_offset == cold.position_offset && warm.position_scale == cold.position_scale &&
+              memcmp(warm.verts, cold.verts, (size_t)getVertexSize(cold.format) * cold.num_verts) == 0 &&
+              memcmp(warm.indices, cold.indices, sizeof(uint32_t) * cold.num_indices) == 0;
+    SDL_Log("vertex %-7s cache round trip %s\n", name, ok ? "matches" : "differs from the cold build");
+    unmapFile(&file);
+    removeMapCache(cache_key);
+    return ok;
+}
+
+// what packing saves in vertex memory and traffic and what it costs in
+// precision, a draw of the whole world fetches one vertex per shader run
+static bool benchVertexFormats(const char *map_path) {
+    map_build build;
+    if (!loadMapData(map_path, &build)) return false;
+
+    int64_t transforms = simulateVertexCache(build.indices, build.num_indices, build.num_verts, VCACHE_SIZE, &loaded_map.scratch);
+    SDL_Log("vertex %s, %d vertices, %lld vertex shader runs\n", map_path, build.num_verts, (long long)transforms);
+    logVertexFormat("full", getVertexSize(VERTEX_FORMAT_FULL), build.num_verts, transforms);
+    bool ok = checkCacheRoundTrip("full", build);
+
+    const vertex *verts = (const vertex *)build.verts;
+    if (!mapPackVertices(&build)) {
+        SDL_Log("vertex packed does not fit this map\n");
+        mapRelease();
+        return ok;
+    }
+    logVertexFormat("packed", getVertexSize(VERTEX_FORMAT_PACKED), build.num_verts, transforms);
+    ok = checkCacheRoundTrip("packed", build) && ok;
+
+    const packed_vertex *packed = (const packed_vertex *)build.verts;
+    float max_position_error = 0.0f;
+    float max_texcoord_error = 0.0f;
+    float max_lightmap_error = 0.0f;
+    for (int i = 0; i < build.num_verts; i++) {
+        const vertex &v = verts[i];
+        const packed_vertex &p = packed[i];
+        for (int j = 0; j < 3; j++) {
+            float pos = build.position_offset[j] + (float)p.pos[j] * build.position_scale;
+            max_position_error = fmaxf(max_position_error, fabsf(pos - v.pos[j]));
+        }
+        for (int j = 0; j < 2; j++) {
+            float texcoord = (float)p.texcoord[j] / PACKED_TEXCOORD_STEPS;
+            float lightmap = (float)p.lightmap[j] / 65535.0f;
+            int lightmap_size = j == 0 ? build.lightmap_width : build.lightmap_height;
+            max_texcoord_error = fmaxf(max_texcoord_error, fabsf(texcoord - v.texcoord[j]));
+            max_lightmap_error = fmaxf(max_lightmap_error, fabsf(lightmap - v.lightmap[j]) * lightmap_size);
+        }
+    }
+    SDL_Log("vertex packed error at most %.4f units, %.4f texels, %.4f luxels\n", max_position_error, max_texcoord_error, max_lightmap_error);
+
+    mapRelease();
+    return ok;
+}
+
+// somewhere in the bounds of a random leaf other than the shared solid one
+static glm::vec3 randomLeafPoint(uint32_t *seed) {
+    const map_leaf &leaf = loaded_map.leafs[1 + nextRandom(seed) % (loaded_map.num_leafs - 1)];
+    glm::vec3 min = glm::vec3(leaf.min[0], leaf.min[1], leaf.min[2]);
+    glm::vec3 max = glm::vec3(leaf.max[0], leaf.max[1], leaf.max[2]);
+    return min + (max - min) * glm::vec3(nextRandom(seed), nextRandom(seed), nextRandom(seed)) / 16777216.0f;
+}
+
+static double timeTraces(trace_batch_fn fn, const trace_request *requests, int count, trace_result *results) {
+    int64_t traces = 0;
+    uint64_t start = SDL_GetPerformanceCounter();
+    do {
+        fn(requests, count, results);
+        traces += count;
+    } while (secondsSince(start) < BENCH_MIN_SECONDS);
+    return (double)traces / secondsSince(start);
+}
+
+static int countTraceMismatches(const trace_result *expected, const trace_result *results, int count, float *max_error) {
+    int num_mismatches = 0;
+    for (int i = 0; i < count; i++) {
+        const trace_result &a = expected[i];
+        const trace_result &b = results[i];
+        float error = fabsf(a.fraction - b.fraction);
+        *max_error = fmaxf(*max_error, error);
+        if (error > 1e-3f || a.all_solid != b.all_solid || a.start_solid != b.start_solid || a.contents != b.contents ||
+            (a.fraction < 1.0f && !a.all_solid && glm::dot(a.normal, b.normal) < 0.999f)) {
+            num_mismatches++;
+        }
+    }
+    return num_mismatches;
+}
+
+// shots, sight lines and bot moves from random open spots, up to 512 units
+// long in any direction and spread over all three hulls
+static bool benchTraces(const char *map_path) {
+    map_build build;
+    if (!loadMapData(map_path, &build)) return false;
+
+    const int count = 16384;
+    trace_request *requests = (trace_request *)malloc(sizeof(trace_request) * count);
+    trace_result *expected = (trace_result *)malloc(sizeof(trace_result) * count);
+    trace_result *results = (trace_result *)malloc(sizeof(trace_result) * count);
+    uint32_t seed = 1;
+    for (int i = 0; i < count; i++) {
+        int hull = i % 3;
+        glm::vec3 start;
+        // most of a map's bounds is solid, so start inside a random open leaf.
+        // tries are bounded in case a hull has no open space at all
+        for (int tries = 0; tries < 1000; tries++) {
+            start = randomLeafPoint(&seed);
+            if (hullPointContents(start, hull) != BSP_CONTENTS_SOLID) break;
+        }
+        glm::vec3 dir = glm::vec3(nextRandom(&seed), nextRandom(&seed), nextRandom(&seed)) / 8388608.0f - 1.0f;
+        requests[i] = { start, start + dir * 512.0f, glm::vec3(0.0f), hull };
+    }
+
+    traceHullBatchGeneric(requests, count, expected);
+    traceHullBatch(requests, count, results);
+    int num_hits = 0;
+    for (int i = 0; i < count; i++) {
+        num_hits += expected[i].fraction < 1.0f;
+    }
+    float max_error = 0.0f;
+    int num_mismatches = countTraceMismatches(expected, results, count, &max_error);
+
+    // servers trace from worker threads with far smaller stacks than main
+    memset(results, 0, sizeof(trace_result) * count);
+    std::thread worker(traceHullBatch, requests, count, results);
+    worker.join();
+    float worker_error = 0.0f;
+    int worker_mismatches = countTraceMismatches(expected, results, count, &worker_error);
+    SDL_Log("trace on a worker thread: %d mismatches\n", worker_mismatches);
+
+    SDL_Log("trace %s, %d traces, %d hit something\n", map_path, count, num_hits);
+    double scalar_rate = timeTraces(traceHullBatchGeneric, requests, count, results);
+    SDL_Log("trace %-8s %8.2f Mtraces/s\n", "scalar", scalar_rate / 1e6);
+    double batch_rate = timeTraces(traceHullBatch, requests, count, results);
+    SDL_Log("trace %-8s %8.2f Mtraces/s, %.2fx, %d mismatches, fraction off by at most %g\n", getTraceKernelName(),
+            batch_rate / 1e6, batch_rate / scalar_rate, num_mismatches, max_error);
+
+    free(requests);
+    free(expected);
+    free(results);
+    mapRelease();
+    return num_mismatches == 0 && worker_mismatches == 0;
+}
+
+// a 32 KB 8 way data cache with 64 byte lines, what a walk would miss in
+// l1 if nothing else ran. walks feed it the addresses they load. small maps
+// fit in it whole, so the lines of each walk are also counted as if it
+// started cold
+#define CACHE_SIM_SETS 64
+#define CACHE_SIM_WAYS 8
+#define CACHE_SIM_WALK_LINES 256
+
+struct cache_sim {
+    uintptr_t lines[CACHE_SIM_SETS][CACHE_SIM_WAYS];
+    uint64_t stamps[CACHE_SIM_SETS][CACHE_SIM_WAYS];
+    uint64_t clock;
+    int64_t misses;
+    uintptr_t walk_lines[CACHE_SIM_WALK_LINES];
+    int32_t num_walk_lines;
+    int64_t cold_lines;
+};
+
+static void touchCache(cache_sim *sim, const void *address) {
+    uintptr_t line = (uintptr_t)address >> 6;
+    bool seen = false;
+    for (int i = 0; i < sim->num_walk_lines && !seen; i++) {
+        seen = sim->walk_lines[i] == line;
+    }
+    if (!seen && sim->num_walk_lines < CACHE_SIM_WALK_LINES) {
+        sim->walk_lines[sim->num_walk_lines++] = line;
+        sim->cold_lines++;
+    }
+
+    uintptr_t *lines = sim->lines[line % CACHE_SIM_SETS];
+    uint64_t *stamps = sim->stamps[line % CACHE_SIM_SETS];
+    int oldest = 0;
+    sim->clock++;
+    for (int i = 0; i < CACHE_SIM_WAYS; i++) {
+        if (lines[i] == line + 1) {
+            stamps[i] = sim->clock;
+            return;
+        }
+        if (stamps[i] < stamps[oldest]) oldest = i;
+    }
+    // lines are stored plus one so an empty way never matches
+    lines[oldest] = line + 1;
+    stamps[oldest] = sim->clock;
+    sim->misses++;
+}
+
+// the walk before the collision trees, render nodes or clipnodes with the
+// plane one more load away in the plane lump
+static int filePointContents(const glm::vec3 &point, int hull, cache_sim *sim, int64_t *num_nodes) {
+    const map &m = loaded_map;
+    if (sim) sim->num_walk_lines = 0;
+    int node_idx = m.models[0].head_nodes[hull];
+    while (node_idx >= 0) {
+        int plane_idx = hull == MAP_HULL_POINT ? m.nodes[node_idx].plane : m.clipnodes[node_idx].plane;
+        const bsp_plane &plane = m.planes[plane_idx];
+        float dist = plane.type < 3 ? point[plane.type] - plane.dist : glm::dot(point, plane.normal) - plane.dist;
+        int side = dist < 0.0f ? 1 : 0;
+        if (hull == MAP_HULL_POINT) {
+            if (sim) {
+                touchCache(sim, &m.nodes[node_idx]);
+                touchCache(sim, &plane);
+            }
+            node_idx = m.nodes[node_idx].children[side];
+            if (node_idx < 0) {
+                if (sim) touchCache(sim, &m.leafs[~node_idx]);
+                node_idx = m.leafs[~node_idx].contents;
+            }
+        } else {
+            if (sim) {
+                touchCache(sim, &m.clipnodes[node_idx]);
+                touchCache(sim, &plane);
+            }
+            node_idx = m.clipnodes[node_idx].children[side];
+        }
+        if (num_nodes) (*num_nodes)++;
+    }
+    return node_idx;
+}
+
+// the same walk as hullPointContents, only counted
+static void walkCollision(const glm::vec3 &point, const collision_hull &hull, cache_sim *sim, int64_t *num_nodes) {
+    int node_idx = hull.head;
+    sim->num_walk_lines = 0;
+    while (node_idx >= 0) {
+        const collision_node &node = hull.nodes[node_idx];
+        touchCache(sim, &node);
+        float dist = glm::dot(point, node.normal) - node.dist;
+        node_idx = node.children[dist < 0.0f ? 1 : 0];
+        (*num_nodes)++;
+    }
+}
+
+struct collision_points {
+    glm::vec3 *points;
+    int32_t *hulls;
+    int count;
+};
+
+// seconds spent on one pass over the points, the best of enough passes
+static double timePointContents(const collision_points &q, bool file_order, int *checksum) {
+    double best = 1e9;
+    uint64_t start = SDL_GetPerformanceCounter();
+    do {
+        uint64_t pass_start = SDL_GetPerformanceCounter();
+        int sum = 0;
+        for (int i = 0; i < q.count; i++) {
+            sum += file_order ? filePointContents(q.points[i], q.hulls[i], 0, 0) : hullPointContents(q.points[i], q.hulls[i]);
+        }
+        best = glm::min(best, secondsSince(pass_start));
+        *checksum = sum;
+    } while (secondsSince(start) < BENCH_MIN_SECONDS);
+    return best;
+}
+
+static double timeHullTraces(const trace_request *requests, int count) {
+    double best = 1e9;
+    uint64_t start = SDL_GetPerformanceCounter();
+    do {
+        uint64_t pass_start = SDL_GetPerformanceCounter();
+        for (int i = 0; i < count; i++) {
+            traceHull(requests[i].start, requests[i].end, requests[i].hull);
+        }
+        best = glm::min(best, secondsSince(pass_start));
+    } while (secondsSince(start) < BENCH_MIN_SECONDS);
+    return best;
+}
+
+// point queries and traces over the plane lump walk and both collision tree
+// orders. misses come from the cache model, not from hardware counters
+static bool benchCollision(const char *map_path) {
+    map_build build;
+    if (!loadMapData(map_path, &build)) return false;
+
+    collision_points q;
+    q.count = 65536;
+    q.points = (glm::vec3 *)malloc(sizeof(glm::vec3) * q.count);
+    q.hulls = (int32_t *)malloc(sizeof(int32_t) * q.count);
+    const int num_traces = 16384;
+    trace_request *requests = (trace_request *)malloc(sizeof(trace_request) * num_traces);
+    uint32_t seed = 1;
+    for (int i = 0; i < q.count; i++) {
+        q.points[i] = randomLeafPoint(&seed);
+        q.hulls[i] = i % MAP_NUM_COLLISION_HULLS;
+    }
+    for (int i = 0; i < num_traces; i++) {
+        glm::vec3 dir = glm::vec3(nextRandom(&seed), nextRandom(&seed), nextRandom(&seed)) / 8388608.0f - 1.0f;
+        requests[i] = { q.points[i], q.points[i] + dir * 512.0f, glm::vec3(0.0f), q.hulls[i] };
+    }
+
+    collision_hull trees[2][MAP_NUM_COLLISION_HULLS];
+    const char *order_names[2] = { "depth", "veb" };
+    collision_hull loaded[MAP_NUM_COLLISION_HULLS];
+    memcpy(loaded, loaded_map.collision, sizeof(loaded));
+    for (int order = 0; order < 2; order++) {
+        for (int hull = 0; hull < MAP_NUM_COLLISION_HULLS; hull++) {
+            mapBuildCollisionHull(hull, (collision_order)order, &loaded_map.memory, &trees[order][hull]);
+        }
+    }
+
+    SDL_Log("collision %s, %d nodes, %d clipnodes, %d point queries, %d traces\n", map_path, loaded_map.num_nodes,
+            loaded_map.num_clipnodes, q.count, num_traces);
+    cache_sim *sim = (cache_sim *)calloc(1, sizeof(cache_sim));
+    int64_t num_nodes = 0;
+    for (int i = 0; i < q.count; i++) {
+        filePointContents(q.points[i], q.hulls[i], sim, &num_nodes);
+    }
+    int expected = 0;
+    double seconds = timePointContents(q, true, &expected);
+    SDL_Log("collision %-6s %6.2f Mqueries/s %7.2f Mnodes/s, per query %.2f nodes %.2f cold lines %.3f l1 misses\n", "file",
+            q.count / seconds / 1e6, num_nodes / seconds / 1e6, (double)num_nodes / q.count,
+            (double)sim->cold_lines / q.count, (double)sim->misses / q.count);
+
+    bool ok = true;
+    for (int order = 0; order < 2; order++) {
+        memcpy(loaded_map.collision, trees[order], sizeof(loaded_map.collision));
+        memset(sim, 0, sizeof(cache_sim));
+        num_nodes = 0;
+        for (int i = 0; i < q.count; i++) {
+            walkCollision(q.points[i], trees[order][q.hulls[i]], sim, &num_nodes);
+        }
+        int checksum = 0;
+        seconds = timePointContents(q, false, &checksum);
+        double trace_seconds = timeHullTraces(requests, num_traces);
+        SDL_Log("collision %-6s %6.2f Mqueries/s %7.2f Mnodes/s, per query %.2f nodes %.2f cold lines %.3f l1 misses, %.2f Mtraces/s\n",
+                order_names[order], q.count / seconds / 1e6, num_nodes / seconds / 1e6, (double)num_nodes / q.count,
+                (double)sim->cold_lines / q.count, (double)sim->misses / q.count, num_traces / trace_seconds / 1e6);
+        if (checksum != expected) {
+            SDL_Log("collision %s contents differ from the file walk\n", order_names[order]);
+            ok = false;
+        }
+    }
+    memcpy(loaded_map.collision, loaded, sizeof(loaded));
+
+    free(sim);
+    free(q.points);
+    free(q.hulls);
+    free(requests);
+    mapRelease();
+    return ok;
+}
+
+// seconds for one pass over the points, the best of enough passes. with
+// hints every query gets the leaf of the one before
+static double timeFindLeaf(const glm::vec3 *points, int count, bool hinted, int *checksum) {
+    double best = 1e9;
+    uint64_t start = SDL_GetPerformanceCounter();
+    do {
+        uint64_t pass_start = SDL_GetPerformanceCounter();
+        int sum = 0;
+        int leaf_idx = -1;
+        for (int i = 0; i < count; i++) {
+            leaf_idx = findLeaf(points[i], hinted ? leaf_idx : -1);
+            sum += leaf_idx;
+        }
+        best = glm::min(best, secondsSince(pass_start));
+        *checksum = sum;
+    } while (secondsSince(start) < BENCH_MIN_SECONDS);
+    return best;
+}
+
+// random points all over the map against a player's worth of walking, a
+// few units per query through open space
+static bool benchLeafQueries(const char *map_path) {
+    map_build build;
+    if (!loadMapData(map_path, &build)) return false;
+
+    const int count = 65536;
+    glm::vec3 *random_points = (glm::vec3 *)malloc(sizeof(glm::vec3) * count);
+    glm::vec3 *path_points = (glm::vec3 *)malloc(sizeof(glm::vec3) * count);
+    uint32_t seed = 1;
+    for (int i = 0; i < count; i++) {
+        random_points[i] = randomLeafPoint(&seed);
+    }
+    glm::vec3 pos = random_points[0];
+    glm::vec3 dir = glm::vec3(1.0f, 0.0f, 0.0f);
+    for (int tries = 0; tries < 1000 && pointContents(pos) == BSP_CONTENTS_SOLID; tries++) {
+        pos = randomLeafPoint(&seed);
+    }
+    for (int i = 0; i < count; i++) {
+        // 320 units a second at 72 ticks, a new heading at walls and now and then
+        glm::vec3 next = pos + dir * 4.4f;
+        if (nextRandom(&seed) % 64 == 0 || pointContents(next) == BSP_CONTENTS_SOLID) {
+            dir = glm::vec3(nextRandom(&seed), nextRandom(&seed), nextRandom(&seed)) / 8388608.0f - 1.0f;
+            dir.z *= 0.1f;
+            dir = glm::normalize(dir + glm::vec3(0.0f, 0.0f, 1e-3f));
+        } else {
+            pos = next;
+        }
+        path_points[i] = pos;
+    }
+
+    int num_planes = 0;
+    int num_hinted_leaves = 0;
+    for (int i = 0; i < loaded_map.num_leafs; i++) {
+        if (loaded_map.leaf_hints[i].num_planes < 0) continue;
+        num_planes += loaded_map.leaf_hints[i].num_planes;
+        num_hinted_leaves++;
+    }
+    SDL_Log("leaf %s, %d leaves, %.2f planes to check per leaf\n", map_path, loaded_map.num_leafs,
+            (double)num_planes / glm::max(num_hinted_leaves, 1));
+
+    bool ok = true;
+    const char *pattern_names[2] = { "random", "walk" };
+    const glm::vec3 *patterns[2] = { random_points, path_points };
+    for (int pattern = 0; pattern < 2; pattern++) {
+        const glm::vec3 *points = patterns[pattern];
+        int num_mismatches = 0;
+        int num_reused = 0;
+        int hint_leaf = -1;
+        int contents_hint = -1;
+        for (int i = 0; i < count; i++) {
+            int leaf_idx = findLeaf(points[i]);
+            num_reused += leaf_idx == hint_leaf;
+            num_mismatches += findLeaf(points[i], hint_leaf) != leaf_idx;
+            num_mismatches += pointContents(points[i], &contents_hint) != hullPointContents(points[i], MAP_HULL_POINT);
+            hint_leaf = leaf_idx;
+        }
+        int plain_sum = 0;
+        int hinted_sum = 0;
+        double plain_seconds = timeFindLeaf(points, count, false, &plain_sum);
+        double hinted_seconds = timeFindLeaf(points, count, true, &hinted_sum);
+        SDL_Log("leaf %-6s %7.2f Mqueries/s from the root, %7.2f Mqueries/s hinted, %.2fx, same leaf %.1f%%, %d mismatches\n",
+                pattern_names[pattern], count / plain_seconds / 1e6, count / hinted_seconds / 1e6,
+                plain_seconds / hinted_seconds, 100.0 * num_reused / count, num_mismatches);
+        if (num_mismatches || plain_sum != hinted_sum) ok = false;
+    }
+
+    free(random_points);
+    free(path_points);
+    mapRelease();
+    return ok;
+}
+
+static const bench_case bench_cases[] = {
+    { "palette", benchPalette },
+    { "dlights", benchDynamicLights },
+    { "mesh", benchMesh },
+    { "vertex", benchVertexFormats },
+    { "trace", benchTraces },
+    { "collision", benchCollision },
+    { "leaf", benchLeafQueries },
+};
+
+bool runBenchmark(const char *name, const char *map_path) {
+    for (const bench_case &bench : bench_cases) {
+        if (strcmp(bench.name, name) == 0) return bench.run(map_path);
+    }
+    SDL_Log("unknown benchmark %s, available:\n", name);
+    for (const bench_case &bench : bench_cases) {
+        SDL_Log("  %s\n", bench.name);
+    }
+    return false;
+}
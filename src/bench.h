@@ -0,0 +1,4 @@
+#pragma once
+
+// microbenchmarks for the hot loops, run with -bench <name> instead of the game
+bool runBenchmark(const char *name, const char *map_path);
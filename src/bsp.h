@@ -19,6 +19,11 @@
 
 #define BSP_LUMP_COUNT          15
 
+#define BSP_VERSION             29
+// bsp29 with 32 bit indices, "BSP2" has float bounds, "2PSB" int16 bounds
+#define BSP2_VERSION            (('2' << 24) | ('P' << 16) | ('S' << 8) | 'B')
+#define BSP2_VERSION_2PSB       (('B' << 24) | ('S' << 16) | ('P' << 8) | '2')
+
 #define BSP_CONTENTS_EMPTY      -1
 #define BSP_CONTENTS_SOLID      -2
 #define BSP_CONTENTS_WATER      -3
@@ -89,7 +94,7 @@ struct bsp_node {
 
 struct bsp_clip_node {
     int32_t plane;
-    int32_t children[2];
+    int16_t children[2];
 };
 
 struct bsp_texinfo {
@@ -122,3 +127,60 @@ struct bsp_leaf {
     uint16_t mark_surface_count;
     uint8_t ambient_level[4];
 };
+
+// bsp2 and 2psb lumps, everything else is shared with bsp29
+
+struct bsp2rmq_node {
+    int32_t plane;
+    int32_t children[2];
+    int16_t min[3];
+    int16_t max[3];
+    uint32_t first_face;
+    uint32_t face_count;
+};
+
+struct bsp2_node {
+    int32_t plane;
+    int32_t children[2];
+    float min[3];
+    float max[3];
+    uint32_t first_face;
+    uint32_t face_count;
+};
+
+struct bsp2_clip_node {
+    int32_t plane;
+    int32_t children[2];
+};
+
+typedef uint32_t bsp2_edge[2];
+
+struct bsp2_face {
+    int32_t plane;
+    int32_t side;
+    int32_t first_edge;
+    int32_t edge_count;
+    int32_t texinfo;
+    uint8_t styles[MAXLIGHTMAPS];
+    int32_t light_offset;
+};
+
+struct bsp2rmq_leaf {
+    int32_t contents;
+    int32_t visoffset;
+    int16_t min[3];
+    int16_t max[3];
+    uint32_t first_mark_surface;
+    uint32_t mark_surface_count;
+    uint8_t ambient_level[4];
+};
+
+struct bsp2_leaf {
+    int32_t contents;
+    int32_t visoffset;
+    float min[3];
+    float max[3];
+    uint32_t first_mark_surface;
+    uint32_t mark_surface_count;
+    uint8_t ambient_level[4];
+};
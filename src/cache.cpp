@@ -0,0 +1,339 @@
+#include "cache.h"
+#include "map.h"
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+
+// baked results of mapBuildTexture and mapBuildMeshes, laid out so that a
+// cache hit can hand pointers into the mapped file straight to the uploader
+#define MAP_CACHE_MAGIC (('H' << 24) | ('C' << 16) | ('P' << 8) | 'B')
+#define MAP_CACHE_ALIGN 16
+
+struct cache_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t cache_key;
+    uint64_t bsp_size;
+    int32_t num_textures;
+    int32_t num_batches;
+    int32_t num_surfaces;
+    int32_t lightmap_width;
+    int32_t lightmap_height;
+    int32_t num_lightmap_pages;
+    int32_t vertex_format;
+    int32_t num_verts;
+    int32_t num_indices;
+    int32_t num_surface_infos;
+    float position_offset[3]; // world_mesh_mtx, identity for full vertices
+    float position_scale;
+    uint64_t textures_offset;
+    uint64_t surfaces_offset;
+    uint64_t lightmap_offset;
+    uint64_t verts_offset;
+    uint64_t indices_offset;
+    uint64_t surface_infos_offset;
+};
+
+struct cache_texture {
+    int32_t width;
+    int32_t height;
+    int32_t num_levels;
+    int32_t texel_size;
+    uint64_t offset; // 0 when the miptex had nothing to upload
+    uint64_t size;
+};
+
+uint64_t hashMemory(const void *data, size_t size) {
+    // four independent lanes keep the multiplies pipelined, this is not
+    // cryptographic, it only has to notice that a bsp changed
+    const uint64_t k = 0x9e3779b97f4a7c15ull;
+    uint64_t lanes[4] = { k, k ^ 1, k ^ 2, k ^ 3 };
+    const uint8_t *bytes = (const uint8_t *)data;
+
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32) {
+        for (int j = 0; j < 4; j++) {
+            uint64_t word;
+            memcpy(&word, bytes + i + j * 8, sizeof(word));
+            lanes[j] = (lanes[j] ^ word) * k;
+            lanes[j] ^= lanes[j] >> 32;
+        }
+    }
+
+    uint64_t h = (uint64_t)size;
+    for (int j = 0; j < 4; j++) {
+        h = (h ^ lanes[j]) * k;
+        h ^= h >> 29;
+    }
+    for (; i < size; i++) {
+        h = (h ^ bytes[i]) * 0x100000001b3ull;
+    }
+
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    return h;
+}
+
+static std::string cachePath(uint64_t cache_key) {
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.bpc", (unsigned long long)cache_key);
+    return std::string(MAP_CACHE_DIR) + "/" + name;
+}
+
+static uint64_t lightmapSize(const cache_header *header) {
+    return (uint64_t)header->lightmap_width * header->lightmap_height * header->num_lightmap_pages * LIGHTMAP_CHANNELS;
+}
+
+static uint64_t vertsSize(const cache_header *header) {
+    return (uint64_t)getVertexSize((vertex_format)header->vertex_format) * header->num_verts;
+}
+
+static uint32_t getVertexInfo(const uint8_t *verts, vertex_format format, int i) {
+    if (format == VERTEX_FORMAT_PACKED) return ((const packed_vertex *)verts)[i].info;
+    return ((const vertex *)verts)[i].info;
+}
+
+static bool inFile(const mapped_file &file, uint64_t offset, uint64_t size) {
+    return offset <= file.size && size <= file.size - offset && offset % MAP_CACHE_ALIGN == 0;
+}
+
+bool openMapCache(uint64_t cache_key, uint64_t bsp_size, mapped_file *out_file, map_build *out) {
+    std::string path = cachePath(cache_key);
+    mapped_file file;
+    if (!mapFile(path.c_str(), &file)) return false;
+
+    const cache_header *header = (const cache_header *)file.data;
+    bool ok = file.size >= sizeof(cache_header) &&
+              header->magic == MAP_CACHE_MAGIC &&
+              header->version == MAP_CACHE_VERSION &&
+              header->cache_key == cache_key &&
+              header->bsp_size == bsp_size &&
+              header->num_textures == loaded_map.miptex_lump->miptex_count &&
+              header->num_batches == loaded_map.num_batches &&
+              header->num_surfaces >= 0 && header->num_surfaces <= loaded_map.num_faces &&
+              header->lightmap_width > 0 && header->lightmap_width <= LIGHTMAP_WIDTH &&
+              header->lightmap_height > 0 && header->lightmap_height <= LIGHTMAP_HEIGHT &&
+              header->num_lightmap_pages > 0 && header->num_lightmap_pages <= LIGHTMAP_MAX_PAGES &&
+              (header->vertex_format == VERTEX_FORMAT_FULL || header->vertex_format == VERTEX_FORMAT_PACKED) &&
+              header->num_verts >= 0 && header->num_indices >= 0 &&
+              header->num_surface_infos > 0 && header->num_surface_infos % MAP_SURFACE_INFO_ROW == 0 &&
+              std::isfinite(header->position_offset[0]) && std::isfinite(header->position_offset[1]) &&
+              std::isfinite(header->position_offset[2]) && std::isfinite(header->position_scale) && header->position_scale > 0.0f &&
+              inFile(file, header->textures_offset, sizeof(cache_texture) * (uint64_t)header->num_textures) &&
+              inFile(file, header->surfaces_offset, sizeof(surface) * (uint64_t)header->num_surfaces) &&
+              inFile(file, header->lightmap_offset, lightmapSize(header)) &&
+              inFile(file, header->verts_offset, vertsSize(header)) &&
+              inFile(file, header->indices_offset, sizeof(uint32_t) * (uint64_t)header->num_indices) &&
+              inFile(file, header->surface_infos_offset, sizeof(surface_info) * (uint64_t)header->num_surface_infos);
+
+    const cache_texture *textures = ok ? (const cache_texture *)(file.data + header->textures_offset) : 0;
+    const surface *surfaces = ok ? (const surface *)(file.data + header->surfaces_offset) : 0;
+    const uint32_t *indices = ok ? (const uint32_t *)(file.data + header->indices_offset) : 0;
+    const surface_info *surface_infos = ok ? (const surface_info *)(file.data + header->surface_infos_offset) : 0;
+
+    for (int i = 0; ok && i < header->num_textures; i++) {
+        const cache_texture &tex = textures[i];
+        if (tex.offset == 0) continue;
+        ok = tex.width > 0 && tex.height > 0 &&
+             tex.num_levels > 0 && tex.num_levels <= getNumMipLevels(tex.width, tex.height) &&
+             tex.texel_size == (loaded_map.paletted ? 1 : (int32_t)sizeof(color)) &&
+             tex.size == (uint64_t)tex.texel_size * getMipChainTexels(tex.width, tex.height, tex.num_levels) &&
+             inFile(file, tex.offset, tex.size);
+    }
+
+    // an index past the vertices would have the gpu read out of bounds
+    for (int i = 0; ok && i < header->num_indices; i++) {
+        ok = indices[i] < (uint32_t)header->num_verts;
+    }
+
+    // the shader indexes the style values and the atlas pages with these
+    for (int i = 0; ok && i < header->num_verts; i++) {
+        ok = getVertexInfo(file.data + header->verts_offset, (vertex_format)header->vertex_format, i) < (uint32_t)header->num_surface_infos;
+    }
+    for (int i = 0; ok && i < header->num_surface_infos; i++) {
+        const surface_info &info = surface_infos[i];
+        ok = info.lightmap_page < header->num_lightmap_pages;
+        for (int j = 0; ok && j < MAXLIGHTMAPS; j++) {
+            ok = info.styles[j] < MAP_MAX_LIGHTSTYLES;
+        }
+    }
+
+    for (int i = 0; ok && i < header->num_surfaces; i++) {
+        const surface &surf = surfaces[i];
+        ok = surf.face >= 0 && surf.face < loaded_map.num_faces &&
+             surf.lightmap_page >= -1 && surf.lightmap_page < header->num_lightmap_pages &&
+             surf.lightmap_offset.x >= 0 && surf.lightmap_offset.x < header->lightmap_width &&
+             surf.lightmap_offset.y >= 0 && surf.lightmap_offset.y < header->lightmap_height;
+        ok = ok && surf.batch >= 0 && surf.batch < header->num_batches &&
+             surf.num_indices >= 0 && surf.first_index >= 0 &&
+             (int64_t)surf.first_index + surf.num_indices <= header->num_indices;
+        // dynamic lights rewrite the whole padded block
+        if (ok && surf.lightmap_page >= 0) {
+            int64_t right = (int64_t)surf.lightmap_offset.x + (surf.uv_extents.s >> 4) + 1 + LIGHTMAP_PADDING;
+            int64_t bottom = (int64_t)surf.lightmap_offset.y + (surf.uv_extents.t >> 4) + 1 + LIGHTMAP_PADDING;
+            ok = surf.uv_extents.s >= 0 && surf.uv_extents.t >= 0 &&
+                 surf.lightmap_offset.x >= LIGHTMAP_PADDING && surf.lightmap_offset.y >= LIGHTMAP_PADDING &&
+                 right <= header->lightmap_width && bottom <= header->lightmap_height;
+        }
+    }
+
+    // the surfaces sharing a range start add up to the range
+    if (ok) {
+        int64_t *range_sizes = arenaPush<int64_t>(&loaded_map.scratch, header->num_indices + 1);
+        for (int i = 0; i < header->num_surfaces; i++) {
+            range_sizes[surfaces[i].first_index] += surfaces[i].num_indices;
+        }
+        for (int i = 0; ok && i < header->num_surfaces; i++) {
+            ok = surfaces[i].first_index + range_sizes[surfaces[i].first_index] <= header->num_indices;
+        }
+    }
+
+    if (!ok) {
+        std::cerr << "ignoring stale map cache " << path << std::endl;
+        unmapFile(&file);
+        return false;
+    }
+
+    *out = {};
+    out->from_cache = true;
+    out->num_textures = header->num_textures;
+    out->textures = arenaPush<texture_data>(&loaded_map.scratch, out->num_textures);
+    for (int i = 0; i < out->num_textures; i++) {
+        const cache_texture &tex = textures[i];
+        out->textures[i] = {};
+        if (tex.offset == 0) continue;
+        out->textures[i].width = tex.width;
+        out->textures[i].height = tex.height;
+        out->textures[i].num_levels = tex.num_levels;
+        out->textures[i].texel_size = tex.texel_size;
+        out->textures[i].pixels = (uint8_t *)(file.data + tex.offset);
+    }
+
+    out->format = (vertex_format)header->vertex_format;
+    out->num_verts = header->num_verts;
+    out->verts = (void *)(file.data + header->verts_offset);
+    out->num_indices = header->num_indices;
+    out->indices = (uint32_t *)(file.data + header->indices_offset);
+    out->num_surface_infos = header->num_surface_infos;
+    out->surface_infos = (surface_info *)(file.data + header->surface_infos_offset);
+    out->position_offset = glm::vec3(header->position_offset[0], header->position_offset[1], header->position_offset[2]);
+    out->position_scale = header->position_scale;
+
+    out->lightmap_width = header->lightmap_width;
+    out->lightmap_height = header->lightmap_height;
+    out->num_lightmap_pages = header->num_lightmap_pages;
+    out->lightmap = (uint8_t *)(file.data + header->lightmap_offset);
+
+    // the surface table is small and stays writable for the rest of the map
+    loaded_map.num_surfaces = header->num_surfaces;
+    loaded_map.surfaces = arenaPush<surface>(&loaded_map.memory, header->num_surfaces);
+    memcpy(loaded_map.surfaces, surfaces, sizeof(surface) * header->num_surfaces);
+
+    *out_file = file;
+    return true;
+}
+
+static uint64_t alignOffset(uint64_t offset) {
+    return (offset + MAP_CACHE_ALIGN - 1) & ~(uint64_t)(MAP_CACHE_ALIGN - 1);
+}
+
+static void writeAt(std::ofstream &out, uint64_t offset, const void *data, uint64_t size) {
+    out.seekp((std::streamoff)offset);
+    out.write((const char *)data, (std::streamsize)size);
+}
+
+bool writeMapCache(uint64_t cache_key, uint64_t bsp_size, const map_build *build) {
+    std::error_code err;
+    std::filesystem::create_directories(MAP_CACHE_DIR, err);
+    if (err) return false;
+
+    cache_header header = {};
+    header.magic = MAP_CACHE_MAGIC;
+    header.version = MAP_CACHE_VERSION;
+    header.cache_key = cache_key;
+    header.bsp_size = bsp_size;
+    header.num_textures = build->num_textures;
+    header.num_batches = loaded_map.num_batches;
+    header.num_surfaces = loaded_map.num_surfaces;
+    header.lightmap_width = build->lightmap_width;
+    header.lightmap_height = build->lightmap_height;
+    header.num_lightmap_pages = build->num_lightmap_pages;
+    header.vertex_format = build->format;
+    header.num_verts = build->num_verts;
+    header.num_indices = build->num_indices;
+    header.num_surface_infos = build->num_surface_infos;
+    for (int i = 0; i < 3; i++) {
+        header.position_offset[i] = build->position_offset[i];
+    }
+    header.position_scale = build->position_scale;
+
+    // lay out the tables first and the bulk data after them
+    uint64_t offset = alignOffset(sizeof(cache_header));
+    header.textures_offset = offset;
+    offset = alignOffset(offset + sizeof(cache_texture) * build->num_textures);
+    header.surfaces_offset = offset;
+    offset = alignOffset(offset + sizeof(surface) * loaded_map.num_surfaces);
+    header.lightmap_offset = offset;
+    offset = alignOffset(offset + lightmapSize(&header));
+    header.verts_offset = offset;
+    offset = alignOffset(offset + vertsSize(&header));
+    header.indices_offset = offset;
+    offset = alignOffset(offset + sizeof(uint32_t) * (uint64_t)build->num_indices);
+    header.surface_infos_offset = offset;
+    offset = alignOffset(offset + sizeof(surface_info) * (uint64_t)build->num_surface_infos);
+
+    cache_texture *textures = (cache_texture *)malloc(sizeof(cache_texture) * build->num_textures);
+    for (int i = 0; i < build->num_textures; i++) {
+        const texture_data &tex = build->textures[i];
+        textures[i] = {};
+        if (!tex.pixels) continue;
+        textures[i].width = tex.width;
+        textures[i].height = tex.height;
+        textures[i].num_levels = tex.num_levels;
+        textures[i].texel_size = tex.texel_size;
+        textures[i].size = (uint64_t)tex.texel_size * getMipChainTexels(tex.width, tex.height, tex.num_levels);
+        textures[i].offset = offset;
+        offset = alignOffset(offset + textures[i].size);
+    }
+
+    // written under a temporary name so a crash never leaves a torn cache
+    std::string path = cachePath(cache_key);
+    std::string tmp_path = path + ".tmp";
+    std::ofstream out(tmp_path, std::ios::binary | std::ios::trunc);
+    bool ok = out.is_open();
+    if (ok) {
+        writeAt(out, 0, &header, sizeof(header));
+        writeAt(out, header.textures_offset, textures, sizeof(cache_texture) * build->num_textures);
+        writeAt(out, header.surfaces_offset, loaded_map.surfaces, sizeof(surface) * loaded_map.num_surfaces);
+        writeAt(out, header.lightmap_offset, build->lightmap, lightmapSize(&header));
+        writeAt(out, header.verts_offset, build->verts, vertsSize(&header));
+        writeAt(out, header.indices_offset, build->indices, sizeof(uint32_t) * (uint64_t)build->num_indices);
+        writeAt(out, header.surface_infos_offset, build->surface_infos, sizeof(surface_info) * (uint64_t)build->num_surface_infos);
+        for (int i = 0; i < build->num_textures; i++) {
+            if (textures[i].offset) writeAt(out, textures[i].offset, build->textures[i].pixels, textures[i].size);
+        }
+        out.close();
+        ok = !out.fail();
+    }
+
+    free(textures);
+
+    if (ok) {
+        std::filesystem::rename(tmp_path, path, err);
+        ok = !err;
+    }
+    if (!ok) {
+        std::filesystem::remove(tmp_path, err);
+        std::cerr << "could not write map cache " << path << std::endl;
+    }
+    return ok;
+}
+
+void removeMapCache(uint64_t cache_key) {
+    std::error_code err;
+    std::filesystem::remove(cachePath(cache_key), err);
+}
@@ -0,0 +1,11 @@
+#pragma once
+#include "map.h"
+
+// bump whenever anything written by writeMapCache changes
+#define MAP_CACHE_VERSION 12
+#define MAP_CACHE_DIR "cache"
+
+uint64_t hashMemory(const void *data, size_t size);
+bool openMapCache(uint64_t cache_key, uint64_t bsp_size, mapped_file *out_file, map_build *out);
+bool writeMapCache(uint64_t cache_key, uint64_t bsp_size, const map_build *build);
+void removeMapCache(uint64_t cache_key);
@@ -0,0 +1,16 @@
+#pragma once
+
+// runtime picked simd kernels, the avx2 code is built into every x86 binary
+// and only called once cpuHasAVX2 says the machine can run it
+#if defined(__x86_64__) || defined(_M_X64)
+#define CPU_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define TARGET_AVX2
+#else
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+bool cpuHasAVX2();
+#endif
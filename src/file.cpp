@@ -0,0 +1,82 @@
+#include "file.h"
+#include <cstring>
+
+#ifdef WINDOWS
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+bool mapFile(const char *filename, mapped_file *out) {
+    memset(out, 0, sizeof(*out));
+
+    HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+    if (file == INVALID_HANDLE_VALUE) return false;
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size) || size.QuadPart == 0) {
+        CloseHandle(file);
+        return false;
+    }
+
+    HANDLE mapping = CreateFileMappingA(file, 0, PAGE_READONLY, 0, 0, 0);
+    if (!mapping) {
+        CloseHandle(file);
+        return false;
+    }
+
+    void *data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    if (!data) {
+        CloseHandle(mapping);
+        CloseHandle(file);
+        return false;
+    }
+
+    out->data = (const uint8_t *)data;
+    out->size = (size_t)size.QuadPart;
+    out->file_handle = file;
+    out->mapping_handle = mapping;
+    return true;
+}
+
+void unmapFile(mapped_file *file) {
+    if (file->data) UnmapViewOfFile(file->data);
+    if (file->mapping_handle) CloseHandle(file->mapping_handle);
+    if (file->file_handle) CloseHandle(file->file_handle);
+    memset(file, 0, sizeof(*file));
+}
+
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+bool mapFile(const char *filename, mapped_file *out) {
+    memset(out, 0, sizeof(*out));
+
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        close(fd);
+        return false;
+    }
+
+    void *data = mmap(0, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    // the mapping keeps its own reference to the file
+    close(fd);
+    if (data == MAP_FAILED) return false;
+
+    // the whole file is about to be parsed, start paging it in now
+    madvise(data, (size_t)st.st_size, MADV_WILLNEED);
+
+    out->data = (const uint8_t *)data;
+    out->size = (size_t)st.st_size;
+    return true;
+}
+
+void unmapFile(mapped_file *file) {
+    if (file->data) munmap((void *)file->data, file->size);
+    memset(file, 0, sizeof(*file));
+}
+#endif
@@ -0,0 +1,17 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+// read-only view of a file mapped into memory, pages are shared with the
+// OS page cache so nothing is copied until it is actually touched
+struct mapped_file {
+    const uint8_t *data;
+    size_t size;
+#ifdef WINDOWS
+    void *file_handle;
+    void *mapping_handle;
+#endif
+};
+
+bool mapFile(const char *filename, mapped_file *out);
+void unmapFile(mapped_file *file);
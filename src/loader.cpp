@@ -0,0 +1,270 @@
+#include "loader.h"
+#include "map.h"
+#include "cache.h"
+#include <SDL.h>
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+
+// work handed from the loader threads to the render thread, everything an
+// item refers to is fully written before the item is queued
+enum upload_type {
+    UPLOAD_MATERIALS,
+    UPLOAD_TEXTURE,
+    UPLOAD_LIGHTMAP,
+    UPLOAD_MESH,
+    UPLOAD_DONE
+};
+
+struct upload_item {
+    upload_type type;
+    int32_t index;
+};
+
+static std::mutex queue_mutex;
+static std::deque<upload_item> upload_queue;
+static std::thread load_thread;
+
+static std::atomic<int> state;
+static std::atomic<int> num_items_total;
+static int num_items_uploaded;
+
+static map_build build;
+static mapped_file cache_file;
+static std::string map_filename;
+static uint64_t load_start_time;
+static bool paletted_textures;
+static bool packed_vertices;
+
+static void pushUpload(upload_type type, int32_t index) {
+    std::lock_guard<std::mutex> lock(queue_mutex);
+    upload_queue.push_back({type, index});
+}
+
+static bool popUpload(upload_item *out) {
+    std::lock_guard<std::mutex> lock(queue_mutex);
+    if (upload_queue.empty()) return false;
+    *out = upload_queue.front();
+    upload_queue.pop_front();
+    return true;
+}
+
+// textures are handed out one at a time so a few huge ones do not leave
+// the other workers idle
+static std::atomic<int> next_texture;
+
+static void buildTextures() {
+    for (int i = next_texture++; i < build.num_textures; i = next_texture++) {
+        mapBuildTexture(i, &build.textures[i]);
+        pushUpload(UPLOAD_TEXTURE, i);
+    }
+}
+
+static int getNumTextureWorkers() {
+    // the loader thread itself joins in once the meshes are built
+    int num_cores = (int)std::thread::hardware_concurrency();
+    if (num_cores < 2) return 1;
+    return num_cores - 1 < MAP_MAX_TEXTURE_WORKERS ? num_cores - 1 : MAP_MAX_TEXTURE_WORKERS;
+}
+
+static void loadThread() {
+    if (!loadBinaryFile(map_filename.c_str(), &loaded_map.file)) {
+        SDL_Log("could not open %s\n", map_filename.c_str());
+        state = MAP_STATE_FAILED;
+        return;
+    }
+
+    bsp_file bsp;
+    if (!openBSP(loaded_map.file, &bsp) || !mapInitBSP(bsp)) {
+        SDL_Log("failed to load %s\n", map_filename.c_str());
+        vfsClose(&loaded_map.file);
+        state = MAP_STATE_FAILED;
+        return;
+    }
+
+    mapInitPalette();
+    mapInitLightStyles();
+    mapAssignTextureSlots();
+
+    int num_textures = loaded_map.miptex_lump->miptex_count;
+    // materials, every texture, the lightmap, the world mesh and the done marker
+    num_items_total = 1 + num_textures + 1 + 1 + 1;
+
+    // a warm cache skips the whole cpu build and uploads out of the mapping,
+    // the palette is part of the key since the textures are baked with it
+    uint64_t cache_key = hashMemory(loaded_map.file.data, loaded_map.file.size);
+    cache_key ^= hashMemory(loaded_map.palette, sizeof(loaded_map.palette)) * 31;
+    cache_key += loaded_map.paletted;
+    cache_key += (uint64_t)loaded_map.packed_vertices << 1;
+    if (openMapCache(cache_key, loaded_map.file.size, &cache_file, &build)) {
+        mapBuildClusters();
+        mapInitVisibility();
+        pushUpload(UPLOAD_MATERIALS, 0);
+        for (int i = 0; i < build.num_textures; i++) {
+            pushUpload(UPLOAD_TEXTURE, i);
+        }
+        pushUpload(UPLOAD_LIGHTMAP, 0);
+        pushUpload(UPLOAD_MESH, 0);
+        pushUpload(UPLOAD_DONE, 0);
+        return;
+    }
+
+    build.num_textures = num_textures;
+    build.textures = arenaPush<texture_data>(&loaded_map.scratch, num_textures);
+
+    pushUpload(UPLOAD_MATERIALS, 0);
+
+    // palette conversion fans out next to triangulation and lightmap packing
+    next_texture = 0;
+    int num_workers = getNumTextureWorkers();
+    std::thread texture_threads[MAP_MAX_TEXTURE_WORKERS];
+    for (int i = 0; i < num_workers; i++) {
+        texture_threads[i] = std::thread(buildTextures);
+    }
+
+    mapBuildMeshes(&build);
+    mapInitVisibility();
+    pushUpload(UPLOAD_LIGHTMAP, 0);
+    pushUpload(UPLOAD_MESH, 0);
+
+    buildTextures();
+    for (int i = 0; i < num_workers; i++) {
+        texture_threads[i].join();
+    }
+
+    // the render thread only reads the buffers until the done marker
+    writeMapCache(cache_key, loaded_map.file.size, &build);
+    pushUpload(UPLOAD_DONE, 0);
+}
+
+// the build only lived in the scratch arena or the cache mapping
+static void freeMapBuild() {
+    build = {};
+    arenaRelease(&loaded_map.scratch);
+    unmapFile(&cache_file);
+}
+
+static void finishLoading() {
+    load_thread.join();
+    bool from_cache = build.from_cache;
+    freeMapBuild();
+
+    float elapsed_ms = (float)(SDL_GetPerformanceCounter() - load_start_time) * 1000.0f / SDL_GetPerformanceFrequency();
+    SDL_Log("loaded %s in %.2f ms%s\n", map_filename.c_str(), elapsed_ms, from_cache ? " from cache" : "");
+    state = MAP_STATE_READY;
+}
+
+void loadMapAsync(const char *filename) {
+    map_filename = filename;
+    load_start_time = SDL_GetPerformanceCounter();
+    num_items_total = 0;
+    num_items_uploaded = 0;
+
+    if (!arenaInit(&loaded_map.memory) || !arenaInit(&loaded_map.scratch)) {
+        SDL_Log("could not reserve memory for %s\n", filename);
+        state = MAP_STATE_FAILED;
+        return;
+    }
+    loaded_map.paletted = paletted_textures;
+    loaded_map.packed_vertices = packed_vertices;
+
+    state = MAP_STATE_LOADING;
+    load_thread = std::thread(loadThread);
+}
+
+// called once per frame on the render thread, uploads finished cpu buffers
+// until the time budget runs out
+void updateMapLoading(float budget_ms) {
+    if (state == MAP_STATE_FAILED && load_thread.joinable()) {
+        load_thread.join();
+    }
+    if (state != MAP_STATE_LOADING) return;
+
+    uint64_t start = SDL_GetPerformanceCounter();
+    uint64_t budget = (uint64_t)(budget_ms * 0.001f * SDL_GetPerformanceFrequency());
+
+    upload_item item;
+    while (popUpload(&item)) {
+        switch (item.type) {
+            case UPLOAD_MATERIALS:
+                mapInitMaterials();
+                break;
+            case UPLOAD_TEXTURE:
+                mapUploadTexture(item.index, &build.textures[item.index]);
+                break;
+            case UPLOAD_LIGHTMAP:
+                mapUploadLightmap(&build);
+                break;
+            case UPLOAD_MESH:
+                mapUploadMesh(&build);
+                break;
+            case UPLOAD_DONE:
+                break;
+        }
+        num_items_uploaded++;
+
+        if (item.type == UPLOAD_DONE) {
+            finishLoading();
+            return;
+        }
+        if (SDL_GetPerformanceCounter() - start >= budget) return;
+    }
+}
+
+// drains the whole pipeline on the calling render thread
+bool waitMapLoading() {
+    while (state == MAP_STATE_LOADING) {
+        updateMapLoading(1000.0f);
+        if (state == MAP_STATE_LOADING) std::this_thread::yield();
+    }
+    // joins the loader thread if it gave up
+    updateMapLoading(0.0f);
+    return state == MAP_STATE_READY;
+}
+
+// blocking load for when there is nothing to draw in the meantime
+bool loadMap(const char *filename) {
+    loadMapAsync(filename);
+    return waitMapLoading();
+}
+
+// drops everything the current map owns, a failed or partial load included
+void unloadMap() {
+    waitMapLoading();
+    freeMapBuild();
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex);
+        upload_queue.clear();
+    }
+    mapRelease();
+    num_items_total = 0;
+    num_items_uploaded = 0;
+    state = MAP_STATE_EMPTY;
+}
+
+void changeMap(const char *filename) {
+    unloadMap();
+    loadMapAsync(filename);
+}
+
+// takes effect on the next load
+void setPalettedTextures(bool enabled) {
+    paletted_textures = enabled;
+}
+
+// takes effect on the next load, maps that do not fit keep full vertices
+void setPackedVertices(bool enabled) {
+    packed_vertices = enabled;
+}
+
+map_state getMapState() {
+    return (map_state)state.load();
+}
+
+float getMapLoadProgress() {
+    int total = num_items_total;
+    if (total == 0) return 0.0f;
+    return (float)num_items_uploaded / (float)total;
+}
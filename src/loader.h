@@ -0,0 +1,23 @@
+#pragma once
+
+// time the render thread may spend on gpu uploads per frame while loading
+#define MAP_UPLOAD_BUDGET_MS 4.0f
+#define MAP_MAX_TEXTURE_WORKERS 8
+
+enum map_state {
+    MAP_STATE_EMPTY,
+    MAP_STATE_LOADING,
+    MAP_STATE_READY,
+    MAP_STATE_FAILED
+};
+
+void loadMapAsync(const char *filename);
+void updateMapLoading(float budget_ms);
+bool waitMapLoading();
+bool loadMap(const char *filename);
+void unloadMap();
+void changeMap(const char *filename);
+void setPalettedTextures(bool enabled);
+void setPackedVertices(bool enabled);
+map_state getMapState();
+float getMapLoadProgress();
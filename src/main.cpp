@@ -1,12 +1,18 @@
 #include <SDL.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include "SDL_mouse.h"
 #include "glad/glad.h"
 #include "glm.hpp"
 
 #include "shader.h"
 #include "map.h"
+#include "loader.h"
 #include "camera.h"
 #include "player.h"
+#include "vfs.h"
+#include "bench.h"
 
 #define VIDEO_WIDTH 1920
 #define VIDEO_HEIGHT 1080
@@ -18,6 +24,43 @@ static SDL_GLContext context;
 static Player player;
 
 int main(int argc, char *argv[]) {
+    // game data comes from pak0.pak, pak1.pak, ... and then any -pak given,
+    // the map path is looked up in the mounted paks before the file system
+    vfsMountDefaultPaks();
+    const char *map_path = 0;
+    const char *bench_name = 0;
+    int tick_rate = SIM_TICK_RATE;
+    bool flashlight = false;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-pak") == 0 && i + 1 < argc) {
+            vfsMount(argv[++i]);
+        } else if (strcmp(argv[i], "-paletted") == 0) {
+            setPalettedTextures(true);
+        } else if (strcmp(argv[i], "-packed") == 0) {
+            setPackedVertices(true);
+        } else if (strcmp(argv[i], "-flashlight") == 0) {
+            flashlight = true;
+        } else if (strcmp(argv[i], "-bench") == 0 && i + 1 < argc) {
+            bench_name = argv[++i];
+        } else if (strcmp(argv[i], "-tickrate") == 0 && i + 1 < argc) {
+            tick_rate = atoi(argv[++i]);
+            if (tick_rate < 1) tick_rate = SIM_TICK_RATE;
+        } else {
+            map_path = argv[i];
+        }
+    }
+
+    if (bench_name) {
+        bool ok = runBenchmark(bench_name, map_path);
+        vfsShutdown();
+        return ok ? 0 : 1;
+    }
+
+    if (!map_path) {
+        SDL_Log("usage: %s [-pak file.pak]... [-paletted] [-packed] [-tickrate hz] [-flashlight] [-bench name] <map.bsp>\n", argv[0]);
+        return 1;
+    }
+
     SDL_Init(SDL_INIT_VIDEO);
 
     SDL_GL_SetAttribute(SDL_GL_MULTISAMPLESAMPLES, 4);
@@ -45,12 +88,16 @@ int main(int argc, char *argv[]) {
 
     input in = {0};
 
-    loadMap(argv[1]);
-
-    player.spawn();
+    // the map streams in while the window keeps drawing a progress bar
+    loadMapAsync(map_path);
+    bool spawned = false;
 
     uint64_t old_time = SDL_GetPerformanceCounter();
     float time = 0.0f;
+    float tick_time = 1.0f / tick_rate;
+    float sim_accumulator = 0.0f;
+    float title_time = 0.0f;
+    int num_frames = 0;
 
     glCullFace(GL_BACK);
     glFrontFace(GL_CW);
@@ -72,6 +119,11 @@ int main(int argc, char *argv[]) {
                     running = false;
                     break;
                 }
+                // reload the level through the same path a level change takes
+                if (event.key.keysym.scancode == SDL_SCANCODE_F5 && !event.key.repeat) {
+                    changeMap(map_path);
+                    spawned = false;
+                }
                 in.keyboard[event.key.keysym.scancode] = 1;
             } else if (event.type == SDL_KEYUP) {
                 in.keyboard[event.key.keysym.scancode] = 0;
@@ -88,18 +140,70 @@ int main(int argc, char *argv[]) {
         old_time = SDL_GetPerformanceCounter();
         time += delta_time;
 
-        //player.handleInput(&in, delta_time);
-        player.update(&in, delta_time);
+        updateMapLoading(MAP_UPLOAD_BUDGET_MS);
+        map_state state = getMapState();
+        if (state == MAP_STATE_FAILED) {
+            running = false;
+            break;
+        }
 
         glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-        drawMap(time, player.cam);
+        if (state == MAP_STATE_READY) {
+            if (!spawned) {
+                player.spawn();
+                spawned = true;
+                sim_accumulator = 0.0f;
+            }
+
+            // whole ticks for the time that passed, the rest carries over
+            player.look(&in);
+            sim_accumulator = glm::min(sim_accumulator + delta_time, tick_time * SIM_MAX_TICKS_PER_FRAME);
+            while (sim_accumulator >= tick_time) {
+                player.tick(&in, tick_time);
+                sim_accumulator -= tick_time;
+            }
+            player.updateCamera(sim_accumulator / tick_time);
+
+            // with -flashlight holding F carries a light around, back in map
+            // coordinates, to try dynamic lights out by hand
+            if (flashlight) {
+                const glm::vec3 &eye = player.cam.pos;
+                dynamic_light flash = { glm::vec3(eye.x, -eye.z, eye.y), 300.0f };
+                mapUpdateDynamicLights(&flash, in.keyboard[SDL_SCANCODE_F] ? 1 : 0);
+                mapUploadDynamicLights();
+            }
+
+            drawMap(time, player.cam);
+
+            // once a second the title shows what culling left to draw
+            num_frames++;
+            if (time - title_time >= 1.0f) {
+                const cull_stats &stats = getCullStats();
+                const render_stats &render = getRenderStats();
+                char title[256];
+                snprintf(title, sizeof(title), "borepack - %d fps, %d tris in %d draws, %d clusters, %d of %d pvs leaves culled, %d nodes tested, "
+                         "%d items, %d state changes, %d skipped, %.0f us submit",
+                         num_frames, stats.triangles_drawn, stats.draws, stats.clusters_drawn, stats.leaves_culled, stats.leaves_visible, stats.nodes_tested,
+                         stats.render_items, render.state_changes, render.state_changes_skipped, stats.submit_us);
+                SDL_SetWindowTitle(window, title);
+                title_time = time;
+                num_frames = 0;
+            }
+        } else {
+            int screen_width, screen_height;
+            SDL_GL_GetDrawableSize(window, &screen_width, &screen_height);
+            drawProgressBar(getMapLoadProgress(), screen_width, screen_height);
+        }
 
         SDL_GL_SwapWindow(window);
     }
 
+    // the loader threads may still be running if we quit early
+    unloadMap();
     SDL_DestroyWindow(window);
     SDL_GL_DeleteContext(context);
     SDL_Quit();
+    vfsShutdown();
     return 0;
 }
@@ -1,173 +1,906 @@
 #include "map.h"
 #include "bsp.h"
 #include "camera.h"
-#include "gtc/type_ptr.hpp"
 #include "material.h"
 #include "renderer.h"
 #include "shader.h"
+#include "palette.h"
+#include "atlas.h"
+#include "cache.h"
+#include "vcache.h"
+#include <SDL.h>
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
 #include <cstring>
-#include <fstream>
 #include <iostream>
 
-#define loadBSP(filename) ((bsp_header *)loadBinaryFile(filename))
-
 map loaded_map;
-static int num_indicies;
-static uint32_t *indices;
 static int num_render_faces;
 static int *render_faces;
 
-#define LIGHTMAP_WIDTH 1024
-#define LIGHTMAP_HEIGHT 1024
+// every gl object made for the map is recorded here so unloading does not
+// have to know which material or mesh owns it
+static void trackGLResource(gl_resource_type type, GLuint id) {
+    if (id == 0) return;
+    gl_resource_chunk *chunk = loaded_map.gl_resources;
+    if (!chunk || chunk->count == MAP_GL_RESOURCE_CHUNK_SIZE) {
+        chunk = arenaPush<gl_resource_chunk>(&loaded_map.memory, 1);
+        chunk->next = loaded_map.gl_resources;
+        loaded_map.gl_resources = chunk;
+    }
+    chunk->types[chunk->count] = type;
+    chunk->ids[chunk->count] = id;
+    chunk->count++;
+}
+
+static void trackMesh(const mesh &m) {
+    trackGLResource(GL_RESOURCE_VERTEX_ARRAY, m.VAO);
+    trackGLResource(GL_RESOURCE_BUFFER, m.VBO);
+    trackGLResource(GL_RESOURCE_BUFFER, m.EBO);
+}
+
+// one delete call per object type and chunk
+static void releaseGLResources() {
+    for (gl_resource_chunk *chunk = loaded_map.gl_resources; chunk; chunk = chunk->next) {
+        GLuint ids[GL_RESOURCE_TYPE_COUNT][MAP_GL_RESOURCE_CHUNK_SIZE];
+        int counts[GL_RESOURCE_TYPE_COUNT] = {};
+        for (int i = 0; i < chunk->count; i++) {
+            int type = chunk->types[i];
+            ids[type][counts[type]++] = chunk->ids[i];
+        }
+        if (counts[GL_RESOURCE_TEXTURE]) glDeleteTextures(counts[GL_RESOURCE_TEXTURE], ids[GL_RESOURCE_TEXTURE]);
+        if (counts[GL_RESOURCE_BUFFER]) glDeleteBuffers(counts[GL_RESOURCE_BUFFER], ids[GL_RESOURCE_BUFFER]);
+        if (counts[GL_RESOURCE_VERTEX_ARRAY]) glDeleteVertexArrays(counts[GL_RESOURCE_VERTEX_ARRAY], ids[GL_RESOURCE_VERTEX_ARRAY]);
+    }
+}
+
+// render thread only, and only while no loader thread is touching the map
+void mapRelease() {
+    releaseGLResources();
+    // deleted names get handed out again, the state cache would trust them
+    resetRenderState();
+    vfsClose(&loaded_map.file);
+    arenaRelease(&loaded_map.scratch);
+    arenaRelease(&loaded_map.memory);
+    loaded_map = {};
+
+    num_render_faces = 0;
+    render_faces = 0;
+}
+
+bool loadBinaryFile(const char *filename, vfs_file *out) {
+    return vfsOpen(filename, out);
+}
+
+void expandMiptex(const uint8_t *miptex_data, int width, int height, int offset, int pitch, const uint32_t *palette_lut, color *pixel_buffer) {
+    // a tightly packed image converts as one long run
+    if (offset == 0 && pitch == width) {
+        expandPalette(miptex_data, width * height, palette_lut, (uint8_t *)pixel_buffer);
+        return;
+    }
+    for (int y = 0; y < height; y++) {
+        expandPalette(miptex_data + offset + y * pitch, width, palette_lut, (uint8_t *)(pixel_buffer + y * width));
+    }
+}
+
+template <typename T>
+bool getLump(const bsp_file &bsp, int lump_type, lump_view<T> *out) {
+    bsp_lump lump = bsp.header->lumps[lump_type];
+    *out = {};
+
+    if (lump.offset < 0 || lump.length < 0) return false;
+    if ((uint64_t)lump.offset + (uint64_t)lump.length > bsp.size) return false;
+    if (lump.length % sizeof(T) != 0) return false;
+    // files inside of a pak are not necessarily aligned to anything
+    if ((uintptr_t)(bsp.data + lump.offset) % alignof(T) != 0) return false;
+
+    out->data = (const T *)(bsp.data + lump.offset);
+    out->count = lump.length / sizeof(T);
+    return true;
+}
 
-static int allocated[LIGHTMAP_WIDTH];
+bool openBSP(const vfs_file &file, bsp_file *out) {
+    *out = {};
+    if (file.size < sizeof(bsp_header)) {
+        std::cerr << "bsp: file too small for a header" << std::endl;
+        return false;
+    }
 
-bool allocBlock(int width, int height, int *x, int *y) {
-    int best = LIGHTMAP_HEIGHT;
+    if ((uintptr_t)file.data % alignof(bsp_header) != 0) {
+        std::cerr << "bsp: file is not aligned inside of its pak" << std::endl;
+        return false;
+    }
+
+    const bsp_header *header = (const bsp_header *)file.data;
+    int32_t version = header->version;
+    if (version != BSP_VERSION && version != BSP2_VERSION && version != BSP2_VERSION_2PSB) {
+        std::cerr << "bsp: unsupported version " << version << std::endl;
+        return false;
+    }
 
-    for (int i = 0; i < LIGHTMAP_WIDTH - width; i++) {
-        int best2 = 0;
-        int j;
-        for (j = 0; j < width; j++) {
-            if (allocated[i + j] >= best) break;
-            if (allocated[i + j] > best2) best2 = allocated[i + j];
+    out->data = file.data;
+    out->size = file.size;
+    out->version = version;
+    out->header = header;
+    return true;
+}
+
+const bsp_miptex *getMiptex(int miptex_idx) {
+    int32_t offset = loaded_map.miptex_lump->data_offset[miptex_idx];
+    if (offset < 0) return 0;
+    return (const bsp_miptex *)((const uint8_t *)loaded_map.miptex_lump + offset);
+}
+
+static bool validateMiptexLump() {
+    int32_t lump_size = loaded_map.miptex_lump_size;
+    if (lump_size < (int32_t)sizeof(int32_t)) return false;
+
+    int32_t count = loaded_map.miptex_lump->miptex_count;
+    if (count < 0 || (uint64_t)(count + 1) * sizeof(int32_t) > (uint64_t)lump_size) return false;
+
+    for (int i = 0; i < count; i++) {
+        int32_t offset = loaded_map.miptex_lump->data_offset[i];
+        if (offset == -1) continue;
+        if (offset < 0 || offset % alignof(bsp_miptex) != 0) return false;
+        if ((uint64_t)offset + sizeof(bsp_miptex) > (uint64_t)lump_size) return false;
+
+        const bsp_miptex *miptex = getMiptex(i);
+        if (miptex->width == 0 || miptex->height == 0) return false;
+        if (miptex->width % 16 != 0 || miptex->height % 16 != 0) return false;
+        if (memchr(miptex->name, 0, sizeof(miptex->name)) == 0) return false;
+
+        for (int mip = 0; mip < MIPLEVELS; mip++) {
+            uint64_t mip_size = (uint64_t)(miptex->width >> mip) * (uint64_t)(miptex->height >> mip);
+            if ((uint64_t)offset + miptex->offsets[mip] + mip_size > (uint64_t)lump_size) return false;
         }
+    }
+    return true;
+}
 
-        if (j == width) {
-            *x = i;
-            *y = best = best2;
+static bool validFloat(float f, float limit) {
+    return std::isfinite(f) && f >= -limit && f <= limit;
+}
+
+// cross checks every index stored in the lumps so nothing downstream can
+// read outside of the mapped file no matter what the file contains
+bool mapValidateBSP() {
+    const map &m = loaded_map;
+
+    if (m.num_models < 1) return false;
+    if (!validateMiptexLump()) return false;
+
+    // keeps surface extents math inside of integer range
+    for (int i = 0; i < m.num_vertices; i++) {
+        for (int j = 0; j < 3; j++) {
+            if (!validFloat(m.vertices[i][j], 1 << 20)) return false;
         }
     }
 
-    if (best + height > LIGHTMAP_HEIGHT) return false;
+    for (int i = 0; i < m.num_edges; i++) {
+        for (int j = 0; j < 2; j++) {
+            if (m.edges[i][j] < 0 || m.edges[i][j] >= m.num_vertices) return false;
+        }
+    }
 
-    for (int i = 0; i < width; i++) {
-        allocated[*x + i] = best + height;
+    for (int i = 0; i < m.num_surfedges; i++) {
+        int32_t edge = m.surfedges[i];
+        if (edge <= -m.num_edges || edge >= m.num_edges) return false;
+    }
+
+    for (int i = 0; i < m.num_texinfos; i++) {
+        const bsp_texinfo &texinfo = m.texinfos[i];
+        for (int j = 0; j < 3; j++) {
+            if (!validFloat(texinfo.uaxis[j], 16.0f) || !validFloat(texinfo.vaxis[j], 16.0f)) return false;
+        }
+        if (!validFloat(texinfo.uoffset, 1 << 20) || !validFloat(texinfo.voffset, 1 << 20)) return false;
+
+        int32_t miptex = texinfo.miptex;
+        if (miptex < 0 || miptex >= m.miptex_lump->miptex_count) return false;
+        if (!getMiptex(miptex)) return false;
+    }
+
+    for (int i = 0; i < m.num_faces; i++) {
+        const map_face &face = m.faces[i];
+        if (face.plane < 0 || face.plane >= m.num_planes) return false;
+        if (face.texinfo < 0 || face.texinfo >= m.num_texinfos) return false;
+        if (face.edge_count < 3 || face.first_edge < 0) return false;
+        if ((int64_t)face.first_edge + face.edge_count > m.num_surfedges) return false;
+
+        if (face.light_offset != -1) {
+            surface surf = {};
+            surf.face = i;
+            calcSurfaceExtents(&surf);
+            if (surf.uv_extents.s < 0 || surf.uv_extents.t < 0) return false;
+
+            int64_t block_size = (int64_t)((surf.uv_extents.s >> 4) + 1) * ((surf.uv_extents.t >> 4) + 1);
+            if (face.light_offset < 0 || face.light_offset + block_size > m.num_lightmap_bytes) return false;
+        }
+    }
+
+    for (int i = 0; i < m.num_mark_surfaces; i++) {
+        if (m.mark_surfaces[i] < 0 || m.mark_surfaces[i] >= m.num_faces) return false;
+    }
+
+    for (int i = 0; i < m.num_leafs; i++) {
+        const map_leaf &leaf = m.leafs[i];
+        if (leaf.first_mark_surface < 0 || leaf.mark_surface_count < 0) return false;
+        if ((int64_t)leaf.first_mark_surface + leaf.mark_surface_count > m.num_mark_surfaces) return false;
+    }
+
+    for (int i = 0; i < m.num_nodes; i++) {
+        const map_node &node = m.nodes[i];
+        if (node.plane < 0 || node.plane >= m.num_planes) return false;
+        if (node.first_face < 0 || node.face_count < 0) return false;
+        if ((int64_t)node.first_face + node.face_count > m.num_faces) return false;
+
+        for (int j = 0; j < 2; j++) {
+            int child = node.children[j];
+            // compilers emit nodes depth first, requiring it rules out cycles
+            if (child >= 0 && (child <= i || child >= m.num_nodes)) return false;
+            if (child < 0 && ~child >= m.num_leafs) return false;
+        }
+    }
+
+    // collision leaves keep the leaf index above their contents
+    if (m.num_leafs > 1 << (31 - COLLISION_CONTENTS_BITS)) return false;
+
+    for (int i = 0; i < m.num_clipnodes; i++) {
+        const map_clip_node &node = m.clipnodes[i];
+        if (node.plane < 0 || node.plane >= m.num_planes) return false;
+
+        for (int j = 0; j < 2; j++) {
+            int child = node.children[j];
+            if (child >= 0 && (child <= i || child >= m.num_clipnodes)) return false;
+            if (child < 0 && child < BSP_CONTENTS_SKY) return false;
+        }
+    }
+
+    for (int i = 0; i < m.num_models; i++) {
+        const bsp_model &model = m.models[i];
+        if (model.head_nodes[0] < 0 || model.head_nodes[0] >= m.num_nodes) return false;
+        for (int j = 1; j < 4; j++) {
+            if (model.head_nodes[j] >= m.num_clipnodes) return false;
+        }
+        if (model.first_face < 0 || model.num_faces < 0) return false;
+        if ((int64_t)model.first_face + model.num_faces > m.num_faces) return false;
     }
 
     return true;
 }
 
-void *loadBinaryFile(const char *filename) {
-    std::ifstream file(filename, std::ios::binary | std::ios::ate);
-    void *result = 0;
-    if (file)
-    {
-        std::streamsize fileSize = file.tellg();
-        file.seekg(0, std::ios::beg);
-        result = malloc(static_cast<size_t>(fileSize));
-        if (!file.read(static_cast<char*>(result), fileSize))
-        {
-            free(result);
-        }
+// bsp29 stores indices as uint16, values past the node count are leafs and
+// values near the top of the range are contents
+static int32_t nodeChild(int16_t child, int32_t num_nodes) {
+    uint16_t index = (uint16_t)child;
+    return index < num_nodes ? index : (int32_t)index - 0x10000;
+}
+
+static int32_t nodeChild(int32_t child, int32_t) {
+    return child;
+}
+
+static int32_t clipChild(int16_t child) {
+    uint16_t index = (uint16_t)child;
+    return index < 0xfff0 ? index : (int32_t)index - 0x10000;
+}
+
+static int32_t clipChild(int32_t child) {
+    return child;
+}
 
+template <typename T>
+static bool convertNodes(const bsp_file &bsp) {
+    lump_view<T> in;
+    if (!getLump(bsp, BSP_LUMP_NODES, &in)) return false;
+
+    map_node *out = arenaPush<map_node>(&loaded_map.memory, in.count);
+    for (int i = 0; i < in.count; i++) {
+        const T &node = in.data[i];
+        out[i].plane = node.plane;
+        for (int j = 0; j < 2; j++) {
+            out[i].children[j] = nodeChild(node.children[j], in.count);
+        }
+        for (int j = 0; j < 3; j++) {
+            out[i].min[j] = node.min[j];
+            out[i].max[j] = node.max[j];
+        }
+        out[i].first_face = node.first_face;
+        out[i].face_count = node.face_count;
     }
-    return result;
+    loaded_map.nodes = out;
+    loaded_map.num_nodes = in.count;
+    return true;
 }
 
-uint32_t buildTexture(uint8_t *miptex_data, int width, int height, int offset, int pitch, color *palette, GLenum filter, color *pixel_buffer) {
-    for (int y = 0; y < height; y++) {
-        for (int x = 0; x < width; x++) {
-            int miptex_idx = ((x + offset) + y * pitch);
-            int pixel_idx = x + y * width;
-            color clr = palette[miptex_data[miptex_idx]];
-            pixel_buffer[pixel_idx] = {clr.r, clr.g, clr.b};
+template <typename T>
+static bool convertLeafs(const bsp_file &bsp) {
+    lump_view<T> in;
+    if (!getLump(bsp, BSP_LUMP_LEAFS, &in)) return false;
+
+    map_leaf *out = arenaPush<map_leaf>(&loaded_map.memory, in.count);
+    for (int i = 0; i < in.count; i++) {
+        const T &leaf = in.data[i];
+        out[i].contents = leaf.contents;
+        out[i].visoffset = leaf.visoffset;
+        for (int j = 0; j < 3; j++) {
+            out[i].min[j] = leaf.min[j];
+            out[i].max[j] = leaf.max[j];
         }
+        out[i].first_mark_surface = leaf.first_mark_surface;
+        out[i].mark_surface_count = leaf.mark_surface_count;
+        memcpy(out[i].ambient_level, leaf.ambient_level, sizeof(out[i].ambient_level));
     }
-    uint32_t result = createTexture(pixel_buffer, width, height, GL_RGB, filter, GL_REPEAT, 1);
-    return result;
+    loaded_map.leafs = out;
+    loaded_map.num_leafs = in.count;
+    return true;
 }
 
 template <typename T>
-void copyLump(bsp_header *header, int lump_type, T **out_items, int *out_num_items) {
-    bsp_lump lump = header->lumps[lump_type];
-    if (out_num_items) *out_num_items = lump.length / sizeof(T);
-    *out_items = (T *)((uint8_t *)header + lump.offset);
-}
-
-void mapInitBSP(bsp_header *header) {
-    copyLump(header, BSP_LUMP_ENTITIES, &loaded_map.ents, 0);
-    copyLump(header, BSP_LUMP_PLANES, &loaded_map.planes, &loaded_map.num_planes);
-    copyLump(header, BSP_LUMP_VERTICES, &loaded_map.vertices, &loaded_map.num_vertices);
-    copyLump(header, BSP_LUMP_NODES, &loaded_map.nodes, &loaded_map.num_nodes);
-    copyLump(header, BSP_LUMP_TEXINFO, &loaded_map.texinfos, &loaded_map.num_texinfos);
-    copyLump(header, BSP_LUMP_FACES, &loaded_map.faces, &loaded_map.num_faces);
-    copyLump(header, BSP_LUMP_CLIPNODES, &loaded_map.clipnodes, &loaded_map.num_clipnodes);
-    copyLump(header, BSP_LUMP_LEAFS, &loaded_map.leafs, &loaded_map.num_leafs);
-    copyLump(header, BSP_LUMP_MARKSURFACES, &loaded_map.mark_surfaces, &loaded_map.num_mark_surfaces);
-    copyLump(header, BSP_LUMP_EDGES, &loaded_map.edges, &loaded_map.num_edges);
-    copyLump(header, BSP_LUMP_SURFEDGES, &loaded_map.surfedges, &loaded_map.num_surfedges);
-    copyLump(header, BSP_LUMP_MODELS, &loaded_map.models, &loaded_map.num_models);
-    copyLump(header, BSP_LUMP_LIGHTMAPS, &loaded_map.lightmap, 0);
-
-    bsp_lump miptex_lump = header->lumps[BSP_LUMP_MIPTEX];
-    loaded_map.miptex_lump = (bsp_miptex_lump *)((uint8_t *)header + miptex_lump.offset);
+static bool convertClipNodes(const bsp_file &bsp) {
+    lump_view<T> in;
+    if (!getLump(bsp, BSP_LUMP_CLIPNODES, &in)) return false;
+
+    map_clip_node *out = arenaPush<map_clip_node>(&loaded_map.memory, in.count);
+    for (int i = 0; i < in.count; i++) {
+        out[i].plane = in.data[i].plane;
+        for (int j = 0; j < 2; j++) {
+            out[i].children[j] = clipChild(in.data[i].children[j]);
+        }
+    }
+    loaded_map.clipnodes = out;
+    loaded_map.num_clipnodes = in.count;
+    return true;
 }
 
-void mapInitMaterials() {
+// bsp29 faces keep their counts in int16 but compilers treat them as unsigned
+static bool convertFaces(const bsp_file &bsp) {
+    lump_view<bsp_face> in29 = {};
+    lump_view<bsp2_face> in2 = {};
+    bool ok = bsp.version == BSP_VERSION ? getLump(bsp, BSP_LUMP_FACES, &in29) : getLump(bsp, BSP_LUMP_FACES, &in2);
+    if (!ok) return false;
+
+    int32_t count = in29.count + in2.count;
+    map_face *out = arenaPush<map_face>(&loaded_map.memory, count);
+    for (int i = 0; i < in29.count; i++) {
+        const bsp_face &face = in29.data[i];
+        out[i].plane = (uint16_t)face.plane;
+        out[i].side = face.side;
+        out[i].first_edge = face.first_edge;
+        out[i].edge_count = (uint16_t)face.edge_count;
+        out[i].texinfo = (uint16_t)face.texinfo;
+        memcpy(out[i].styles, face.styles, sizeof(out[i].styles));
+        out[i].light_offset = face.light_offset;
+    }
+    for (int i = 0; i < in2.count; i++) {
+        const bsp2_face &face = in2.data[i];
+        out[i].plane = face.plane;
+        out[i].side = face.side;
+        out[i].first_edge = face.first_edge;
+        out[i].edge_count = face.edge_count;
+        out[i].texinfo = face.texinfo;
+        memcpy(out[i].styles, face.styles, sizeof(out[i].styles));
+        out[i].light_offset = face.light_offset;
+    }
+    loaded_map.faces = out;
+    loaded_map.num_faces = count;
+    return true;
+}
+
+static bool convertEdges(const bsp_file &bsp) {
+    lump_view<bsp_edge> in29 = {};
+    lump_view<bsp2_edge> in2 = {};
+    bool ok = bsp.version == BSP_VERSION ? getLump(bsp, BSP_LUMP_EDGES, &in29) : getLump(bsp, BSP_LUMP_EDGES, &in2);
+    if (!ok) return false;
+
+    int32_t count = in29.count + in2.count;
+    map_edge *out = arenaPush<map_edge>(&loaded_map.memory, count);
+    for (int i = 0; i < in29.count; i++) {
+        out[i][0] = in29.data[i][0];
+        out[i][1] = in29.data[i][1];
+    }
+    for (int i = 0; i < in2.count; i++) {
+        // anything past int32 range fails validation as a negative index
+        out[i][0] = (int32_t)in2.data[i][0];
+        out[i][1] = (int32_t)in2.data[i][1];
+    }
+    loaded_map.edges = out;
+    loaded_map.num_edges = count;
+    return true;
+}
+
+static bool convertMarkSurfaces(const bsp_file &bsp) {
+    lump_view<uint16_t> in29 = {};
+    lump_view<uint32_t> in2 = {};
+    bool ok = bsp.version == BSP_VERSION ? getLump(bsp, BSP_LUMP_MARKSURFACES, &in29) : getLump(bsp, BSP_LUMP_MARKSURFACES, &in2);
+    if (!ok) return false;
+
+    int32_t count = in29.count + in2.count;
+    int32_t *out = arenaPush<int32_t>(&loaded_map.memory, count);
+    for (int i = 0; i < in29.count; i++) {
+        out[i] = in29.data[i];
+    }
+    for (int i = 0; i < in2.count; i++) {
+        out[i] = (int32_t)in2.data[i];
+    }
+    loaded_map.mark_surfaces = out;
+    loaded_map.num_mark_surfaces = count;
+    return true;
+}
+
+static bool convertLumps(const bsp_file &bsp) {
+    bool ok = convertFaces(bsp) && convertEdges(bsp) && convertMarkSurfaces(bsp);
+    if (!ok) return false;
+
+    switch (bsp.version) {
+        case BSP_VERSION:
+            return convertNodes<bsp_node>(bsp) && convertLeafs<bsp_leaf>(bsp) && convertClipNodes<bsp_clip_node>(bsp);
+        case BSP2_VERSION_2PSB:
+            return convertNodes<bsp2rmq_node>(bsp) && convertLeafs<bsp2rmq_leaf>(bsp) && convertClipNodes<bsp2_clip_node>(bsp);
+        case BSP2_VERSION:
+            return convertNodes<bsp2_node>(bsp) && convertLeafs<bsp2_leaf>(bsp) && convertClipNodes<bsp2_clip_node>(bsp);
+    }
+    return false;
+}
+
+bool mapInitBSP(const bsp_file &bsp) {
+    lump_view<char> ents;
+    lump_view<bsp_plane> planes;
+    lump_view<glm::vec3> vertices;
+    lump_view<bsp_texinfo> texinfos;
+    lump_view<int32_t> surfedges;
+    lump_view<bsp_model> models;
+    lump_view<uint8_t> lightmap;
+    lump_view<uint8_t> vis;
+    lump_view<uint8_t> miptex;
+
+    bool lumps_ok =
+        getLump(bsp, BSP_LUMP_ENTITIES, &ents) &&
+        getLump(bsp, BSP_LUMP_PLANES, &planes) &&
+        getLump(bsp, BSP_LUMP_VERTICES, &vertices) &&
+        getLump(bsp, BSP_LUMP_TEXINFO, &texinfos) &&
+        getLump(bsp, BSP_LUMP_SURFEDGES, &surfedges) &&
+        getLump(bsp, BSP_LUMP_MODELS, &models) &&
+        getLump(bsp, BSP_LUMP_LIGHTMAPS, &lightmap) &&
+        getLump(bsp, BSP_LUMP_VISIBILITY, &vis) &&
+        getLump(bsp, BSP_LUMP_MIPTEX, &miptex) &&
+        convertLumps(bsp);
+
+    if (!lumps_ok) {
+        std::cerr << "bsp: lump out of bounds" << std::endl;
+        return false;
+    }
+
+    // the player parses entities as a c string
+    if (ents.count == 0 || memchr(ents.data, 0, ents.count) == 0) {
+        std::cerr << "bsp: entities are not terminated" << std::endl;
+        return false;
+    }
+
+    loaded_map.ents = ents.data;
+    loaded_map.planes = planes.data;
+    loaded_map.num_planes = planes.count;
+    loaded_map.vertices = vertices.data;
+    loaded_map.num_vertices = vertices.count;
+    loaded_map.texinfos = texinfos.data;
+    loaded_map.num_texinfos = texinfos.count;
+    loaded_map.surfedges = surfedges.data;
+    loaded_map.num_surfedges = surfedges.count;
+    loaded_map.models = models.data;
+    loaded_map.num_models = models.count;
+    loaded_map.lightmap = lightmap.data;
+    loaded_map.num_lightmap_bytes = lightmap.count;
+    loaded_map.vis = vis.data;
+    loaded_map.num_vis_bytes = vis.count;
+    loaded_map.miptex_lump = (const bsp_miptex_lump *)miptex.data;
+    loaded_map.miptex_lump_size = miptex.count;
+
+    if (!mapValidateBSP()) {
+        std::cerr << "bsp: lump contents are corrupt" << std::endl;
+        return false;
+    }
+    mapBuildCollision();
+    return true;
+}
+
+static bool isSkyTexture(const bsp_miptex *miptex) {
+    return strncmp(miptex->name, "sky", 3) == 0;
+}
+
+static GLenum getTextureFormat() {
+    return loaded_map.paletted ? GL_RED : GL_RGB;
+}
+
+static bool isWorldTexture(const bsp_miptex *miptex) {
+    return miptex && strcmp(miptex->name, "") != 0 && !isSkyTexture(miptex) && miptex->name[0] != '*';
+}
+
+// cpu only, decides the array layer of every world texture and the mesh
+// every miptex is drawn with before anything is built or uploaded
+void mapAssignTextureSlots() {
     int num_texs = loaded_map.miptex_lump->miptex_count;
-    Material *mats = (Material *)malloc(sizeof(Material) * num_texs);
-    memset(mats, 0, sizeof(Material) * num_texs);
-    loaded_map.materials = mats;
-    loaded_map.num_materials = num_texs;
+    loaded_map.texture_slots = arenaPush<texture_slot>(&loaded_map.memory, num_texs);
+    loaded_map.texture_buckets = arenaPush<texture_bucket>(&loaded_map.memory, num_texs);
+    loaded_map.num_texture_buckets = 0;
+
+    for (int i = 0; i < num_texs; i++) {
+        texture_slot &slot = loaded_map.texture_slots[i];
+        slot.bucket = -1;
+
+        const bsp_miptex *miptex = getMiptex(i);
+        if (!isWorldTexture(miptex)) continue;
+
+        int bucket_idx = 0;
+        for (; bucket_idx < loaded_map.num_texture_buckets; bucket_idx++) {
+            const texture_bucket &bucket = loaded_map.texture_buckets[bucket_idx];
+            if (bucket.width == (int32_t)miptex->width && bucket.height == (int32_t)miptex->height &&
+                bucket.num_layers < MAP_MAX_ARRAY_LAYERS) {
+                break;
+            }
+        }
+        texture_bucket &bucket = loaded_map.texture_buckets[bucket_idx];
+        if (bucket_idx == loaded_map.num_texture_buckets) {
+            bucket.width = miptex->width;
+            bucket.height = miptex->height;
+            bucket.num_levels = getNumMipLevels(miptex->width, miptex->height);
+            loaded_map.num_texture_buckets++;
+        }
+        slot.bucket = bucket_idx;
+        slot.layer = bucket.num_layers++;
+        slot.batch = bucket_idx;
+    }
+
+    int num_batches = loaded_map.num_texture_buckets;
+    for (int i = 0; i < num_texs; i++) {
+        texture_slot &slot = loaded_map.texture_slots[i];
+        if (slot.bucket == -1) slot.batch = num_batches++;
+    }
+
+    loaded_map.num_batches = num_batches;
+    loaded_map.batches = arenaPush<draw_batch>(&loaded_map.memory, num_batches);
+    for (int i = 0; i < num_batches; i++) {
+        loaded_map.batches[i].material_index = -1;
+        loaded_map.batches[i].pass = RENDER_PASS_OPAQUE;
+    }
+    for (int i = 0; i < num_texs; i++) {
+        const texture_slot &slot = loaded_map.texture_slots[i];
+        if (slot.bucket != -1) continue;
+        draw_batch &batch = loaded_map.batches[slot.batch];
+        batch.material_index = i;
+        const bsp_miptex *miptex = getMiptex(i);
+        if (miptex && isSkyTexture(miptex)) batch.pass = RENDER_PASS_SKY;
+    }
+
+    render_queue &queue = loaded_map.queue;
+    queue.capacity = num_batches;
+    queue.num_items = 0;
+    queue.items = arenaPush<render_item>(&loaded_map.memory, num_batches);
+    queue.temp = arenaPush<render_item>(&loaded_map.memory, num_batches);
 }
 
-void mapInitTextures() {
-    // TODO: fix this jank
-    color palette[256] = {
-        #include "colormap.h"
-    };
+static void setPaletteUniforms(Material *mat) {
+    if (!loaded_map.paletted || !mat->program) return;
+    mat->setInt("Paletted", 1);
+    mat->setTexture("Palette", loaded_map.palette_tex);
+}
+
+void mapInitMaterials() {
     int num_texs = loaded_map.miptex_lump->miptex_count;
+    loaded_map.materials = arenaPush<Material>(&loaded_map.memory, num_texs);
+    loaded_map.num_materials = num_texs;
+
+    for (int i = 0; i < loaded_map.num_texture_buckets; i++) {
+        texture_bucket &bucket = loaded_map.texture_buckets[i];
+        GLenum filter = loaded_map.paletted ? GL_NEAREST : GL_LINEAR;
+        bucket.array_tex = createTextureArray(bucket.width, bucket.height, bucket.num_layers, bucket.num_levels, getTextureFormat(), filter, GL_REPEAT);
+        trackGLResource(GL_RESOURCE_TEXTURE, bucket.array_tex);
+    }
+
+    loaded_map.frame_ubo = createUniformBuffer(sizeof(frame_uniforms));
+    trackGLResource(GL_RESOURCE_BUFFER, loaded_map.frame_ubo);
+
+    // the array goes first so it lands in texture unit 0, drawMap swaps it
+    Material &world = loaded_map.world_material;
+    world.program = getShader("SurfaceShader");
+    world.depth_test = true;
+    world.cull_face = 1;
+    if (loaded_map.num_texture_buckets > 0) {
+        world.setTextureArray("Texture0", loaded_map.texture_buckets[0].array_tex);
+    }
 
-    int max_tex_width = 256;
-    int max_tex_height = 256;
-    color *pixel_buffer = (color *)malloc(sizeof(color) * max_tex_width * max_tex_height);
+    if (loaded_map.paletted) {
+        loaded_map.palette_tex = createTexture(loaded_map.palette, 256, 1, GL_RGB, GL_NEAREST, GL_CLAMP_TO_EDGE);
+        trackGLResource(GL_RESOURCE_TEXTURE, loaded_map.palette_tex);
+    }
+    setPaletteUniforms(&world);
 
     for (int i = 0; i < num_texs; i++) {
         Material &mat = loaded_map.materials[i];
         mat.cull_face = 1;
 
-        bsp_miptex *miptex = (bsp_miptex *)((uint8_t *)loaded_map.miptex_lump + loaded_map.miptex_lump->data_offset[i]);
+        const bsp_miptex *miptex = getMiptex(i);
+        if (!miptex || loaded_map.texture_slots[i].bucket != -1) continue;
 
-        int tex_width = miptex->width;
-        int tex_height = miptex->height;
-        uint8_t *mip_data = (uint8_t *)miptex + miptex->offsets[0];
         if (strcmp(miptex->name, "") == 0) {
             std::cout << "nameless tex" << std::endl;
-        } else if (strncmp(miptex->name, "sky", 3) == 0) {
+        } else if (isSkyTexture(miptex)) {
             mat.program = getShader("SkyShader");
             mat.depth_test = true;
-            int sky_tex_width = tex_width >> 1;
-            uint32_t fg_tex = buildTexture(mip_data, sky_tex_width, tex_height, 0, tex_width, palette, GL_NEAREST, pixel_buffer);
-            uint32_t bg_tex = buildTexture(mip_data, sky_tex_width, tex_height, sky_tex_width, tex_width, palette, GL_NEAREST, pixel_buffer);
-            mat.setFloat("Time", 0.0f);
-            mat.setVec3("CameraPosition", glm::vec3(0.0f));
-            mat.setTexture("Texture0", fg_tex);
-            mat.setTexture("Texture2", bg_tex);
         } else if (miptex->name[0] == '*') {
             mat.program = getShader("WaterShader");
             mat.depth_test = true;
-            uint32_t tex = buildTexture(mip_data, tex_width, tex_height, 0, tex_width, palette, GL_LINEAR, pixel_buffer);
-            mat.setTexture("Texture0", tex);
-            mat.setFloat("Time", 0.0f);
+        }
+        setPaletteUniforms(&mat);
+    }
+}
+
+// the palette shipped with the game data wins over the built in one
+void mapInitPalette() {
+    static const color default_palette[256] = {
+        #include "colormap.h"
+    };
+
+    vfs_file lump;
+    if (vfsOpen("gfx/palette.lmp", &lump) && lump.size == sizeof(loaded_map.palette)) {
+        memcpy(loaded_map.palette, lump.data, sizeof(loaded_map.palette));
+    } else {
+        memcpy(loaded_map.palette, default_palette, sizeof(loaded_map.palette));
+    }
+    vfsClose(&lump);
+    buildPaletteLUT((const uint8_t *)loaded_map.palette, loaded_map.palette_lut);
+}
+
+// the presets quake's progs set up for styles 0 to 11
+static const char *default_light_styles[] = {
+    "m",
+    "mmnmmommommnonmmonqnmmo",
+    "abcdefghijklmnopqrstuvwxyzyxwvutsrqponmlkjihgfedcba",
+    "mmmmmaaaaammmmmaaaaaabcdefgabcdefg",
+    "mamamamamama",
+    "jklmnopqrstuvwxyzyxwvutsrqponmlkj",
+    "nmonqnmomnmomomno",
+    "mmmaaaabcdefgmmmmaaaammmaamm",
+    "mmmaaammmaaammmabcdefaaaammmmabcdefmmmaaaa",
+    "aaaaaaaazzzzzzzz",
+    "mmamammmmammamamaaamammma",
+    "abcdefghijklmnopqrrqponmlkjihgfedcba",
+};
+
+// next quoted string or brace of the entity lump, 0 at the end
+static const char *parseEntityToken(const char *data, char *token, int max_len) {
+    while (*data && *data <= ' ') data++;
+    if (!*data) return 0;
+
+    int len = 0;
+    if (*data == '"') {
+        data++;
+        while (*data && *data != '"') {
+            if (len < max_len - 1) token[len++] = *data;
+            data++;
+        }
+        if (*data) data++;
+    } else {
+        token[len++] = *data++;
+    }
+    token[len] = 0;
+    return data;
+}
+
+// presets first, switchable lights from 32 up are on unless flagged to start off
+void mapInitLightStyles() {
+    for (int i = 0; i < MAP_MAX_LIGHTSTYLES; i++) {
+        int num_defaults = sizeof(default_light_styles) / sizeof(default_light_styles[0]);
+        mapSetLightStyle(i, i < num_defaults ? default_light_styles[i] : "m");
+    }
+
+    char key[64];
+    char value[64];
+    bool is_light = false;
+    int style = 0;
+    int spawnflags = 0;
+    const char *data = loaded_map.ents;
+    while ((data = parseEntityToken(data, key, sizeof(key)))) {
+        if (key[0] == '{' && key[1] == 0) {
+            is_light = false;
+            style = 0;
+            spawnflags = 0;
+            continue;
+        }
+        if (key[0] == '}' && key[1] == 0) {
+            if (is_light && style >= 32 && style < MAP_MAX_LIGHTSTYLES && (spawnflags & 1)) {
+                mapSetLightStyle(style, "a");
+            }
+            continue;
+        }
+        if (!(data = parseEntityToken(data, value, sizeof(value)))) break;
+        if (strcmp(key, "classname") == 0) is_light = strncmp(value, "light", 5) == 0;
+        else if (strcmp(key, "style") == 0) style = atoi(value);
+        else if (strcmp(key, "spawnflags") == 0) spawnflags = atoi(value);
+    }
+}
+
+// anything outside of a to z is dropped, an empty style stays at normal
+void mapSetLightStyle(int style, const char *pattern) {
+    if (style < 0 || style >= MAP_MAX_LIGHTSTYLES) return;
+    char *out = loaded_map.light_styles[style];
+    int len = 0;
+    for (; *pattern && len < MAP_MAX_LIGHTSTYLE_LENGTH - 1; pattern++) {
+        if (*pattern >= 'a' && *pattern <= 'z') out[len++] = *pattern;
+    }
+    out[len] = 0;
+}
+
+void mapAnimateLightStyles(float time) {
+    int frame = (int)(time * 10.0f);
+    for (int i = 0; i < MAP_MAX_LIGHTSTYLES; i++) {
+        const char *pattern = loaded_map.light_styles[i];
+        int len = (int)strlen(pattern);
+        loaded_map.light_style_values[i] = len ? (float)(pattern[frame % len] - 'a') / 12.0f : 1.0f;
+    }
+}
+
+// levels down to 1x1, the authored ones first
+int getNumMipLevels(int width, int height) {
+    int num_levels = 1;
+    while ((width >> num_levels) > 0 || (height >> num_levels) > 0) {
+        num_levels++;
+    }
+    return num_levels;
+}
+
+int64_t getMipChainTexels(int width, int height, int num_levels) {
+    int64_t texels = 0;
+    for (int level = 0; level < num_levels; level++) {
+        int64_t level_width = width >> level > 0 ? width >> level : 1;
+        int64_t level_height = height >> level > 0 ? height >> level : 1;
+        texels += level_width * level_height;
+    }
+    return texels;
+}
+
+// 2x2 box filter for the levels below the ones stored in the bsp
+static void downsampleMip(const color *src, int src_width, int src_height, color *dst) {
+    int dst_width = src_width > 1 ? src_width >> 1 : 1;
+    int dst_height = src_height > 1 ? src_height >> 1 : 1;
+    for (int y = 0; y < dst_height; y++) {
+        int y0 = y * 2;
+        int y1 = y0 + 1 < src_height ? y0 + 1 : y0;
+        for (int x = 0; x < dst_width; x++) {
+            int x0 = x * 2;
+            int x1 = x0 + 1 < src_width ? x0 + 1 : x0;
+            const color &a = src[x0 + y0 * src_width];
+            const color &b = src[x1 + y0 * src_width];
+            const color &c = src[x0 + y1 * src_width];
+            const color &d = src[x1 + y1 * src_width];
+            dst[x + y * dst_width] = {
+                (uint8_t)((a.r + b.r + c.r + d.r + 2) >> 2),
+                (uint8_t)((a.g + b.g + c.g + d.g + 2) >> 2),
+                (uint8_t)((a.b + b.b + c.b + d.b + 2) >> 2)
+            };
+        }
+    }
+}
+
+// paletted textures below the authored levels keep one index per 2x2 block,
+// averaging indices would make up unrelated colors
+static void downsampleIndices(const uint8_t *src, int src_width, int src_height, uint8_t *dst) {
+    int dst_width = src_width > 1 ? src_width >> 1 : 1;
+    int dst_height = src_height > 1 ? src_height >> 1 : 1;
+    for (int y = 0; y < dst_height; y++) {
+        for (int x = 0; x < dst_width; x++) {
+            dst[x + y * dst_width] = src[x * 2 + y * 2 * src_width];
+        }
+    }
+}
+
+static void convertMiptex(const uint8_t *miptex_data, int width, int height, int offset, int pitch, uint8_t *out) {
+    if (!loaded_map.paletted) {
+        expandMiptex(miptex_data, width, height, offset, pitch, loaded_map.palette_lut, (color *)out);
+        return;
+    }
+    for (int y = 0; y < height; y++) {
+        memcpy(out + y * width, miptex_data + offset + y * pitch, width);
+    }
+}
+
+// palette conversion only, safe to run off the render thread
+void mapBuildTexture(int miptex_idx, texture_data *out) {
+    *out = {};
+    const bsp_miptex *miptex = getMiptex(miptex_idx);
+    if (!miptex || strcmp(miptex->name, "") == 0) return;
+
+    int tex_width = miptex->width;
+    int tex_height = miptex->height;
+    const uint8_t *mip_data = (const uint8_t *)miptex + miptex->offsets[0];
+    out->width = tex_width;
+    out->height = tex_height;
+    out->texel_size = loaded_map.paletted ? 1 : sizeof(color);
+
+    if (isSkyTexture(miptex)) {
+        // the two sky layers are stored side by side, split them into two
+        // images, sky is sampled unfiltered so only level 0 is used
+        int sky_tex_width = tex_width >> 1;
+        int sky_tex_size = sky_tex_width * tex_height * out->texel_size;
+        out->num_levels = 1;
+        out->pixels = arenaPush<uint8_t>(&loaded_map.scratch, (size_t)tex_width * tex_height * out->texel_size);
+        convertMiptex(mip_data, sky_tex_width, tex_height, 0, tex_width, out->pixels);
+        convertMiptex(mip_data, sky_tex_width, tex_height, sky_tex_width, tex_width, out->pixels + sky_tex_size);
+        return;
+    }
+
+    // the bsp carries MIPLEVELS prefiltered levels, only the rest is made here
+    out->num_levels = getNumMipLevels(tex_width, tex_height);
+    out->pixels = arenaPush<uint8_t>(&loaded_map.scratch, getMipChainTexels(tex_width, tex_height, out->num_levels) * out->texel_size);
+
+    uint8_t *level_pixels = out->pixels;
+    uint8_t *prev_pixels = 0;
+    int prev_width = 0;
+    int prev_height = 0;
+    for (int level = 0; level < out->num_levels; level++) {
+        int level_width = tex_width >> level > 0 ? tex_width >> level : 1;
+        int level_height = tex_height >> level > 0 ? tex_height >> level : 1;
+        if (level < MIPLEVELS) {
+            const uint8_t *level_data = (const uint8_t *)miptex + miptex->offsets[level];
+            convertMiptex(level_data, level_width, level_height, 0, level_width, level_pixels);
+        } else if (loaded_map.paletted) {
+            downsampleIndices(prev_pixels, prev_width, prev_height, level_pixels);
         } else {
-            uint32_t tex = buildTexture(mip_data, tex_width, tex_height, 0, tex_width, palette, GL_LINEAR, pixel_buffer);
-            mat.program = getShader("SurfaceShader");
-            mat.depth_test = true;
-            mat.setTexture("Texture0", tex);
+            downsampleMip((const color *)prev_pixels, prev_width, prev_height, (color *)level_pixels);
         }
+        prev_pixels = level_pixels;
+        prev_width = level_width;
+        prev_height = level_height;
+        level_pixels += level_width * level_height * out->texel_size;
+    }
+}
+
+// index textures can not be filtered, they are sampled like the software renderer did
+void mapUploadTexture(int miptex_idx, const texture_data *tex) {
+    if (!tex->pixels) return;
+
+    Material &mat = loaded_map.materials[miptex_idx];
+    const bsp_miptex *miptex = getMiptex(miptex_idx);
+    GLenum format = getTextureFormat();
+
+    if (isSkyTexture(miptex)) {
+        int sky_tex_width = tex->width >> 1;
+        const uint8_t *bg_pixels = tex->pixels + sky_tex_width * tex->height * tex->texel_size;
+        uint32_t fg_tex = createTexture(tex->pixels, sky_tex_width, tex->height, format, GL_NEAREST, GL_REPEAT);
+        uint32_t bg_tex = createTexture(bg_pixels, sky_tex_width, tex->height, format, GL_NEAREST, GL_REPEAT);
+        trackGLResource(GL_RESOURCE_TEXTURE, fg_tex);
+        trackGLResource(GL_RESOURCE_TEXTURE, bg_tex);
+        mat.setTexture("Texture0", fg_tex);
+        mat.setTexture("Texture2", bg_tex);
+    } else if (loaded_map.texture_slots[miptex_idx].bucket != -1) {
+        const texture_slot &slot = loaded_map.texture_slots[miptex_idx];
+        const texture_bucket &bucket = loaded_map.texture_buckets[slot.bucket];
+        updateTextureArrayLayer(bucket.array_tex, slot.layer, tex->width, tex->height, tex->num_levels, format, tex->pixels);
+    } else {
+        GLenum filter = loaded_map.paletted ? GL_NEAREST : GL_LINEAR;
+        uint32_t tex_id = createTextureMips(tex->pixels, tex->width, tex->height, tex->num_levels, format, filter, GL_REPEAT);
+        trackGLResource(GL_RESOURCE_TEXTURE, tex_id);
+        mat.setTexture("Texture0", tex_id);
+    }
+}
+
+// the shaders look every texel up through this when textures are paletted,
+// so swapping palettes is a single 768 byte upload
+void mapSetPalette(const color *palette) {
+    memcpy(loaded_map.palette, palette, sizeof(loaded_map.palette));
+    buildPaletteLUT((const uint8_t *)loaded_map.palette, loaded_map.palette_lut);
+    if (loaded_map.palette_tex) {
+        updateTexture(loaded_map.palette_tex, 0, 0, 256, 1, GL_RGB, loaded_map.palette);
     }
-    free(pixel_buffer);
 }
 
 void calcSurfaceExtents(surface *surf) {
     glm::vec2 uv_min = glm::vec2(FLT_MAX);
     glm::vec2 uv_max = glm::vec2(-FLT_MAX);
-    bsp_face face = loaded_map.faces[surf->face];
+    const map_face &face = loaded_map.faces[surf->face];
     bsp_texinfo texinfo = loaded_map.texinfos[face.texinfo];
 
     for (int i = 0; i < face.edge_count; i++) {
-        int edge = ((int *)loaded_map.surfedges)[face.first_edge + i];
+        int edge = loaded_map.surfedges[face.first_edge + i];
         glm::vec3 pos = {};
 
         if (edge >= 0) {
@@ -204,44 +937,38 @@ void calcSurfaceExtents(surface *surf) {
 }
 
 void markSurface(int leaf_idx) {
-    bsp_leaf leaf = loaded_map.leafs[leaf_idx];
+    const map_leaf &leaf = loaded_map.leafs[leaf_idx];
     for (int i = 0; i < leaf.mark_surface_count; i++) {
         int face_idx = loaded_map.mark_surfaces[leaf.first_mark_surface + i];
         render_faces[face_idx] = 1;
     }
 }
 
-void buildBSPTree(bsp_node node) {
-    if ((node.children[0] & 0x8000) == 0) {
-        int child_idx = node.children[0];
-        buildBSPTree(loaded_map.nodes[child_idx]);
-    } else {
-        int leaf_idx = ~node.children[0];
-        markSurface(leaf_idx);
-    }
-
-    if ((node.children[1] & 0x8000) == 0) {
-        int child_idx = node.children[1];
-        buildBSPTree(loaded_map.nodes[child_idx]);
-    } else {
-        int leaf_idx = ~node.children[1];
-        markSurface(leaf_idx);
+void buildBSPTree(const map_node &node) {
+    for (int i = 0; i < 2; i++) {
+        int child = node.children[i];
+        if (child >= 0) {
+            buildBSPTree(loaded_map.nodes[child]);
+        } else {
+            markSurface(~child);
+        }
     }
 }
 
 void createSurfaces() {
-    num_render_faces = loaded_map.num_mark_surfaces;
-    render_faces = (int *)malloc(sizeof(int) * num_render_faces);
-    memset(render_faces, 0, sizeof(int) * num_render_faces);
+    // marks are indexed by face, not by mark surface
+    num_render_faces = loaded_map.num_faces;
+    render_faces = arenaPush<int>(&loaded_map.scratch, num_render_faces);
 
     bsp_model mdl = loaded_map.models[0];
     buildBSPTree(loaded_map.nodes[mdl.head_nodes[0]]);
 
-    loaded_map.surfaces = (surface *)malloc(sizeof(surface) * loaded_map.num_mark_surfaces);
+    loaded_map.num_surfaces = 0;
+    loaded_map.surfaces = arenaPush<surface>(&loaded_map.memory, num_render_faces);
 
     for (int i = 0; i < num_render_faces; i++) {
         if (render_faces[i]) {
-            surface *surf = loaded_map.surfaces + i;
+            surface *surf = loaded_map.surfaces + loaded_map.num_surfaces;
             *surf = {};
             surf->face = i;
             calcSurfaceExtents(surf);
@@ -251,140 +978,1377 @@ void createSurfaces() {
 }
 
 int getVertexFromEdge(int surf_edge) {
-    int edge = ((int *)loaded_map.surfedges)[surf_edge];
+    int edge = loaded_map.surfedges[surf_edge];
     if (edge >= 0)
         return loaded_map.edges[edge][0];
     return loaded_map.edges[-edge][1];
 }
 
-void triangulateSurface(surface *surf, uint32_t *triangle) {
-    surf->first_index = num_indicies;
-    bsp_face face = loaded_map.faces[surf->face];
-    int num_tris = face.edge_count - 2;
+// luxels are 16 texels apart and cover both ends of the extents
+static glm::ivec2 blockSize(const surface &surf) {
+    return glm::ivec2((surf.uv_extents.s >> 4) + 1, (surf.uv_extents.t >> 4) + 1);
+}
+
+static bool hasOwnLightmap(const surface *surf) {
+    const map_face &face = loaded_map.faces[surf->face];
+    if (face.light_offset == -1) return false;
+    return (loaded_map.texinfos[face.texinfo].flags & TEX_SPECIAL) == 0;
+}
 
-    for(int i = 1; i <= num_tris; i++) {
-        int edge_idx = face.first_edge + i;
-        *triangle++ = getVertexFromEdge(face.first_edge);
-        *triangle++ = getVertexFromEdge(edge_idx);
-        *triangle++ = getVertexFromEdge(edge_idx + 1);
-        surf->num_indices += 3;
+// copies a block into one channel of an atlas with its edge luxels repeated
+// one texel out, x and y are the corner of the padded block
+static void copyLightmapBlock(const uint8_t *src, int width, int height, uint8_t *page, int pitch, int x, int y, int channel, int num_channels) {
+    for (int j = -LIGHTMAP_PADDING; j < height + LIGHTMAP_PADDING; j++) {
+        int src_y = glm::clamp(j, 0, height - 1);
+        uint8_t *row = page + ((y + LIGHTMAP_PADDING + j) * pitch + x + LIGHTMAP_PADDING) * num_channels + channel;
+        for (int i = -LIGHTMAP_PADDING; i < width + LIGHTMAP_PADDING; i++) {
+            row[i * num_channels] = src[glm::clamp(i, 0, width - 1) + src_y * width];
+        }
     }
 }
 
-void mapInitMeshes() {
-    createSurfaces();
+// the styles a face has samples for in channel order, a style whose block
+// runs past the lump is dropped and out of range styles fall back to 0
+static int getFaceStyles(const map_face &face, int64_t block_size, uint8_t *styles) {
+    int num_styles = 0;
+    for (; num_styles < MAXLIGHTMAPS && face.styles[num_styles] != 255; num_styles++) {
+        if (face.light_offset + block_size * (num_styles + 1) > loaded_map.num_lightmap_bytes) break;
+        uint8_t style = face.styles[num_styles];
+        styles[num_styles] = style < MAP_MAX_LIGHTSTYLES ? style : 0;
+    }
+    for (int i = num_styles; i < MAXLIGHTMAPS; i++) {
+        styles[i] = 0;
+    }
+    return num_styles;
+}
+
+// tallest blocks first into as many pages as needed, the pages share one
+// size so they can be layers of a single array texture
+static void packLightmaps(map_build *out) {
+    uint64_t start = SDL_GetPerformanceCounter();
+
+    int num_blocks = 0;
+    int *order = arenaPush<int>(&loaded_map.scratch, loaded_map.num_surfaces);
+    for (int i = 0; i < loaded_map.num_surfaces; i++) {
+        if (hasOwnLightmap(loaded_map.surfaces + i)) order[num_blocks++] = i;
+    }
+
+    std::sort(order, order + num_blocks, [&](int a, int b) {
+        glm::ivec2 size_a = blockSize(loaded_map.surfaces[a]);
+        glm::ivec2 size_b = blockSize(loaded_map.surfaces[b]);
+        if (size_a.y != size_b.y) return size_a.y > size_b.y;
+        if (size_a.x != size_b.x) return size_a.x > size_b.x;
+        return a < b;
+    });
+
+    atlas_page pages[LIGHTMAP_MAX_PAGES];
+    int num_pages = 1;
+    atlasInit(&pages[0], LIGHTMAP_WIDTH, LIGHTMAP_HEIGHT, arenaPush<skyline_segment>(&loaded_map.scratch, LIGHTMAP_WIDTH));
+
+    // one luxel for everything unlit, sky and liquids
+    glm::ivec2 shared;
+    atlasPack(&pages[0], 1 + LIGHTMAP_PADDING * 2, 1 + LIGHTMAP_PADDING * 2, &shared.x, &shared.y);
+
+    int64_t num_luxels = 0;
+    int64_t num_padded_luxels = 0;
+    int num_overflowed = 0;
+    for (int i = 0; i < num_blocks; i++) {
+        surface &surf = loaded_map.surfaces[order[i]];
+        glm::ivec2 size = blockSize(surf) + LIGHTMAP_PADDING * 2;
+
+        int page = 0;
+        int x = 0;
+        int y = 0;
+        while (page < num_pages && !atlasPack(&pages[page], size.x, size.y, &x, &y)) {
+            page++;
+        }
+        if (page == num_pages && num_pages < LIGHTMAP_MAX_PAGES && size.x <= LIGHTMAP_WIDTH && size.y <= LIGHTMAP_HEIGHT) {
+            atlasInit(&pages[page], LIGHTMAP_WIDTH, LIGHTMAP_HEIGHT, arenaPush<skyline_segment>(&loaded_map.scratch, LIGHTMAP_WIDTH));
+            atlasPack(&pages[page], size.x, size.y, &x, &y);
+            num_pages++;
+        }
 
-    // allocate memory
-    int max_tris = 65536;
-    indices = (uint32_t *)malloc(sizeof(uint32_t) * max_tris);
+        if (page == num_pages) {
+            // too big for a page or out of pages, dark beats reading garbage
+            surf.lightmap_page = -1;
+            num_overflowed++;
+            continue;
+        }
+        surf.lightmap_page = page;
+        surf.lightmap_offset = glm::ivec2(x, y);
+        num_luxels += (int64_t)(size.x - LIGHTMAP_PADDING * 2) * (size.y - LIGHTMAP_PADDING * 2);
+        num_padded_luxels += (int64_t)size.x * size.y;
+    }
 
-    uint64_t size_in_bytes = sizeof(uint8_t) * LIGHTMAP_WIDTH * LIGHTMAP_HEIGHT;
-    uint8_t *lightmap_bitmap = (uint8_t *)malloc(size_in_bytes);
-    memset(lightmap_bitmap, 0, size_in_bytes);
+    // a single page is cut down to what was used
+    int page_height = 0;
+    for (int i = 0; i < num_pages; i++) {
+        page_height = std::max(page_height, pages[i].used_height);
+    }
+    page_height = (page_height + 3) & ~3;
+
+    out->lightmap_width = LIGHTMAP_WIDTH;
+    out->lightmap_height = page_height;
+    out->num_lightmap_pages = num_pages;
+    int64_t page_size = (int64_t)LIGHTMAP_WIDTH * page_height;
+    out->lightmap = arenaPush<uint8_t>(&loaded_map.scratch, page_size * num_pages * LIGHTMAP_CHANNELS);
 
-    // create tris
+    uint8_t unlit = 28;
+    copyLightmapBlock(&unlit, 1, 1, out->lightmap, LIGHTMAP_WIDTH, shared.x, shared.y, 0, LIGHTMAP_CHANNELS);
     for (int i = 0; i < loaded_map.num_surfaces; i++) {
-        surface *surf = loaded_map.surfaces + i;
-        triangulateSurface(surf, indices + num_indicies);
-        num_indicies += surf->num_indices;
+        surface &surf = loaded_map.surfaces[i];
+        if (!hasOwnLightmap(&surf) || surf.lightmap_page < 0) {
+            surf.lightmap_page = -1;
+            surf.lightmap_offset = shared + LIGHTMAP_PADDING;
+            continue;
+        }
+        // every style of a face shares one block, a channel each
+        glm::ivec2 size = blockSize(surf);
+        const map_face &face = loaded_map.faces[surf.face];
+        uint8_t styles[MAXLIGHTMAPS];
+        int num_styles = getFaceStyles(face, (int64_t)size.x * size.y, styles);
+        uint8_t *page = out->lightmap + page_size * surf.lightmap_page * LIGHTMAP_CHANNELS;
+        for (int j = 0; j < num_styles; j++) {
+            const uint8_t *samples = loaded_map.lightmap + face.light_offset + (int64_t)size.x * size.y * j;
+            copyLightmapBlock(samples, size.x, size.y, page, LIGHTMAP_WIDTH, surf.lightmap_offset.x, surf.lightmap_offset.y, j, LIGHTMAP_CHANNELS);
+        }
+        surf.lightmap_offset += LIGHTMAP_PADDING;
+    }
+
+    float elapsed_ms = (float)(SDL_GetPerformanceCounter() - start) * 1000.0f / SDL_GetPerformanceFrequency();
+    double atlas_size = (double)(page_size * num_pages);
+    std::cout << "lightmap: " << num_blocks << " blocks in " << num_pages << " page(s) of "
+              << LIGHTMAP_WIDTH << "x" << page_height << ", "
+              << (float)(100.0 * num_luxels / atlas_size) << "% luxels, "
+              << (float)(100.0 * num_padded_luxels / atlas_size) << "% with padding, packed in "
+              << elapsed_ms << " ms" << std::endl;
+    if (num_overflowed) {
+        std::cerr << "lightmap: " << num_overflowed << " surfaces did not fit and are drawn unlit" << std::endl;
+    }
+}
+
+struct cluster_builder {
+    const int32_t *subtree_surfaces;
+    int32_t *node_clusters;
+    bool *whole_subtrees;
+};
+
+static void assignClusters(cluster_builder *builder, int node_idx, int cluster) {
+    // nodes are only ever reached through their first parent
+    if (node_idx < 0 || builder->node_clusters[node_idx] >= 0) return;
+    if (cluster < 0 || !builder->whole_subtrees[cluster]) {
+        cluster = loaded_map.num_clusters++;
+        builder->whole_subtrees[cluster] = builder->subtree_surfaces[node_idx] <= MAP_CLUSTER_SURFACES;
+    }
+    builder->node_clusters[node_idx] = cluster;
+    assignClusters(builder, loaded_map.nodes[node_idx].children[0], cluster);
+    assignClusters(builder, loaded_map.nodes[node_idx].children[1], cluster);
+}
+
+// cuts the world tree into small subtrees depth first, so clusters close in
+// the tree end up close in the index buffer, nodes above those subtrees keep
+// their faces in a cluster of their own. surfaces join the cluster of the
+// node their face lies on
+void mapBuildClusters() {
+    map &m = loaded_map;
+    m.face_surfaces = arenaPush<int32_t>(&m.memory, m.num_faces);
+    for (int i = 0; i < m.num_faces; i++) {
+        m.face_surfaces[i] = -1;
+    }
+    for (int i = 0; i < m.num_surfaces; i++) {
+        m.face_surfaces[m.surfaces[i].face] = i;
+    }
+
+    // children always come after their parents, so one backwards pass
+    int32_t *subtree_surfaces = arenaPush<int32_t>(&m.scratch, m.num_nodes);
+    for (int i = m.num_nodes - 1; i >= 0; i--) {
+        const map_node &node = m.nodes[i];
+        int32_t count = 0;
+        for (int j = 0; j < node.face_count; j++) {
+            if (m.face_surfaces[node.first_face + j] >= 0) count++;
+        }
+        for (int j = 0; j < 2; j++) {
+            if (node.children[j] >= 0) count += subtree_surfaces[node.children[j]];
+        }
+        subtree_surfaces[i] = std::min(count, m.num_surfaces);
+    }
+
+    cluster_builder builder;
+    builder.subtree_surfaces = subtree_surfaces;
+    builder.node_clusters = arenaPush<int32_t>(&m.scratch, m.num_nodes);
+    builder.whole_subtrees = arenaPush<bool>(&m.scratch, m.num_nodes);
+    for (int i = 0; i < m.num_nodes; i++) {
+        builder.node_clusters[i] = -1;
+    }
+    m.num_clusters = 0;
+    int root = m.models[0].head_nodes[0];
+    assignClusters(&builder, root, -1);
+
+    for (int i = 0; i < m.num_surfaces; i++) {
+        m.surfaces[i].cluster = -1;
+    }
+    for (int i = 0; i < m.num_nodes; i++) {
+        int cluster = builder.node_clusters[i];
+        if (cluster < 0) continue;
+        const map_node &node = m.nodes[i];
+        for (int j = 0; j < node.face_count; j++) {
+            int surf_idx = m.face_surfaces[node.first_face + j];
+            if (surf_idx >= 0 && m.surfaces[surf_idx].cluster < 0) m.surfaces[surf_idx].cluster = cluster;
+        }
+    }
+    // a face no world node claims still has a leaf marking it
+    for (int i = 0; i < m.num_surfaces; i++) {
+        if (m.surfaces[i].cluster < 0) m.surfaces[i].cluster = builder.node_clusters[root];
+    }
+
+    m.cluster_frames = arenaPush<int32_t>(&m.memory, m.num_clusters);
+    m.cluster_distances = arenaPush<float>(&m.memory, m.num_clusters);
+    m.cluster_bounds = arenaPush<aabb>(&m.memory, m.num_clusters);
+    for (int i = 0; i < m.num_clusters; i++) {
+        m.cluster_bounds[i] = { glm::vec3(FLT_MAX), glm::vec3(-FLT_MAX) };
+    }
+    for (int i = 0; i < m.num_surfaces; i++) {
+        const map_face &face = m.faces[m.surfaces[i].face];
+        aabb &bounds = m.cluster_bounds[m.surfaces[i].cluster];
+        for (int j = 0; j < face.edge_count; j++) {
+            glm::vec3 pos = m.vertices[getVertexFromEdge(face.first_edge + j)];
+            bounds.min = glm::min(bounds.min, pos);
+            bounds.max = glm::max(bounds.max, pos);
+        }
+    }
+}
+
+// merges byte identical vertices, only corners that sample the shared luxel
+// like sky and liquids can match up since lit faces own their atlas block
+static int weldVertices(vertex *verts, int num_verts, uint32_t *indices, int num_indices) {
+    uint32_t capacity = 16;
+    while (capacity < (uint32_t)num_verts * 2) capacity <<= 1;
+    int32_t *table = arenaPush<int32_t>(&loaded_map.scratch, capacity);
+    int32_t *remap = arenaPush<int32_t>(&loaded_map.scratch, num_verts);
+    for (uint32_t i = 0; i < capacity; i++) {
+        table[i] = -1;
+    }
+
+    int num_welded = 0;
+    for (int i = 0; i < num_verts; i++) {
+        uint32_t slot = (uint32_t)hashMemory(verts + i, sizeof(vertex)) & (capacity - 1);
+        while (table[slot] >= 0 && memcmp(verts + table[slot], verts + i, sizeof(vertex)) != 0) {
+            slot = (slot + 1) & (capacity - 1);
+        }
+        if (table[slot] < 0) {
+            table[slot] = num_welded;
+            verts[num_welded++] = verts[i];
+        }
+        remap[i] = table[slot];
+    }
+    for (int i = 0; i < num_indices; i++) {
+        indices[i] = remap[indices[i]];
+    }
+    return num_welded;
+}
+
+// renumbers vertices in the order the indices first use them so the vertex
+// fetch walks the buffer forwards, returns how many are left
+static int reorderVertices(vertex *verts, int num_verts, uint32_t *indices, int num_indices) {
+    int32_t *remap = arenaPush<int32_t>(&loaded_map.scratch, num_verts);
+    vertex *old_verts = arenaPush<vertex>(&loaded_map.scratch, num_verts);
+    memcpy(old_verts, verts, sizeof(vertex) * num_verts);
+    for (int i = 0; i < num_verts; i++) {
+        remap[i] = -1;
+    }
+    int num_used = 0;
+    for (int i = 0; i < num_indices; i++) {
+        uint32_t v = indices[i];
+        if (remap[v] < 0) {
+            remap[v] = num_used;
+            verts[num_used++] = old_verts[v];
+        }
+        indices[i] = remap[v];
+    }
+    return num_used;
+}
+
+static uint64_t getSurfaceInfoKey(const surface_info &info) {
+    uint64_t key;
+    memcpy(&key, &info, sizeof(key));
+    return key;
+}
+
+// one table entry per distinct combination, surface_entries gets the entry of
+// every surface
+static void buildSurfaceInfos(map_build *out, int32_t *surface_entries) {
+    map &m = loaded_map;
+    surface_info *infos = arenaPush<surface_info>(&m.scratch, m.num_surfaces);
+    uint64_t *keys = arenaPush<uint64_t>(&m.scratch, m.num_surfaces);
+    for (int i = 0; i < m.num_surfaces; i++) {
+        const surface &surf = m.surfaces[i];
+        const map_face &face = m.faces[surf.face];
+        surface_info &info = infos[i];
+        // the shared luxel only has data in the first channel, style 0
+        if (surf.lightmap_page >= 0) {
+            glm::ivec2 size = blockSize(surf);
+            getFaceStyles(face, (int64_t)size.x * size.y, info.styles);
+        }
+        info.layer = (uint8_t)m.texture_slots[m.texinfos[face.texinfo].miptex].layer;
+        info.lightmap_page = (uint8_t)(surf.lightmap_page >= 0 ? surf.lightmap_page : 0);
+        keys[i] = getSurfaceInfoKey(info);
+    }
+
+    uint64_t *unique_keys = arenaPush<uint64_t>(&m.scratch, m.num_surfaces);
+    memcpy(unique_keys, keys, sizeof(uint64_t) * m.num_surfaces);
+    std::sort(unique_keys, unique_keys + m.num_surfaces);
+    int num_unique = (int)(std::unique(unique_keys, unique_keys + m.num_surfaces) - unique_keys);
+
+    int num_rows = num_unique > 0 ? (num_unique + MAP_SURFACE_INFO_ROW - 1) / MAP_SURFACE_INFO_ROW : 1;
+    out->num_surface_infos = num_rows * MAP_SURFACE_INFO_ROW;
+    out->surface_infos = arenaPush<surface_info>(&m.scratch, out->num_surface_infos);
+    for (int i = 0; i < m.num_surfaces; i++) {
+        int entry = (int)(std::lower_bound(unique_keys, unique_keys + num_unique, keys[i]) - unique_keys);
+        out->surface_infos[entry] = infos[i];
+        surface_entries[i] = entry;
+    }
+}
+
+// lightmap packing and vertex generation, no gl calls. the index buffer is
+// ordered by batch and cluster so each pair owns one contiguous range, the
+// triangles inside a range are reordered for the vertex cache
+void mapBuildMeshes(map_build *out) {
+    createSurfaces();
+    mapBuildClusters();
+    packLightmaps(out);
+
+    uint64_t start = SDL_GetPerformanceCounter();
+    map &m = loaded_map;
+    int32_t *surface_entries = arenaPush<int32_t>(&m.scratch, m.num_surfaces);
+    buildSurfaceInfos(out, surface_entries);
+
+    int *order = arenaPush<int>(&m.scratch, m.num_surfaces);
+    int64_t total_verts = 0;
+    int64_t total_indices = 0;
+    for (int i = 0; i < m.num_surfaces; i++) {
+        surface &surf = m.surfaces[i];
+        const map_face &face = m.faces[surf.face];
+        surf.batch = m.texture_slots[m.texinfos[face.texinfo].miptex].batch;
+        order[i] = i;
+        total_verts += face.edge_count;
+        total_indices += (face.edge_count - 2) * 3;
+    }
+    std::sort(order, order + m.num_surfaces, [&](int a, int b) {
+        const surface &surf_a = m.surfaces[a];
+        const surface &surf_b = m.surfaces[b];
+        if (surf_a.batch != surf_b.batch) return surf_a.batch < surf_b.batch;
+        if (surf_a.cluster != surf_b.cluster) return surf_a.cluster < surf_b.cluster;
+        return a < b;
+    });
+
+    int num_verts = 0;
+    vertex *verts = arenaPush<vertex>(&m.scratch, total_verts);
+    out->num_indices = 0;
+    out->indices = arenaPush<uint32_t>(&m.scratch, total_indices);
+
+    float lightmap_scale_s = 1.0f / (float)(out->lightmap_width * 16);
+    float lightmap_scale_t = 1.0f / (float)(out->lightmap_height * 16);
+
+    for (int i = 0; i < m.num_surfaces; i++) {
+        surface *surf = m.surfaces + order[i];
+        const map_face &face = m.faces[surf->face];
+        bsp_texinfo texinfo = m.texinfos[face.texinfo];
+        const bsp_miptex *miptex = getMiptex(texinfo.miptex);
+        const texture_slot &slot = m.texture_slots[texinfo.miptex];
+
+        uint32_t first_vertex = (uint32_t)num_verts;
+        for (int j = 0; j < face.edge_count; j++) {
+            glm::vec3 pos = m.vertices[getVertexFromEdge(face.first_edge + j)];
+            glm::vec2 texcoord = glm::vec2(glm::dot(pos, texinfo.uaxis) + texinfo.uoffset,
+                                           glm::dot(pos, texinfo.vaxis) + texinfo.voffset);
+
+            // surfaces without a block of their own all sample the shared luxel
+            float s = (float)surf->lightmap_offset.x * 16 + 8;
+            float t = (float)surf->lightmap_offset.y * 16 + 8;
+            if (surf->lightmap_page >= 0) {
+                s += texcoord.s - (float)surf->tex_mins.s;
+                t += texcoord.t - (float)surf->tex_mins.t;
+            }
+
+            vertex &vert = verts[num_verts++];
+            vert.pos = pos;
+            vert.texcoord = texcoord;
+            vert.lightmap = glm::vec2(s * lightmap_scale_s, t * lightmap_scale_t);
+            vert.info = (uint32_t)surface_entries[order[i]];
+        }
+
+        // repeating textures can move a face by whole tiles, which keeps its
+        // texcoords small. the steps are coarse so that neighbours mostly
+        // move alike and still weld. the sky is projected from the position
+        // alone and the water ripple is not periodic in whole tiles
+        if (isSkyTexture(miptex)) {
+            for (int j = 0; j < face.edge_count; j++) {
+                verts[first_vertex + j].texcoord = glm::vec2(0.0f);
+            }
+        } else if (slot.bucket != -1) {
+            glm::vec2 step = glm::vec2(miptex->width * glm::max(1, MAP_TEXCOORD_SHIFT / (int)miptex->width),
+                                       miptex->height * glm::max(1, MAP_TEXCOORD_SHIFT / (int)miptex->height));
+            glm::vec2 min_texcoord = glm::vec2(FLT_MAX);
+            for (int j = 0; j < face.edge_count; j++) {
+                min_texcoord = glm::min(min_texcoord, verts[first_vertex + j].texcoord);
+            }
+            glm::vec2 shift = glm::floor(min_texcoord / step) * step;
+            for (int j = 0; j < face.edge_count; j++) {
+                verts[first_vertex + j].texcoord -= shift;
+            }
+        }
+
+        // the faces of a cluster get interleaved, so a surface only knows
+        // where its cluster's range starts
+        const surface *prev = i > 0 ? m.surfaces + order[i - 1] : 0;
+        bool new_range = !prev || prev->batch != surf->batch || prev->cluster != surf->cluster;
+        surf->first_index = new_range ? out->num_indices : prev->first_index;
+        surf->num_indices = (face.edge_count - 2) * 3;
+        for (int j = 1; j < face.edge_count - 1; j++) {
+            out->indices[out->num_indices++] = first_vertex;
+            out->indices[out->num_indices++] = first_vertex + j;
+            out->indices[out->num_indices++] = first_vertex + j + 1;
+        }
     }
 
-    uint64_t max_vertex_buffer_size = sizeof(vertex) * 65536;
-    uint64_t num_vertex_buffers = (uint64_t)loaded_map.miptex_lump->miptex_count;
+    int num_corners = num_verts;
+    num_verts = weldVertices(verts, num_verts, out->indices, out->num_indices);
+    int64_t transforms_before = simulateVertexCache(out->indices, out->num_indices, num_verts, VCACHE_SIZE, &m.scratch);
 
-    vertex **vertex_buffers = (vertex **)malloc(sizeof(vertex *) * num_vertex_buffers);
-    for (uint64_t i = 0; i < num_vertex_buffers; i++) {
-        vertex_buffers[i] = (vertex *)malloc(sizeof(vertex) * max_vertex_buffer_size);
+    for (int i = 0; i < m.num_surfaces; i++) {
+        const surface &surf = m.surfaces[order[i]];
+        if (i + 1 < m.num_surfaces && m.surfaces[order[i + 1]].first_index == surf.first_index) continue;
+        int end = i + 1 < m.num_surfaces ? m.surfaces[order[i + 1]].first_index : out->num_indices;
+        optimizeVertexCache(out->indices + surf.first_index, end - surf.first_index, &m.scratch);
     }
+    num_verts = reorderVertices(verts, num_verts, out->indices, out->num_indices);
+    int64_t transforms_after = simulateVertexCache(out->indices, out->num_indices, num_verts, VCACHE_SIZE, &m.scratch);
+
+    out->format = VERTEX_FORMAT_FULL;
+    out->num_verts = num_verts;
+    out->verts = verts;
+    out->position_offset = glm::vec3(0.0f);
+    out->position_scale = 1.0f;
+    if (m.packed_vertices) mapPackVertices(out);
+
+    float elapsed_ms = (float)(SDL_GetPerformanceCounter() - start) * 1000.0f / SDL_GetPerformanceFrequency();
+    std::cout << "mesh: " << num_corners << " face corners welded to " << out->num_verts << " vertices of "
+              << getVertexSize(out->format) << " bytes, " << out->num_indices / 3 << " triangles, "
+              << transforms_before << " -> " << transforms_after << " vertex shader runs with a " << VCACHE_SIZE
+              << " entry cache, built in " << elapsed_ms << " ms" << std::endl;
+}
 
-    int *vertex_buffers_num_vertices = (int *)malloc(sizeof(int) * num_vertex_buffers);
-    memset(vertex_buffers_num_vertices, 0, sizeof(int) * num_vertex_buffers);
+static int16_t packTexcoord(float texels) {
+    return (int16_t)lroundf(texels * PACKED_TEXCOORD_STEPS);
+}
+
+static uint16_t packNormalized(float value) {
+    return (uint16_t)lroundf(glm::clamp(value, 0.0f, 1.0f) * 65535.0f);
+}
 
+// switches the build over to packed vertices when every one of them fits,
+// otherwise it stays with the full layout
+bool mapPackVertices(map_build *build) {
+    if (build->format != VERTEX_FORMAT_FULL) return false;
+    const vertex *verts = (const vertex *)build->verts;
+    glm::vec3 mins = glm::vec3(FLT_MAX);
+    glm::vec3 maxs = glm::vec3(-FLT_MAX);
+    float max_texcoord = 0.0f;
+    for (int i = 0; i < build->num_verts; i++) {
+        mins = glm::min(mins, verts[i].pos);
+        maxs = glm::max(maxs, verts[i].pos);
+        max_texcoord = glm::max(max_texcoord, glm::max(fabsf(verts[i].texcoord.s), fabsf(verts[i].texcoord.t)));
+    }
+    glm::vec3 center = glm::round((mins + maxs) * 0.5f);
+    glm::vec3 extents = build->num_verts > 0 ? glm::max(maxs - center, center - mins) : glm::vec3(0.0f);
+    float half_size = glm::max(extents.x, glm::max(extents.y, extents.z));
+    int steps = PACKED_POSITION_MAX_STEPS;
+    while (steps > PACKED_POSITION_MIN_STEPS && half_size * steps > 32767.0f) {
+        steps >>= 1;
+    }
+
+    const char *reason = 0;
+    if (build->num_surface_infos > 65536) reason = "too many surface infos";
+    if (half_size * steps > 32767.0f) reason = "map too large";
+    if (max_texcoord * PACKED_TEXCOORD_STEPS > 32767.0f) reason = "texcoords out of range";
+    if (reason) {
+        std::cout << "mesh: " << reason << " for packed vertices, keeping " << sizeof(vertex) << " bytes" << std::endl;
+        return false;
+    }
+
+    packed_vertex *packed = arenaPush<packed_vertex>(&loaded_map.scratch, build->num_verts);
+    for (int i = 0; i < build->num_verts; i++) {
+        const vertex &v = verts[i];
+        packed_vertex &p = packed[i];
+        for (int j = 0; j < 3; j++) {
+            p.pos[j] = (int16_t)lroundf((v.pos[j] - center[j]) * steps);
+        }
+        p.texcoord[0] = packTexcoord(v.texcoord.s);
+        p.texcoord[1] = packTexcoord(v.texcoord.t);
+        p.lightmap[0] = packNormalized(v.lightmap.s);
+        p.lightmap[1] = packNormalized(v.lightmap.t);
+        p.info = (uint16_t)v.info;
+    }
+    build->format = VERTEX_FORMAT_PACKED;
+    build->verts = packed;
+    build->position_offset = center;
+    build->position_scale = 1.0f / (float)steps;
+    return true;
+}
+
+void mapUploadLightmap(const map_build *build) {
+    int width = build->lightmap_width;
+    int height = build->lightmap_height;
+    loaded_map.lightmap_width = width;
+    loaded_map.lightmap_height = height;
+    loaded_map.num_lightmap_pages = build->num_lightmap_pages;
+
+    loaded_map.lightmap_tex = createTextureArray(width, height, build->num_lightmap_pages, 1, GL_RGBA, GL_LINEAR, GL_CLAMP_TO_EDGE);
+    trackGLResource(GL_RESOURCE_TEXTURE, loaded_map.lightmap_tex);
+    for (int i = 0; i < build->num_lightmap_pages; i++) {
+        const uint8_t *page = build->lightmap + (size_t)width * height * LIGHTMAP_CHANNELS * i;
+        updateTextureArrayLayer(loaded_map.lightmap_tex, i, width, height, 1, GL_RGBA, page);
+    }
+
+    // starts out black, the texture is filled once so no layer is undefined
+    mapInitDynamicLights(width, height, build->num_lightmap_pages);
+    dynamic_lightmap &dl = loaded_map.dlights;
+    dl.tex = createTextureArray(width, height, dl.num_pages, 1, GL_RED, GL_LINEAR, GL_CLAMP_TO_EDGE);
+    trackGLResource(GL_RESOURCE_TEXTURE, dl.tex);
+    for (int i = 0; i < dl.num_pages; i++) {
+        updateTextureArrayLayer(dl.tex, i, width, height, 1, GL_RED, dl.luxels + (size_t)width * height * i);
+    }
+
+    loaded_map.world_material.setTextureArray("Texture1", loaded_map.lightmap_tex);
+    loaded_map.world_material.setTextureArray("Texture2", dl.tex);
+    for (int i = 0; i < loaded_map.num_materials; i++) {
+        loaded_map.materials[i].setTextureArray("Texture1", loaded_map.lightmap_tex);
+    }
+}
+
+// cpu side only so it can run without a context, the texture is made by
+// mapUploadLightmap, needs mapInitVisibility first
+void mapInitDynamicLights(int width, int height, int num_pages) {
+    dynamic_lightmap &dl = loaded_map.dlights;
+    dl = {};
+    dl.width = width;
+    dl.height = height;
+    dl.num_pages = num_pages;
+    dl.luxels = arenaPush<uint8_t>(&loaded_map.memory, (int64_t)width * height * num_pages);
+
+    int64_t max_block = 1;
     for (int i = 0; i < loaded_map.num_surfaces; i++) {
-        surface *surf = loaded_map.surfaces + i;
-        bsp_face face = loaded_map.faces[surf->face];
-        bsp_texinfo texinfo = loaded_map.texinfos[face.texinfo];
-        bsp_miptex *miptex = (bsp_miptex *)((uint8_t *)loaded_map.miptex_lump + loaded_map.miptex_lump->data_offset[texinfo.miptex]);
-        glm::vec3 *map_vertices = loaded_map.vertices;
-
-        int vertex_buffer_idx = texinfo.miptex;
-        vertex *vertex_buffer = vertex_buffers[vertex_buffer_idx];
-        int *num_vertices = vertex_buffers_num_vertices + vertex_buffer_idx;
-
-        int lightmap_block_width = (surf->uv_extents.s >> 4) + 1;
-        int lightmap_block_height = (surf-> uv_extents.t >> 4) + 1;
-        allocBlock(lightmap_block_width, lightmap_block_height, &surf->lightmap_offset.x, &surf->lightmap_offset.y);
-
-        uint8_t *lightmap_texels = loaded_map.lightmap + face.light_offset;
-
-        for (int y = 0; y < lightmap_block_height; y++) {
-            for (int x = 0; x < lightmap_block_width; x++) {
-                uint8_t pixel = lightmap_texels[x + y * lightmap_block_width];
-                uint32_t image_idx = (x + surf->lightmap_offset.x) + (y + surf->lightmap_offset.y) * LIGHTMAP_WIDTH;
-
-                if (face.light_offset == -1) {
-                    lightmap_bitmap[image_idx] = 28;
-                } else {
-                    lightmap_bitmap[image_idx] = pixel;
+        const surface &surf = loaded_map.surfaces[i];
+        if (surf.lightmap_page < 0) continue;
+        glm::ivec2 size = blockSize(surf);
+        max_block = std::max(max_block, (int64_t)size.x * size.y);
+    }
+
+    dl.light_masks = arenaPush<uint32_t>(&loaded_map.memory, loaded_map.num_surfaces);
+    dl.lit_frames = arenaPush<int32_t>(&loaded_map.memory, loaded_map.num_surfaces);
+    dl.lit[0] = arenaPush<int32_t>(&loaded_map.memory, loaded_map.num_surfaces);
+    dl.lit[1] = arenaPush<int32_t>(&loaded_map.memory, loaded_map.num_surfaces);
+    dl.rects = arenaPush<lightmap_rect>(&loaded_map.memory, loaded_map.num_surfaces * 2);
+    dl.accum = arenaPush<int32_t>(&loaded_map.memory, max_block);
+    dl.block = arenaPush<uint8_t>(&loaded_map.memory, max_block);
+}
+
+// the light clamped onto the block has to be within the radius, and lights
+// behind a face never reach it
+static bool lightReachesSurface(const surface &surf, const dynamic_light &light) {
+    const map_face &face = loaded_map.faces[surf.face];
+    const bsp_plane &plane = loaded_map.planes[face.plane];
+    float dist = glm::dot(light.origin, plane.normal) - plane.dist;
+    if ((face.side ? -dist : dist) < -0.25f) return false;
+
+    const bsp_texinfo &texinfo = loaded_map.texinfos[face.texinfo];
+    glm::vec3 impact = light.origin - plane.normal * dist;
+    float local_s = glm::dot(impact, texinfo.uaxis) + texinfo.uoffset - (float)surf.tex_mins.s;
+    float local_t = glm::dot(impact, texinfo.vaxis) + texinfo.voffset - (float)surf.tex_mins.t;
+    float s = local_s - glm::clamp(local_s, 0.0f, (float)surf.uv_extents.s);
+    float t = local_t - glm::clamp(local_t, 0.0f, (float)surf.uv_extents.t);
+    return s * s + t * t + dist * dist < light.radius * light.radius;
+}
+
+// walks down from the root like quake's R_MarkLights, only nodes whose plane
+// lies within the radius have faces the light can reach
+static void markDynamicLight(int node_idx, const dynamic_light &light, int light_idx) {
+    dynamic_lightmap &dl = loaded_map.dlights;
+    while (node_idx >= 0) {
+        const map_node &node = loaded_map.nodes[node_idx];
+        const bsp_plane &plane = loaded_map.planes[node.plane];
+        float dist = glm::dot(light.origin, plane.normal) - plane.dist;
+        if (dist > light.radius) {
+            node_idx = node.children[0];
+            continue;
+        }
+        if (dist < -light.radius) {
+            node_idx = node.children[1];
+            continue;
+        }
+
+        for (int i = 0; i < node.face_count; i++) {
+            int surf_idx = loaded_map.face_surfaces[node.first_face + i];
+            if (surf_idx < 0 || loaded_map.surfaces[surf_idx].lightmap_page < 0) continue;
+            if (!lightReachesSurface(loaded_map.surfaces[surf_idx], light)) continue;
+            if (dl.lit_frames[surf_idx] != dl.frame) {
+                dl.lit_frames[surf_idx] = dl.frame;
+                dl.light_masks[surf_idx] = 0;
+                dl.lit[0][dl.num_lit[0]++] = surf_idx;
+            }
+            dl.light_masks[surf_idx] |= 1u << light_idx;
+        }
+
+        markDynamicLight(node.children[0], light, light_idx);
+        node_idx = node.children[1];
+    }
+}
+
+static void addDirtyRect(const surface &surf) {
+    dynamic_lightmap &dl = loaded_map.dlights;
+    glm::ivec2 size = blockSize(surf) + LIGHTMAP_PADDING * 2;
+    lightmap_rect &rect = dl.rects[dl.num_rects++];
+    rect.page = surf.lightmap_page;
+    rect.x = surf.lightmap_offset.x - LIGHTMAP_PADDING;
+    rect.y = surf.lightmap_offset.y - LIGHTMAP_PADDING;
+    rect.width = size.x;
+    rect.height = size.y;
+}
+
+// same falloff as quake's R_AddDynamicLights, in lightmap units where 255 is
+// a bit under twice the texture's own brightness
+static void relightSurface(int surf_idx, const dynamic_light *lights) {
+    dynamic_lightmap &dl = loaded_map.dlights;
+    const surface &surf = loaded_map.surfaces[surf_idx];
+    const map_face &face = loaded_map.faces[surf.face];
+    const bsp_texinfo &texinfo = loaded_map.texinfos[face.texinfo];
+    const bsp_plane &plane = loaded_map.planes[face.plane];
+    glm::ivec2 size = blockSize(surf);
+    int num_luxels = size.x * size.y;
+
+    memset(dl.accum, 0, sizeof(int32_t) * num_luxels);
+    uint32_t mask = dl.lit_frames[surf_idx] == dl.frame ? dl.light_masks[surf_idx] : 0;
+    for (int i = 0; mask; i++, mask >>= 1) {
+        if (!(mask & 1)) continue;
+        const dynamic_light &light = lights[i];
+        float dist = glm::dot(light.origin, plane.normal) - plane.dist;
+        float radius = light.radius - fabsf(dist);
+        if (radius <= 0.0f) continue;
+
+        glm::vec3 impact = light.origin - plane.normal * dist;
+        float local_s = glm::dot(impact, texinfo.uaxis) + texinfo.uoffset - (float)surf.tex_mins.s;
+        float local_t = glm::dot(impact, texinfo.vaxis) + texinfo.voffset - (float)surf.tex_mins.t;
+        for (int t = 0; t < size.y; t++) {
+            float td = fabsf(local_t - (float)(t * 16));
+            if (td >= radius) continue;
+            int32_t *row = dl.accum + t * size.x;
+            for (int s = 0; s < size.x; s++) {
+                float sd = fabsf(local_s - (float)(s * 16));
+                float d = sd > td ? sd + td * 0.5f : td + sd * 0.5f;
+                if (d < radius) row[s] += (int32_t)(radius - d);
+            }
+        }
+    }
+
+    for (int i = 0; i < num_luxels; i++) {
+        dl.block[i] = (uint8_t)std::min(dl.accum[i], 255);
+    }
+    uint8_t *page = dl.luxels + (int64_t)dl.width * dl.height * surf.lightmap_page;
+    copyLightmapBlock(dl.block, size.x, size.y, page, dl.width, surf.lightmap_offset.x - LIGHTMAP_PADDING,
+                      surf.lightmap_offset.y - LIGHTMAP_PADDING, 0, 1);
+    addDirtyRect(surf);
+}
+
+// neighbours in the atlas merge while the union wastes little, the skyline
+// packs similar heights side by side so rows often join up
+static void coalesceDirtyRects() {
+    dynamic_lightmap &dl = loaded_map.dlights;
+    std::sort(dl.rects, dl.rects + dl.num_rects, [](const lightmap_rect &a, const lightmap_rect &b) {
+        if (a.page != b.page) return a.page < b.page;
+        if (a.y != b.y) return a.y < b.y;
+        return a.x < b.x;
+    });
+
+    int num_rects = 0;
+    for (int i = 0; i < dl.num_rects; i++) {
+        const lightmap_rect &rect = dl.rects[i];
+        if (num_rects > 0) {
+            lightmap_rect &last = dl.rects[num_rects - 1];
+            int x0 = std::min(last.x, rect.x);
+            int y0 = std::min(last.y, rect.y);
+            int x1 = std::max(last.x + last.width, rect.x + rect.width);
+            int y1 = std::max(last.y + last.height, rect.y + rect.height);
+            int64_t merged = (int64_t)(x1 - x0) * (y1 - y0);
+            int64_t separate = (int64_t)last.width * last.height + (int64_t)rect.width * rect.height;
+            if (last.page == rect.page && merged - separate <= LIGHTMAP_UPLOAD_SLACK) {
+                last = { rect.page, x0, y0, x1 - x0, y1 - y0 };
+                continue;
+            }
+        }
+        dl.rects[num_rects++] = rect;
+    }
+    dl.num_rects = num_rects;
+}
+
+// rebuilds the blocks of every surface lit now or in the previous frame, the
+// cost follows the lit surfaces and the nodes the lights touch
+void mapUpdateDynamicLights(const dynamic_light *lights, int num_lights) {
+    dynamic_lightmap &dl = loaded_map.dlights;
+    if (!dl.luxels) return;
+    // nothing to light and nothing left lit to clear
+    if (num_lights == 0 && dl.num_lit[0] == 0) {
+        dl.num_rects = 0;
+        dl.num_dirty = 0;
+        return;
+    }
+
+    std::swap(dl.lit[0], dl.lit[1]);
+    dl.num_lit[1] = dl.num_lit[0];
+    dl.num_lit[0] = 0;
+    dl.num_rects = 0;
+    dl.frame++;
+
+    num_lights = std::min(num_lights, MAP_MAX_DYNAMIC_LIGHTS);
+    int root = loaded_map.models[0].head_nodes[0];
+    for (int i = 0; i < num_lights; i++) {
+        if (lights[i].radius > 0.0f) markDynamicLight(root, lights[i], i);
+    }
+
+    // anything lit last frame and not this one goes back to black
+    for (int i = 0; i < dl.num_lit[1]; i++) {
+        int surf_idx = dl.lit[1][i];
+        if (dl.lit_frames[surf_idx] != dl.frame) relightSurface(surf_idx, lights);
+    }
+    for (int i = 0; i < dl.num_lit[0]; i++) {
+        relightSurface(dl.lit[0][i], lights);
+    }
+
+    dl.num_dirty = dl.num_rects;
+    coalesceDirtyRects();
+}
+
+void mapUploadDynamicLights() {
+    const dynamic_lightmap &dl = loaded_map.dlights;
+    if (!dl.tex) return;
+    for (int i = 0; i < dl.num_rects; i++) {
+        const lightmap_rect &rect = dl.rects[i];
+        const uint8_t *data = dl.luxels + (int64_t)dl.width * dl.height * rect.page + rect.y * dl.width + rect.x;
+        updateTextureArrayRect(dl.tex, rect.page, rect.x, rect.y, rect.width, rect.height, dl.width, GL_RED, data);
+    }
+}
+
+// quake's run length coding, a zero byte is followed by a count of zero bytes
+static void decompressLeafPVS(int leaf_idx, uint8_t *out) {
+    const uint8_t *in = loaded_map.vis + loaded_map.leafs[leaf_idx].visoffset;
+    const uint8_t *end = loaded_map.vis + loaded_map.num_vis_bytes;
+    int row_bytes = loaded_map.pvs_row_bytes;
+    int i = 0;
+    while (i < row_bytes && in < end) {
+        if (*in) {
+            out[i++] = *in++;
+            continue;
+        }
+        if (in + 1 == end) break;
+        int run = std::min((int)in[1], row_bytes - i);
+        memset(out + i, 0, run);
+        i += run;
+        in += 2;
+    }
+    // a row cut short by the end of the lump shows the rest
+    memset(out + i, 0xff, row_bytes - i);
+}
+
+static bool hasLeafPVS(int leaf_idx) {
+    int32_t offset = loaded_map.leafs[leaf_idx].visoffset;
+    return leaf_idx > 0 && offset >= 0 && offset < loaded_map.num_vis_bytes;
+}
+
+// 0 when everything is visible, the solid leaf and maps without vis included
+static const uint8_t *getLeafPVS(int leaf_idx) {
+    if (!hasLeafPVS(leaf_idx)) return 0;
+    if (loaded_map.pvs) return loaded_map.pvs + (int64_t)loaded_map.pvs_row_bytes * leaf_idx;
+    decompressLeafPVS(leaf_idx, loaded_map.pvs_row);
+    return loaded_map.pvs_row;
+}
+
+// pvs rows and the per frame culling state, runs once the surfaces and
+// clusters exist
+void mapInitVisibility() {
+    map &m = loaded_map;
+    m.num_visleafs = glm::clamp(m.models[0].visleafs, 0, m.num_leafs - 1);
+    m.pvs_row_bytes = (m.num_visleafs + 7) >> 3;
+    m.pvs_row = arenaPush<uint8_t>(&m.memory, m.pvs_row_bytes);
+    int64_t pvs_size = (int64_t)m.pvs_row_bytes * m.num_leafs;
+    if (pvs_size <= MAP_MAX_PVS_BYTES) {
+        m.pvs = arenaPush<uint8_t>(&m.memory, pvs_size);
+        for (int i = 0; i < m.num_leafs; i++) {
+            if (hasLeafPVS(i)) decompressLeafPVS(i, m.pvs + (int64_t)m.pvs_row_bytes * i);
+        }
+    }
+
+    m.node_parents = arenaPush<int32_t>(&m.memory, m.num_nodes);
+    m.leaf_parents = arenaPush<int32_t>(&m.memory, m.num_leafs);
+    m.node_vis_frames = arenaPush<int32_t>(&m.memory, m.num_nodes);
+    m.leaf_vis_frames = arenaPush<int32_t>(&m.memory, m.num_leafs);
+    for (int i = 0; i < m.num_nodes; i++) {
+        m.node_parents[i] = -1;
+    }
+    for (int i = 0; i < m.num_nodes; i++) {
+        for (int j = 0; j < 2; j++) {
+            int child = m.nodes[i].children[j];
+            if (child >= 0) m.node_parents[child] = i;
+            else m.leaf_parents[~child] = i;
+        }
+    }
+
+    // the cluster ranges come from where the surfaces actually sit in the
+    // index buffer, so a cache built with other clusters still draws right.
+    // the surfaces of a range all carry its start
+    int *order = arenaPush<int>(&m.scratch, m.num_surfaces);
+    for (int i = 0; i < m.num_surfaces; i++) {
+        order[i] = i;
+    }
+    std::sort(order, order + m.num_surfaces, [&](int a, int b) {
+        return m.surfaces[a].first_index < m.surfaces[b].first_index;
+    });
+    cluster_range *ranges = arenaPush<cluster_range>(&m.scratch, m.num_surfaces);
+    int *range_batches = arenaPush<int>(&m.scratch, m.num_surfaces);
+    int num_ranges = 0;
+    for (int i = 0; i < m.num_surfaces; i++) {
+        const surface &surf = m.surfaces[order[i]];
+        if (num_ranges > 0) {
+            cluster_range &last = ranges[num_ranges - 1];
+            if (range_batches[num_ranges - 1] == surf.batch && last.cluster == surf.cluster &&
+                last.first_index == surf.first_index) {
+                last.num_indices += surf.num_indices;
+                continue;
+            }
+        }
+        range_batches[num_ranges] = surf.batch;
+        ranges[num_ranges++] = { surf.cluster, surf.first_index, surf.num_indices };
+        m.batches[surf.batch].num_ranges++;
+    }
+
+    // a batch never draws more ranges than it has clusters
+    for (int i = 0; i < m.num_batches; i++) {
+        draw_batch &batch = m.batches[i];
+        batch.ranges = arenaPush<cluster_range>(&m.memory, batch.num_ranges);
+        batch.counts = arenaPush<GLsizei>(&m.memory, batch.num_ranges);
+        batch.offsets = arenaPush<const void *>(&m.memory, batch.num_ranges);
+        batch.num_ranges = 0;
+        batch.num_draws = 0;
+    }
+    for (int i = 0; i < num_ranges; i++) {
+        draw_batch &batch = m.batches[range_batches[i]];
+        batch.ranges[batch.num_ranges++] = ranges[i];
+    }
+    m.view_leaf = -1;
+}
+
+// a source child as a collision child, nodes keep their source index until
+// the tree is laid out
+static int32_t collisionChild(int hull, int node_idx, int side) {
+    if (hull == MAP_HULL_POINT) {
+        int child = loaded_map.nodes[node_idx].children[side];
+        if (child >= 0) return child;
+        int contents = -loaded_map.leafs[~child].contents & COLLISION_CONTENTS_MASK;
+        return ~((~child << COLLISION_CONTENTS_BITS) | contents);
+    }
+    int child = loaded_map.clipnodes[node_idx].children[side];
+    return child >= 0 ? child : ~(-child & COLLISION_CONTENTS_MASK);
+}
+
+static int collisionContents(int32_t child) {
+    return -(~child & COLLISION_CONTENTS_MASK);
+}
+
+struct collision_builder {
+    int32_t hull;
+    int32_t *indices; // where each source node ended up, -1 until placed
+    int32_t *order;   // the source node of each collision node
+    int32_t num_nodes;
+    int32_t *walks;   // the last walk below a block that passed each node
+    int32_t num_walks;
+};
+
+static void placeNode(collision_builder &b, int node_idx) {
+    b.indices[node_idx] = b.num_nodes;
+    b.order[b.num_nodes++] = node_idx;
+}
+
+static void layoutVEB(collision_builder &b, int node_idx, int levels);
+
+// lays out every subtree hanging depth levels below node. nodes are only
+// walked once per block, a corrupt file can share them between parents
+static void layoutVEBBelow(collision_builder &b, int walk, int node_idx, int depth, int levels) {
+    if (b.walks[node_idx] == walk) return;
+    b.walks[node_idx] = walk;
+    if (depth == 0) {
+        layoutVEB(b, node_idx, levels);
+        return;
+    }
+    for (int side = 0; side < 2; side++) {
+        int child = collisionChild(b.hull, node_idx, side);
+        if (child >= 0) layoutVEBBelow(b, walk, child, depth - 1, levels);
+    }
+}
+
+// the top half of the levels as one block, then each subtree below it as
+// a block of its own. whatever size a cache line or page is, a walk down
+// crosses into a new block only every so many levels
+static void layoutVEB(collision_builder &b, int node_idx, int levels) {
+    if (b.indices[node_idx] >= 0) return;
+    if (levels == 1) {
+        placeNode(b, node_idx);
+        return;
+    }
+    int top = levels / 2;
+    layoutVEB(b, node_idx, top);
+    layoutVEBBelow(b, ++b.num_walks, node_idx, top, levels - top);
+}
+
+// the render nodes or clipnodes of a hull as a collision tree, planes are
+// copied into the nodes so a walk never touches the plane lump
+void mapBuildCollisionHull(int hull, collision_order order, arena *memory, collision_hull *out) {
+    const map &m = loaded_map;
+    int head = m.models[0].head_nodes[hull];
+    *out = {};
+    if (head < 0) {
+        out->head = ~(-head & COLLISION_CONTENTS_MASK);
+        return;
+    }
+
+    // children always come after their parent, so subtrees fill in backwards
+    int num_source = hull == MAP_HULL_POINT ? m.num_nodes : m.num_clipnodes;
+    int32_t *heights = arenaPush<int32_t>(&loaded_map.scratch, num_source);
+    int32_t *sizes = arenaPush<int32_t>(&loaded_map.scratch, num_source);
+    for (int i = num_source - 1; i >= head; i--) {
+        heights[i] = 1;
+        sizes[i] = 1;
+        for (int side = 0; side < 2; side++) {
+            int child = collisionChild(hull, i, side);
+            if (child < 0) continue;
+            heights[i] = glm::max(heights[i], heights[child] + 1);
+            sizes[i] = glm::min(sizes[i] + sizes[child], num_source);
+        }
+    }
+
+    collision_builder b;
+    b.hull = hull;
+    b.indices = arenaPush<int32_t>(&loaded_map.scratch, num_source);
+    b.order = arenaPush<int32_t>(&loaded_map.scratch, num_source);
+    b.num_nodes = 0;
+    for (int i = 0; i < num_source; i++) {
+        b.indices[i] = -1;
+    }
+    if (order == COLLISION_ORDER_VEB) {
+        b.walks = arenaPush<int32_t>(&loaded_map.scratch, num_source);
+        b.num_walks = 0;
+        layoutVEB(b, head, heights[head]);
+    } else {
+        // every placed node pushes at most two children
+        int32_t *stack = arenaPush<int32_t>(&loaded_map.scratch, 2 * num_source + 1);
+        int depth = 0;
+        stack[depth++] = head;
+        while (depth > 0) {
+            int node_idx = stack[--depth];
+            if (b.indices[node_idx] >= 0) continue;
+            placeNode(b, node_idx);
+            // the bigger subtree goes right after its parent, a walk is more
+            // likely to head there and the two share a cache line half the time
+            int front = collisionChild(hull, node_idx, 0);
+            int back = collisionChild(hull, node_idx, 1);
+            int front_size = front >= 0 ? sizes[front] : 0;
+            int back_size = back >= 0 ? sizes[back] : 0;
+            int first = front_size >= back_size ? front : back;
+            int second = front_size >= back_size ? back : front;
+            if (second >= 0) stack[depth++] = second;
+            if (first >= 0) stack[depth++] = first;
+        }
+    }
+
+    // line aligned so nodes pair up the way the order intends
+    collision_node *nodes = (collision_node *)arenaAlloc(memory, sizeof(collision_node) * b.num_nodes, 64);
+    nodes[0].parent = -1;
+    for (int i = 0; i < b.num_nodes; i++) {
+        int node_idx = b.order[i];
+        int plane_idx = hull == MAP_HULL_POINT ? m.nodes[node_idx].plane : m.clipnodes[node_idx].plane;
+        const bsp_plane &plane = m.planes[plane_idx];
+        collision_node &node = nodes[i];
+        node.normal = plane.normal;
+        node.dist = plane.dist;
+        // the axis comes from the normal, the type in the file is not trusted
+        uint32_t axis = 3;
+        for (int j = 0; j < 3; j++) {
+            if (plane.normal[j] == 1.0f) axis = j;
+            if (plane.normal[j] < 0.0f) node.bits |= 1u << (COLLISION_SIGN_SHIFT + j);
+        }
+        node.bits |= axis;
+        for (int side = 0; side < 2; side++) {
+            int child = collisionChild(hull, node_idx, side);
+            if (child >= 0) {
+                child = b.indices[child];
+                nodes[child].parent = i;
+            }
+            node.children[side] = child;
+        }
+    }
+    out->nodes = nodes;
+    out->num_nodes = b.num_nodes;
+    out->head = 0;
+}
+
+// the planes of hull 0 that bound each leaf. a plane above a leaf whose
+// bounds lie wholly on the leaf's side can never be the one a point in
+// the bounds is on the wrong side of, so only the others are kept
+static void buildLeafHints() {
+    map &m = loaded_map;
+    const collision_hull &hull = m.collision[MAP_HULL_POINT];
+    int32_t *parents = arenaPush<int32_t>(&m.scratch, m.num_leafs);
+    int32_t *num_parents = arenaPush<int32_t>(&m.scratch, m.num_leafs);
+    for (int i = 0; i < hull.num_nodes; i++) {
+        for (int side = 0; side < 2; side++) {
+            int child = hull.nodes[i].children[side];
+            if (child >= 0) continue;
+            int leaf_idx = ~child >> COLLISION_CONTENTS_BITS;
+            parents[leaf_idx] = i;
+            num_parents[leaf_idx]++;
+        }
+    }
+
+    // counted on the first pass and written on the second
+    m.leaf_hints = arenaPush<leaf_hint>(&m.memory, m.num_leafs);
+    leaf_plane *planes = 0;
+    int num_planes = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        num_planes = 0;
+        for (int i = 0; i < m.num_leafs; i++) {
+            const map_leaf &leaf = m.leafs[i];
+            leaf_hint &hint = m.leaf_hints[i];
+            hint.min = glm::vec3(leaf.min[0], leaf.min[1], leaf.min[2]);
+            hint.max = glm::vec3(leaf.max[0], leaf.max[1], leaf.max[2]);
+            hint.first_plane = num_planes;
+            hint.num_planes = -1;
+            if (num_parents[i] != 1) continue;
+
+            const collision_node &parent = hull.nodes[parents[i]];
+            int child = parent.children[parent.children[0] < 0 && ~parent.children[0] >> COLLISION_CONTENTS_BITS == i ? 0 : 1];
+            for (int node_idx = parents[i]; node_idx >= 0; node_idx = hull.nodes[node_idx].parent) {
+                const collision_node &node = hull.nodes[node_idx];
+                float flip = node.children[1] == child ? -1.0f : 1.0f;
+                child = node_idx;
+                // the corner of the bounds furthest behind the plane facing
+                // the leaf, the sign bits of the normal pick it
+                glm::vec3 corner;
+                for (int j = 0; j < 3; j++) {
+                    bool negative = (node.bits >> (COLLISION_SIGN_SHIFT + j)) & 1;
+                    corner[j] = negative == (flip > 0.0f) ? hint.max[j] : hint.min[j];
                 }
+                if ((glm::dot(node.normal, corner) - node.dist) * flip > 0.0f) continue;
+                if (planes) planes[num_planes] = { node.normal * flip, node.dist * flip };
+                num_planes++;
             }
+            hint.num_planes = num_planes - hint.first_plane;
         }
+        if (!planes) planes = arenaPush<leaf_plane>(&m.memory, num_planes);
+    }
+    m.leaf_planes = planes;
+}
 
-        for (int j = 0; j < surf->num_indices; j++) {
-            int vert_idx = indices[surf->first_index + j];
-            glm::vec3 pos = map_vertices[vert_idx];
-            glm::vec2 texcoord = glm::vec2(
-                (glm::dot(pos, texinfo.uaxis) + texinfo.uoffset) / miptex->width,
-                (glm::dot(pos, texinfo.vaxis) + texinfo.voffset) / miptex->height
-            );
+void mapBuildCollision() {
+    for (int i = 0; i < MAP_NUM_COLLISION_HULLS; i++) {
+        mapBuildCollisionHull(i, COLLISION_ORDER_DEPTH_FIRST, &loaded_map.memory, &loaded_map.collision[i]);
+    }
+    buildLeafHints();
+}
 
-            float s = glm::dot(pos, texinfo.uaxis) + texinfo.uoffset;
-            s -= (float)surf->tex_mins.s;
-            s += (float)surf->lightmap_offset.x * 16;
-            s += 8;
-            s /= (float)(LIGHTMAP_WIDTH * 16);
+static float collisionDistance(const collision_node &node, const glm::vec3 &point) {
+    uint32_t axis = node.bits & COLLISION_AXIS_MASK;
+    if (axis < 3) return point[axis] - node.dist;
+    return glm::dot(point, node.normal) - node.dist;
+}
+
+// the leaf child of hull 0 the point is in
+static int32_t collisionLeafChild(const collision_hull &hull, int32_t node_idx, const glm::vec3 &point) {
+    while (node_idx >= 0) {
+        const collision_node &node = hull.nodes[node_idx];
+        node_idx = node.children[collisionDistance(node, point) < 0.0f ? 1 : 0];
+    }
+    return node_idx;
+}
+
+// a point strictly inside the leaf, on none of its planes, lands in it
+// whichever side a walk sends points right on a plane to
+static bool leafHolds(int leaf_idx, const glm::vec3 &position) {
+    const map &m = loaded_map;
+    if (leaf_idx < 0 || leaf_idx >= m.num_leafs) return false;
+    const leaf_hint &hint = m.leaf_hints[leaf_idx];
+    if (hint.num_planes < 0) return false;
+    if (glm::any(glm::lessThan(position, hint.min)) || glm::any(glm::greaterThan(position, hint.max))) return false;
+    const leaf_plane *planes = m.leaf_planes + hint.first_plane;
+    for (int i = 0; i < hint.num_planes; i++) {
+        if (glm::dot(planes[i].normal, position) - planes[i].dist <= 0.0f) return false;
+    }
+    return true;
+}
+
+// unlike the contents walks a point right on a plane goes to the back, as
+// it always has for the view leaf. a hint that still holds the point skips
+// the walk, the leaf of the last frame usually does
+int findLeaf(const glm::vec3 &position, int hint_leaf) {
+    if (leafHolds(hint_leaf, position)) return hint_leaf;
+    const collision_hull &hull = loaded_map.collision[MAP_HULL_POINT];
+    int32_t node_idx = hull.head;
+    while (node_idx >= 0) {
+        const collision_node &node = hull.nodes[node_idx];
+        node_idx = node.children[collisionDistance(node, position) > 0.0f ? 0 : 1];
+    }
+    return ~node_idx >> COLLISION_CONTENTS_BITS;
+}
+
+// the contents of hull 0, the same as hullPointContents. the leaf found is
+// written back to the hint for the next query
+int pointContents(const glm::vec3 &position, int *hint_leaf) {
+    int leaf_idx;
+    if (hint_leaf && leafHolds(*hint_leaf, position)) {
+        leaf_idx = *hint_leaf;
+    } else {
+        const collision_hull &hull = loaded_map.collision[MAP_HULL_POINT];
+        leaf_idx = ~collisionLeafChild(hull, hull.head, position) >> COLLISION_CONTENTS_BITS;
+    }
+    if (hint_leaf) *hint_leaf = leaf_idx;
+    return loaded_map.leafs[leaf_idx].contents;
+}
+
+static int hullNodeContents(const collision_hull &hull, int node_idx, const glm::vec3 &point) {
+    return collisionContents(collisionLeafChild(hull, node_idx, point));
+}
 
-            float t = glm::dot(pos, texinfo.vaxis) + texinfo.voffset;
-            t -= (float)surf->tex_mins.t;
-            t += (float)surf->lightmap_offset.y * 16;
-            t += 8;
-            t /= (float)(LIGHTMAP_HEIGHT * 16);
+int hullPointContents(const glm::vec3 &point, int hull) {
+    const collision_hull &collision = loaded_map.collision[hull];
+    return hullNodeContents(collision, collision.head, point);
+}
 
-            vertex_buffer[*num_vertices].pos = pos;
-            vertex_buffer[*num_vertices].texcoord = texcoord;
-            vertex_buffer[*num_vertices].lightmap = glm::vec2(s, t);
-            *num_vertices = *num_vertices + 1;
+struct hull_trace {
+    const collision_hull *hull;
+    trace_result *result;
+};
+
+// quake's SV_RecursiveHullCheck, splits the segment at every plane it
+// crosses and walks the near side first, so the first solid leaf found is
+// the first one along the line. returns false once something was hit
+static bool traceHullNode(const hull_trace &trace, int node_idx, float start_frac, float end_frac,
+                          const glm::vec3 &start, const glm::vec3 &end) {
+    trace_result &result = *trace.result;
+    if (node_idx < 0) {
+        int contents = collisionContents(node_idx);
+        if (contents != BSP_CONTENTS_SOLID) {
+            result.all_solid = false;
+            result.contents = contents;
+        } else {
+            result.start_solid = true;
         }
+        return true;
     }
 
-    loaded_map.lightmap_tex = createTexture(lightmap_bitmap, LIGHTMAP_WIDTH, LIGHTMAP_HEIGHT, GL_RED, GL_LINEAR, GL_CLAMP_TO_EDGE);
-    free(lightmap_bitmap);
+    const collision_hull &hull = *trace.hull;
+    const collision_node &node = hull.nodes[node_idx];
+    float d1 = collisionDistance(node, start);
+    float d2 = collisionDistance(node, end);
+    if (d1 >= 0.0f && d2 >= 0.0f) return traceHullNode(trace, node.children[0], start_frac, end_frac, start, end);
+    if (d1 < 0.0f && d2 < 0.0f) return traceHullNode(trace, node.children[1], start_frac, end_frac, start, end);
+
+    // split right on the plane. quake splits a little in front of it, which
+    // leaves a gap the near side never walks when the line grazes the plane
+    int side = d1 < 0.0f ? 1 : 0;
+    float frac = glm::clamp(d1 / (d1 - d2), 0.0f, 1.0f);
+    float mid_frac = start_frac + (end_frac - start_frac) * frac;
+    glm::vec3 mid = start + (end - start) * frac;
+
+    if (!traceHullNode(trace, node.children[side], start_frac, mid_frac, start, mid)) return false;
+    int far_child = node.children[side ^ 1];
+    if (hullNodeContents(hull, far_child, mid) != BSP_CONTENTS_SOLID) {
+        return traceHullNode(trace, far_child, mid_frac, end_frac, mid, end);
+    }
+    // never got out of solid to begin with
+    if (result.all_solid) return false;
+
+    // the far side is solid, this plane is what the trace hit, it stops a
+    // little in front of it
+    result.normal = side ? -node.normal : node.normal;
+    result.dist = side ? -node.dist : node.dist;
+    result.contents = BSP_CONTENTS_SOLID;
+    frac = glm::max(side ? (d1 + MAP_TRACE_EPSILON) / (d1 - d2) : (d1 - MAP_TRACE_EPSILON) / (d1 - d2), 0.0f);
+    mid_frac = start_frac + (end_frac - start_frac) * frac;
+    mid = start + (end - start) * frac;
+    // that can still land inside a neighbouring solid, back off
+    while (hullNodeContents(hull, hull.head, mid) == BSP_CONTENTS_SOLID) {
+        frac -= 0.1f;
+        if (frac < 0.0f) break;
+        mid_frac = start_frac + (end_frac - start_frac) * frac;
+        mid = start + (end - start) * frac;
+    }
+    result.fraction = mid_frac;
+    result.end_pos = mid;
+    return false;
+}
 
-    loaded_map.num_meshes = num_vertex_buffers;
-    loaded_map.meshes = (mesh *)malloc(sizeof(mesh) * loaded_map.num_meshes);
+// the world as one hull, each query costs a walk down the tree along the
+// segment instead of a test against every brush
+trace_result traceHull(const glm::vec3 &start, const glm::vec3 &end, int hull) {
+    trace_result result = {};
+    result.fraction = 1.0f;
+    result.end_pos = end;
+    result.contents = BSP_CONTENTS_EMPTY;
+    result.all_solid = true;
+
+    hull_trace trace;
+    trace.hull = &loaded_map.collision[hull];
+    trace.result = &result;
+    traceHullNode(trace, trace.hull->head, 0.0f, 1.0f, start, end);
+
+    if (result.all_solid) {
+        result.start_solid = true;
+        result.fraction = 0.0f;
+        result.end_pos = start;
+        result.contents = BSP_CONTENTS_SOLID;
+    }
+    return result;
+}
 
-    for (uint64_t i = 0; i < num_vertex_buffers; i++) {
-        loaded_map.meshes[i] = createMesh(vertex_buffers[i], vertex_buffers_num_vertices[i], 0, 0);
-        loaded_map.meshes[i].topology = GL_TRIANGLES;
-        loaded_map.meshes[i].material_index = i;
+// stamps every leaf in the pvs and the nodes above it, like quake's
+// R_MarkLeaves only when the camera leaf changes
+static void markVisibleLeaves(int leaf_idx) {
+    map &m = loaded_map;
+    m.view_leaf = leaf_idx;
+    m.vis_frame++;
+    m.stats.leaves_visible = 0;
+
+    const uint8_t *pvs = getLeafPVS(leaf_idx);
+    for (int i = 0; i < m.num_visleafs; i++) {
+        if (pvs && !(pvs[i >> 3] & (1 << (i & 7)))) continue;
+        m.stats.leaves_visible++;
+        m.leaf_vis_frames[i + 1] = m.vis_frame;
+        for (int node_idx = m.leaf_parents[i + 1]; node_idx >= 0; node_idx = m.node_parents[node_idx]) {
+            if (m.node_vis_frames[node_idx] == m.vis_frame) break;
+            m.node_vis_frames[node_idx] = m.vis_frame;
+        }
+    }
+}
 
-        loaded_map.materials[i].setTexture("Texture1", loaded_map.lightmap_tex);
+static void markLeafClusters(int leaf_idx) {
+    map &m = loaded_map;
+    const map_leaf &leaf = m.leafs[leaf_idx];
+    for (int i = 0; i < leaf.mark_surface_count; i++) {
+        int surf_idx = m.face_surfaces[m.mark_surfaces[leaf.first_mark_surface + i]];
+        if (surf_idx < 0) continue;
+        int32_t &frame = m.cluster_frames[m.surfaces[surf_idx].cluster];
+        if (frame == m.frame) continue;
+        frame = m.frame;
+        m.stats.clusters_drawn++;
+        // the nearest point of its bounds, 0 from inside
+        const aabb &bounds = m.cluster_bounds[m.surfaces[surf_idx].cluster];
+        glm::vec3 outside = glm::max(glm::max(bounds.min - m.view_origin, m.view_origin - bounds.max), glm::vec3(0.0f));
+        m.cluster_distances[m.surfaces[surf_idx].cluster] = glm::length(outside);
     }
+}
 
-    free(vertex_buffers_num_vertices);
-    for (uint64_t i = 0; i < num_vertex_buffers; i++) {
-        free(vertex_buffers[i]);
+// walks only the pvs part of the tree, planes a subtree is entirely inside
+// of drop out of the mask so fully visible subtrees do no tests at all
+static void cullNode(int node_idx, uint32_t mask, const frustum &view) {
+    map &m = loaded_map;
+    while (node_idx >= 0) {
+        if (m.node_vis_frames[node_idx] != m.vis_frame) return;
+        const map_node &node = m.nodes[node_idx];
+        if (mask) {
+            m.stats.nodes_tested++;
+            aabb bounds = { glm::vec3(node.min[0], node.min[1], node.min[2]), glm::vec3(node.max[0], node.max[1], node.max[2]) };
+            if (!aabbInsideViewFrustum(bounds, view, &mask)) {
+                m.stats.nodes_culled++;
+                return;
+            }
+        }
+        cullNode(node.children[0], mask, view);
+        node_idx = node.children[1];
+    }
+
+    int leaf_idx = ~node_idx;
+    if (m.leaf_vis_frames[leaf_idx] != m.vis_frame) return;
+    const map_leaf &leaf = m.leafs[leaf_idx];
+    if (mask) {
+        m.stats.leaves_tested++;
+        aabb bounds = { glm::vec3(leaf.min[0], leaf.min[1], leaf.min[2]), glm::vec3(leaf.max[0], leaf.max[1], leaf.max[2]) };
+        if (!aabbInsideViewFrustum(bounds, view, &mask)) return;
+    }
+    m.stats.leaves_drawn++;
+    markLeafClusters(leaf_idx);
+}
+
+// the pvs only changes with the camera leaf, the frustum walk and the draw
+// ranges are redone every frame, view is in map coordinates
+void mapMarkVisibleSurfaces(const glm::vec3 &origin, const frustum &view) {
+    map &m = loaded_map;
+    if (!m.cluster_frames) return;
+    int leaf_idx = findLeaf(origin, m.view_leaf);
+    if (leaf_idx != m.view_leaf) markVisibleLeaves(leaf_idx);
+
+    m.frame++;
+    m.view_origin = origin;
+    m.stats.nodes_tested = 0;
+    m.stats.nodes_culled = 0;
+    m.stats.leaves_tested = 0;
+    m.stats.leaves_drawn = 0;
+    m.stats.clusters_drawn = 0;
+    cullNode(m.models[0].head_nodes[0], FRUSTUM_ALL_PLANES, view);
+    // leaves under a culled node never got tested but are culled all the same
+    m.stats.leaves_culled = m.stats.leaves_visible - m.stats.leaves_drawn;
+
+    // ranges are in index buffer order, visible clusters that follow each
+    // other in a batch become a single range
+    m.stats.draws = 0;
+    m.stats.triangles_drawn = 0;
+    for (int i = 0; i < m.num_batches; i++) {
+        draw_batch &batch = m.batches[i];
+        batch.num_draws = 0;
+        batch.distance = FLT_MAX;
+        int32_t end = -1;
+        for (int j = 0; j < batch.num_ranges; j++) {
+            const cluster_range &range = batch.ranges[j];
+            if (m.cluster_frames[range.cluster] != m.frame) continue;
+            batch.distance = std::min(batch.distance, m.cluster_distances[range.cluster]);
+            if (range.first_index == end) {
+                batch.counts[batch.num_draws - 1] += range.num_indices;
+            } else {
+                batch.offsets[batch.num_draws] = (const void *)(sizeof(uint32_t) * (uintptr_t)range.first_index);
+                batch.counts[batch.num_draws] = range.num_indices;
+                batch.num_draws++;
+            }
+            end = range.first_index + range.num_indices;
+            m.stats.triangles_drawn += range.num_indices / 3;
+        }
+        m.stats.draws += batch.num_draws;
     }
-    free(vertex_buffers);
-    free(indices);
 }
 
-void loadMap(const char *filename) {
-    bsp_header *header = loadBSP(filename);
-    mapInitBSP(header);
-    mapInitMaterials();
-    mapInitTextures();
-    mapInitMeshes();
+void mapUploadMesh(const map_build *build) {
+    map &m = loaded_map;
+    m.world_mesh = createMesh(build->verts, build->num_verts, build->format, build->indices, build->num_indices);
+    trackMesh(m.world_mesh);
+    m.world_mesh.topology = GL_TRIANGLES;
+    m.world_mesh_mtx = glm::mat4(build->position_scale);
+    m.world_mesh_mtx[3] = glm::vec4(build->position_offset, 1.0f);
+
+    int num_rows = build->num_surface_infos / MAP_SURFACE_INFO_ROW;
+    m.surface_info_tex = createTexture(build->surface_infos, MAP_SURFACE_INFO_ROW * 2, num_rows, GL_RGBA, GL_NEAREST, GL_CLAMP_TO_EDGE);
+    trackGLResource(GL_RESOURCE_TEXTURE, m.surface_info_tex);
+    m.world_material.setTexture("SurfaceInfo", m.surface_info_tex);
+
+    // the shaders divide by the texture size, packed texcoords are fixed point
+    float texcoord_scale = build->format == VERTEX_FORMAT_PACKED ? 1.0f / PACKED_TEXCOORD_STEPS : 1.0f;
+    m.world_material.setFloat("TexCoordScale", texcoord_scale);
+    for (int i = 0; i < m.num_materials; i++) {
+        m.materials[i].setFloat("TexCoordScale", texcoord_scale);
+    }
 }
 
 void drawMap(float time, Camera &cam) {
@@ -397,20 +2361,64 @@ void drawMap(float time, Camera &cam) {
         0.0f, 0.0f, 0.0f, 1.0f
     );
 
-    for (int i = 0; i < loaded_map.num_meshes; i++) {
-        mesh m = loaded_map.meshes[i];
-        //glm::mat4 mvp = proj_mtx * view_mtx * quake_transform_mtx;
-        Material &mat = loaded_map.materials[m.material_index];
-        mat.bind();
-        mat.setFloat("Time", time);
-        mat.setVec3("CameraPosition", cam.pos);
-        glUniformMatrix4fv(glGetUniformLocation(mat.program, "ProjectionMatrix"), 1, GL_FALSE, glm::value_ptr(proj_mtx));
-        glUniformMatrix4fv(glGetUniformLocation(mat.program, "ViewMatrix"), 1, GL_FALSE, glm::value_ptr(view_mtx));
-        glUniformMatrix4fv(glGetUniformLocation(mat.program, "ModelMatrix"), 1, GL_FALSE, glm::value_ptr(quake_transform_mtx));
-        meshDraw(m);
+    // culling happens in map coordinates, before the axes are swapped
+    frustum view;
+    extractFrustumPlanes(proj_mtx * view_mtx * quake_transform_mtx, &view);
+    glm::mat4 model_mtx = quake_transform_mtx * loaded_map.world_mesh_mtx;
+    mapMarkVisibleSurfaces(glm::vec3(cam.pos.x, -cam.pos.z, cam.pos.y), view);
+
+    // a render item per batch with something to draw, the buckets share the
+    // world program and differ only in their array texture
+    map &m = loaded_map;
+    uint64_t submit_start = SDL_GetPerformanceCounter();
+    resetRenderStats();
+    m.queue.num_items = 0;
+    for (int i = 0; i < m.num_batches; i++) {
+        const draw_batch &batch = m.batches[i];
+        if (batch.num_draws == 0) continue;
+        const Material &mat = batch.material_index < 0 ? m.world_material : m.materials[batch.material_index];
+        if (!mat.program) continue;
+        uint32_t depth = (uint32_t)std::min(batch.distance, (float)RENDER_KEY_DEPTH_MAX);
+        if (mat.blending) {
+            pushRenderItem(&m.queue, makeRenderKey(RENDER_PASS_BLENDED, mat.program, 0, RENDER_KEY_DEPTH_MAX - depth), i);
+        } else {
+            pushRenderItem(&m.queue, makeRenderKey(batch.pass, mat.program, i, depth), i);
+        }
     }
+    sortRenderQueue(&m.queue);
+
+    // everything that changes per frame is one buffer update, animated
+    // lights only cost their share of it, the atlas never changes
+    mapAnimateLightStyles(time);
+    frame_uniforms frame;
+    frame.world_view_projection = proj_mtx * view_mtx * model_mtx;
+    frame.world = model_mtx;
+    frame.camera_position = cam.pos;
+    frame.time = time;
+    memcpy(frame.light_styles, m.light_style_values, sizeof(frame.light_styles));
+    updateUniformBuffer(m.frame_ubo, MAP_FRAME_UNIFORMS_BINDING, &frame, sizeof(frame));
+
+    const Material *bound = 0;
+    for (int i = 0; i < m.queue.num_items; i++) {
+        int batch_idx = m.queue.items[i].index;
+        const draw_batch &batch = m.batches[batch_idx];
+        Material &mat = batch.material_index < 0 ? m.world_material : m.materials[batch.material_index];
+        if (&mat != bound) {
+            mat.bind();
+            bound = &mat;
+        }
+        // the world material's array sits in unit 0
+        if (batch.material_index < 0) bindTexture(0, GL_TEXTURE_2D_ARRAY, m.texture_buckets[batch_idx].array_tex);
+        meshDrawElementRanges(m.world_mesh, batch.counts, batch.offsets, batch.num_draws);
+    }
+    m.stats.render_items = m.queue.num_items;
+    m.stats.submit_us = (float)((double)(SDL_GetPerformanceCounter() - submit_start) * 1e6 / (double)SDL_GetPerformanceFrequency());
 }
 
-char *getEntities() {
+const char *getEntities() {
     return loaded_map.ents;
 }
+
+const cull_stats &getCullStats() {
+    return loaded_map.stats;
+}
@@ -6,9 +6,75 @@
 #include "glm.hpp"
 #include "camera.h"
 #include "material.h"
+#include "vfs.h"
+#include "arena.h"
 
 #define MAP_MAX_SKY_TEXTURES 8
 
+// spec minimum of GL_MAX_ARRAY_TEXTURE_LAYERS, a bucket splits past it
+#define MAP_MAX_ARRAY_LAYERS 256
+
+// lightmap atlas pages, a single page is trimmed to the height it uses
+#define LIGHTMAP_WIDTH 1024
+#define LIGHTMAP_HEIGHT 1024
+#define LIGHTMAP_MAX_PAGES 16
+#define LIGHTMAP_PADDING 1
+
+// each face blends up to MAXLIGHTMAPS styles, one per channel of the atlas
+#define LIGHTMAP_CHANNELS 4
+
+// style strings step at 10 Hz, 'a' is dark, 'm' normal and 'z' double bright
+#define MAP_MAX_LIGHTSTYLES 64
+#define MAP_MAX_LIGHTSTYLE_LENGTH 64
+
+// one bit per light in a surface's light mask
+#define MAP_MAX_DYNAMIC_LIGHTS 32
+
+// luxels of wasted upload worth trading for one glTexSubImage call less
+#define LIGHTMAP_UPLOAD_SLACK 1024
+
+// decompressed pvs rows up to this size, bigger maps decompress the row of
+// the camera leaf whenever it changes
+#define MAP_MAX_PVS_BYTES (32 << 20)
+
+// the surfaces of a bsp subtree up to this size are drawn as one cluster,
+// fewer and longer index ranges for some overdraw at the edges
+#define MAP_CLUSTER_SURFACES 16
+
+// texcoords of world faces are moved by whole tiles in steps of about this
+// many texels to keep them near the origin
+#define MAP_TEXCOORD_SHIFT 1024
+
+// entries per row of the surface info texture
+#define MAP_SURFACE_INFO_ROW 256
+
+// the uniform block binding of the Frame block in every map shader
+#define MAP_FRAME_UNIFORMS_BINDING 0
+
+// the clipnode hulls qbsp expands the world by, a box that fits one is
+// traced as a line. the point hull is the render tree itself
+#define MAP_HULL_POINT 0
+#define MAP_HULL_PLAYER 1 // -16 -16 -24 to 16 16 32
+#define MAP_HULL_LARGE 2  // -32 -32 -24 to 32 32 64
+#define MAP_MAX_HULLS 4
+
+// quake compilers only fill the first three hulls, the last is left empty
+#define MAP_NUM_COLLISION_HULLS 3
+
+// traces stop this far in front of what they hit so the end position is
+// never on or behind the plane
+#define MAP_TRACE_EPSILON 0.03125f
+
+// leaf children of collision nodes are ~(leaf << bits | -contents), the
+// clip hulls have no leaves and keep leaf 0
+#define COLLISION_CONTENTS_BITS 8
+#define COLLISION_CONTENTS_MASK 0xff
+
+// collision_node bits, the axis of an axial plane or 3, then the signs of
+// the normal
+#define COLLISION_AXIS_MASK 3
+#define COLLISION_SIGN_SHIFT 2
+
 
 struct color {
     uint8_t r;
@@ -19,10 +85,210 @@ struct color {
 struct surface {
     int32_t face;
     int32_t num_indices;
-    int32_t first_index;
-    glm::i16vec2 tex_mins;
-    glm::i16vec2 uv_extents;
+    int32_t first_index; // where its cluster's range starts in the batch
+    glm::ivec2 tex_mins;
+    glm::ivec2 uv_extents;
     glm::ivec2 lightmap_offset;
+    int32_t lightmap_page; // -1 when it samples the shared unlit luxel
+    int32_t batch;
+    int32_t cluster;
+};
+
+// every bsp version is normalized into these 32 bit layouts on load, lumps
+// that are identical across versions are still read straight from the file
+
+struct map_node {
+    int32_t plane;
+    int32_t children[2]; // negative children are ~leaf
+    float min[3];
+    float max[3];
+    int32_t first_face;
+    int32_t face_count;
+};
+
+struct map_clip_node {
+    int32_t plane;
+    int32_t children[2]; // negative children are contents
+};
+
+typedef int32_t map_edge[2];
+
+struct map_face {
+    int32_t plane;
+    int32_t side;
+    int32_t first_edge;
+    int32_t edge_count;
+    int32_t texinfo;
+    uint8_t styles[MAXLIGHTMAPS];
+    int32_t light_offset;
+};
+
+struct map_leaf {
+    int32_t contents;
+    int32_t visoffset;
+    float min[3];
+    float max[3];
+    int32_t first_mark_surface;
+    int32_t mark_surface_count;
+    uint8_t ambient_level[4];
+};
+
+// a point light for a single frame, in map coordinates
+struct dynamic_light {
+    glm::vec3 origin;
+    float radius;
+};
+
+// how far a line through a hull got, in map coordinates
+struct trace_result {
+    float fraction;     // of the way to the end, 1 when nothing was hit
+    glm::vec3 end_pos;
+    glm::vec3 normal;   // of the plane hit, facing back towards the start
+    float dist;
+    int32_t contents;   // solid on a hit, otherwise where the trace ended
+    bool start_solid;
+    bool all_solid;     // never left solid, fraction is 0
+};
+
+// how the nodes of a collision tree are ordered in memory
+enum collision_order {
+    COLLISION_ORDER_DEPTH_FIRST, // a node is followed by its bigger subtree
+    COLLISION_ORDER_VEB,         // van emde boas, the top half of the levels first, then each subtree below it
+};
+
+// a node of the trees traces and point queries walk, the plane is inlined so
+// a step down is one 32 byte load and two nodes share a cache line
+struct collision_node {
+    glm::vec3 normal;
+    float dist;
+    int32_t children[2]; // indices into the same tree, negative children are leaves
+    int32_t parent;      // -1 for the head node
+    uint32_t bits;
+};
+
+// one hull of the world model, built from the render nodes or the clipnodes
+// at load time. a hull that is a single leaf has no nodes and head is it
+struct collision_hull {
+    const collision_node *nodes;
+    int32_t num_nodes;
+    int32_t head;
+};
+
+// a plane facing into a leaf, a point in the leaf is in front of it
+struct leaf_plane {
+    glm::vec3 normal;
+    float dist;
+};
+
+// what it takes to check a leaf still holds a point, its bounds and the
+// planes above it that cut through them. every other plane on the way up
+// has the bounds all on the leaf's side. leaves with more than one parent,
+// like the shared solid leaf, have num_planes -1 and never pass
+struct leaf_hint {
+    glm::vec3 min;
+    glm::vec3 max;
+    int32_t first_plane;
+    int32_t num_planes;
+};
+
+struct lightmap_rect {
+    int32_t page;
+    int32_t x;
+    int32_t y;
+    int32_t width;
+    int32_t height;
+};
+
+// dynamic light lands in an atlas of its own with the static layout, only
+// the blocks of surfaces lit this frame or the last are rebuilt and uploaded
+struct dynamic_lightmap {
+    int32_t width;
+    int32_t height;
+    int32_t num_pages;
+    uint8_t *luxels;        // cpu copy of every page, one byte per luxel
+    uint32_t *light_masks;  // per surface, the lights reaching it
+    int32_t *lit_frames;    // per surface, the last frame it was lit
+    int32_t *lit[2];        // surfaces lit this frame and the last one
+    int32_t num_lit[2];
+    int32_t frame;
+    int32_t *accum;         // scratch sized for the largest block
+    uint8_t *block;
+    int32_t num_dirty;      // blocks rewritten this frame
+    int32_t num_rects;      // what they coalesced into
+    lightmap_rect *rects;
+    GLuint tex;
+};
+
+// what the vertices of a face share, two rgba texels of the table texture
+// the world shader looks up per vertex
+struct surface_info {
+    uint8_t styles[MAXLIGHTMAPS];
+    uint8_t layer;
+    uint8_t lightmap_page;
+    uint8_t pad[2];
+};
+
+// the Frame block the map shaders share, std140 so the vec3 and the float
+// after it fill one vec4 and the light styles are read as vec4[16]
+struct frame_uniforms {
+    glm::mat4 world_view_projection; // world buffer positions to clip space
+    glm::mat4 world;                 // world buffer positions to gl space
+    glm::vec3 camera_position;
+    float time;
+    float light_styles[MAP_MAX_LIGHTSTYLES];
+};
+
+// what the last frame's traversal did
+struct cull_stats {
+    int32_t nodes_tested;  // frustum tests on nodes, fully inside subtrees skip them
+    int32_t nodes_culled;
+    int32_t leaves_tested;
+    int32_t leaves_visible; // in the pvs of the camera leaf
+    int32_t leaves_drawn;
+    int32_t leaves_culled;  // in the pvs but outside of the frustum
+    int32_t clusters_drawn;
+    int32_t draws;          // index ranges after merging, over all batches
+    int32_t triangles_drawn;
+    int32_t render_items;   // batches that went through the render queue
+    float submit_us;        // sorting them and issuing their gl calls
+};
+
+// the index range one cluster owns in a batch
+struct cluster_range {
+    int32_t cluster;
+    int32_t first_index;
+    int32_t num_indices;
+};
+
+// a material's share of the world buffers, its clusters follow each other
+// in the index buffer so visible neighbours merge into one range
+struct draw_batch {
+    int32_t material_index; // -1 for the texture buckets
+    render_pass pass;
+    float distance;         // to the nearest cluster drawn this frame
+    int32_t num_ranges;
+    cluster_range *ranges;
+    int32_t num_draws;      // this frame's ranges, fed to glMultiDrawElements
+    GLsizei *counts;
+    const void **offsets;
+};
+
+// world textures of the same size share one array texture so all opaque
+// surfaces draw with a single program and one draw per bucket
+struct texture_bucket {
+    int32_t width;
+    int32_t height;
+    int32_t num_levels;
+    int32_t num_layers;
+    GLuint array_tex;
+};
+
+// where a miptex ends up, sky, water and missing textures keep a batch and
+// a material of their own
+struct texture_slot {
+    int32_t bucket; // -1 when not in an array
+    int32_t layer;
+    int32_t batch;
 };
 
 struct sky_texture {
@@ -31,87 +297,234 @@ struct sky_texture {
     GLuint background;
 };
 
+// a bsp file that passed header validation, lumps are read straight out of it
+struct bsp_file {
+    const uint8_t *data;
+    size_t size;
+    int32_t version;
+    const bsp_header *header;
+};
+
+// bounds checked, typed window into a single lump
+template <typename T>
+struct lump_view {
+    const T *data;
+    int32_t count;
+};
+
+// cpu side results of building a map, handed to the render thread for upload
+struct texture_data {
+    int32_t width;
+    int32_t height;
+    int32_t num_levels; // full mip chain, level after level in pixels
+    int32_t texel_size; // 3 for rgb, 1 for palette indices
+    uint8_t *pixels;    // sky textures hold the foreground then the background layer
+};
+
+struct map_build {
+    bool from_cache; // buffers point into a mapped cache file, not the scratch arena
+    int32_t num_textures;
+    texture_data *textures;
+    int32_t lightmap_width;
+    int32_t lightmap_height;
+    int32_t num_lightmap_pages;
+    uint8_t *lightmap; // rgba pages one after another
+    vertex_format format; // of the vertices
+    int32_t num_verts;
+    void *verts; // vertex or packed_vertex
+    glm::vec3 position_offset; // positions in the buffer are offset + pos * scale
+    float position_scale;
+    int32_t num_indices;
+    uint32_t *indices; // grouped by batch, then by cluster
+    int32_t num_surface_infos; // a whole number of table rows
+    surface_info *surface_infos;
+};
+
 struct render_group {
     int32_t num_faces;
     int32_t *faces;
     int32_t facetype;
 };
 
+// gl objects owned by the map, kept in arena chunks and freed together
+enum gl_resource_type : uint8_t {
+    GL_RESOURCE_TEXTURE,
+    GL_RESOURCE_BUFFER,
+    GL_RESOURCE_VERTEX_ARRAY,
+    GL_RESOURCE_TYPE_COUNT
+};
+
+#define MAP_GL_RESOURCE_CHUNK_SIZE 64
+
+struct gl_resource_chunk {
+    gl_resource_chunk *next;
+    int32_t count;
+    uint8_t types[MAP_GL_RESOURCE_CHUNK_SIZE];
+    GLuint ids[MAP_GL_RESOURCE_CHUNK_SIZE];
+};
+
 struct map {
-    int32_t num_meshes;
-    mesh *meshes;
+    vfs_file file;
+    arena memory;  // everything that lives as long as the map
+    arena scratch; // build buffers, released once the upload is done
+    gl_resource_chunk *gl_resources;
+
+    color palette[256];
+    uint32_t palette_lut[256];
+    bool paletted;      // textures stay 8 bit and the shaders do the lookup
+    GLuint palette_tex;
+
+    // all world geometry in one vertex and index buffer
+    mesh world_mesh;
+    glm::mat4 world_mesh_mtx; // from buffer positions to map coordinates
+    bool packed_vertices;     // asked for, the map may still not fit them
+    GLuint surface_info_tex;
+    int32_t num_batches;
+    draw_batch *batches;
+    render_queue queue; // a render item per batch with something to draw
+    GLuint frame_ubo;
 
     GLuint program;
     GLuint *textures;
-    GLuint lightmap_tex;
+    GLuint lightmap_tex; // array texture, one layer per atlas page
+    int32_t lightmap_width;
+    int32_t lightmap_height;
+    int32_t num_lightmap_pages;
+    dynamic_lightmap dlights;
 
-    char *ents;
+    const char *ents;
+
+    char light_styles[MAP_MAX_LIGHTSTYLES][MAP_MAX_LIGHTSTYLE_LENGTH];
+    float light_style_values[MAP_MAX_LIGHTSTYLES]; // this frame's intensities
 
     int num_materials;
     Material *materials;
+    Material world_material;
+
+    // batches start with one per bucket, then one per unbatched miptex
+    int32_t num_texture_buckets;
+    texture_bucket *texture_buckets;
+    texture_slot *texture_slots;
 
     int32_t num_surfaces;
     surface *surfaces;
+    int32_t *face_surfaces; // -1 for faces that are never drawn
+
+    // a bit per leaf from leaf 1 on, leaf 0 is the shared solid leaf
+    int32_t num_visleafs;
+    int32_t pvs_row_bytes;
+    uint8_t *pvs;     // a row per leaf, 0 when decompressed on demand
+    uint8_t *pvs_row; // the on demand row
+    int32_t num_vis_bytes;
+    const uint8_t *vis;
+
+    // nodes and leaves holding a pvs leaf carry the current vis_frame, the
+    // frustum walk only enters those
+    int32_t view_leaf;
+    glm::vec3 view_origin;
+    int32_t vis_frame;
+    int32_t *node_parents;
+    int32_t *leaf_parents;
+    int32_t *node_vis_frames;
+    int32_t *leaf_vis_frames;
+
+    // a cluster is drawn whole once a visible leaf marks any of its surfaces
+    int32_t num_clusters;
+    int32_t *cluster_frames;
+    aabb *cluster_bounds;
+    float *cluster_distances; // from the camera, set when a leaf marks it
+
+    int32_t frame;
+    cull_stats stats;
 
     int32_t num_planes;
-    bsp_plane *planes;
+    const bsp_plane *planes;
 
     int32_t num_vertices;
-    glm::vec3 *vertices;
+    const glm::vec3 *vertices;
 
     int32_t num_nodes;
-    bsp_node *nodes;
+    map_node *nodes;
 
     int32_t num_texinfos;
-    bsp_texinfo *texinfos;
+    const bsp_texinfo *texinfos;
 
     int32_t num_faces;
-    bsp_face *faces;
+    map_face *faces;
 
     int32_t num_clipnodes;
-    bsp_clip_node *clipnodes;
+    map_clip_node *clipnodes;
+
+    collision_hull collision[MAP_NUM_COLLISION_HULLS];
+    leaf_hint *leaf_hints; // a hint per leaf for findLeaf and pointContents
+    leaf_plane *leaf_planes;
 
     int32_t num_leafs;
-    bsp_leaf *leafs;
+    map_leaf *leafs;
 
     int32_t num_mark_surfaces;
-    uint16_t *mark_surfaces;
+    int32_t *mark_surfaces;
 
     int32_t num_edges;
-    bsp_edge *edges;
+    map_edge *edges;
 
     int32_t num_surfedges;
-    int16_t *surfedges;
+    const int32_t *surfedges;
 
     int32_t num_models;
-    bsp_model *models;
+    const bsp_model *models;
 
-    uint8_t *lightmap;
+    int32_t num_lightmap_bytes;
+    const uint8_t *lightmap;
 
-    bsp_miptex_lump *miptex_lump;
-    bsp_miptex *miptex;
+    int32_t miptex_lump_size;
+    const bsp_miptex_lump *miptex_lump;
 };
 
 extern map loaded_map;
 
-bool allocBlock(int width, int height, int *x, int *y);
-void *loadBinaryFile(const char *filename);
-uint32_t buildTexture(uint8_t *miptex_data, int width, int height, int offset, int pitch, color *palette, GLenum filter, color *pixel_buffer);
+bool loadBinaryFile(const char *filename, vfs_file *out);
+void expandMiptex(const uint8_t *miptex_data, int width, int height, int offset, int pitch, const uint32_t *palette_lut, color *pixel_buffer);
 
 template <typename T>
-void copyLump(bsp_header *header, int lump_type, T **out_items, int *out_num_items);
-void mapInitBSP(bsp_header *header);
+bool getLump(const bsp_file &bsp, int lump_type, lump_view<T> *out);
+bool openBSP(const vfs_file &file, bsp_file *out);
+void mapInitPalette();
+void mapInitLightStyles();
+void mapSetLightStyle(int style, const char *pattern);
+void mapAnimateLightStyles(float time);
+const bsp_miptex *getMiptex(int miptex_idx);
+int getNumMipLevels(int width, int height);
+int64_t getMipChainTexels(int width, int height, int num_levels);
+bool mapValidateBSP();
+bool mapInitBSP(const bsp_file &bsp);
+void mapAssignTextureSlots();
 void mapInitMaterials();
-void mapInitTextures();
+void mapBuildTexture(int miptex_idx, texture_data *out);
+void mapUploadTexture(int miptex_idx, const texture_data *tex);
+void mapSetPalette(const color *palette);
 void calcSurfaceExtents(surface *surf);
 void markSurface(int leaf_idx);
-void buildBSPTree(bsp_node node);
+void buildBSPTree(const map_node &node);
 void createSurfaces();
 int getVertexFromEdge(int surf_edge);
-void triangulateSurface(surface *surf, uint32_t *triangle);
-void mapInitMeshes();
-void loadMap(const char *filename);
+void mapBuildClusters();
+void mapBuildMeshes(map_build *out);
+bool mapPackVertices(map_build *build);
+void mapUploadLightmap(const map_build *build);
+void mapInitVisibility();
+void mapMarkVisibleSurfaces(const glm::vec3 &origin, const frustum &view);
+void mapInitDynamicLights(int width, int height, int num_pages);
+void mapUpdateDynamicLights(const dynamic_light *lights, int num_lights);
+void mapUploadDynamicLights();
+void mapUploadMesh(const map_build *build);
+void mapRelease();
 void drawMap(float time, Camera &cam);
-char *getEntities();
-void expandTreeCollisions(int nodeIndex, const glm::vec3& mins, const glm::vec3& maxs);
-int findLeaf(const glm::vec3& position);
+const char *getEntities();
+const cull_stats &getCullStats();
+void mapBuildCollisionHull(int hull, collision_order order, arena *memory, collision_hull *out);
+void mapBuildCollision();
+int findLeaf(const glm::vec3 &position, int hint_leaf = -1);
+int pointContents(const glm::vec3 &position, int *hint_leaf = 0);
+int hullPointContents(const glm::vec3 &point, int hull);
+trace_result traceHull(const glm::vec3 &start, const glm::vec3 &end, int hull);
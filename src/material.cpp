@@ -1,21 +1,48 @@
 #include "material.h"
 #include "renderer.h"
+#include <cstring>
+
+static uint32_t next_version = 1;
 
 void Material::reset() {
     program = 0;
+    resolved_program = 0;
     num_uniforms = 0;
     wireframe = 0;
     depth_test = 0;
     cull_face = 0;
     blending = 0;
+    version = 0;
+}
+
+// locations are only asked for once a program is there to ask, and again
+// if the material is moved to another one
+void Material::resolveUniforms() {
+    if (resolved_program == program) return;
+    resolved_program = program;
+    for (int i = 0; i < num_uniforms; i++) {
+        uniforms[i].location = program ? glGetUniformLocation(program, uniforms[i].name) : -1;
+    }
+    version = next_version++;
 }
 
 void Material::bind() {
-    glUseProgram(program);
+    resolveUniforms();
+    useProgram(program);
+    bool upload = !uniformsCurrent(program, version, num_uniforms);
     int tex_slot = 0;
 
     for (int i = 0; i < num_uniforms; i++) {
-        uniform uni = uniforms[i];
+        const uniform &uni = uniforms[i];
+        if (uni.location == -1) continue;
+        // samplers keep their slots, only what is bound to them can change
+        if (uni.type == UNIFORM_TYPE_SAMPLER_2D || uni.type == UNIFORM_TYPE_SAMPLER_2D_ARRAY) {
+            if (upload) glUniform1i(uni.location, tex_slot);
+            bindTexture(tex_slot, uni.type == UNIFORM_TYPE_SAMPLER_2D ? GL_TEXTURE_2D : GL_TEXTURE_2D_ARRAY, uni.val.in);
+            tex_slot++;
+            continue;
+        }
+        if (!upload) continue;
         switch (uni.type) {
             case UNIFORM_TYPE_INT:
                 glUniform1i(uni.location, uni.val.in);
@@ -32,43 +59,42 @@ void Material::bind() {
             case UNIFORM_TYPE_VEC4:
                 glUniform4fv(uni.location, 1, &uni.val.v4[0]);
                 break;
-            case UNIFORM_TYPE_SAMPLER_2D:
-                glUniform1i(uni.location, tex_slot);
-                glActiveTexture(GL_TEXTURE0 + tex_slot);
-                glBindTexture(GL_TEXTURE_2D, uni.val.in);
-                tex_slot++;
+            default:
                 break;
         }
     }
 
-    glPolygonMode(GL_FRONT_AND_BACK, wireframe ? GL_LINE : GL_FILL);
-    (depth_test ? glEnable : glDisable)(GL_DEPTH_TEST);
-    (cull_face ? glEnable : glDisable)(GL_CULL_FACE);
-    (blending ? glEnable : glDisable)(GL_BLEND);
+    setWireframe(wireframe);
+    setCapability(GL_DEPTH_TEST, depth_test);
+    setCapability(GL_CULL_FACE, cull_face);
+    setCapability(GL_BLEND, blending);
 }
 
-uniform *Material::findUniform(int location) {
+uniform *Material::findUniform(const char *name) {
     for (int i = 0; i < num_uniforms; i++) {
-        if (uniforms[i].location == location) {
+        if (strcmp(uniforms[i].name, name) == 0) {
             return (uniforms + i);
         }
     }
     return 0;
 }
 
+// values are kept by name until bind resolves them against the program,
+// once resolved a name the program does not use never reaches the driver
 void Material::setUniformValue(const char *name, uniform_type type, uniform_value val) {
-    int location = glGetUniformLocation(program, name);
-
-    if (location != -1) {
-        uniform *uni = findUniform(location);
-        if (!uni) {
-            uni = &uniforms[num_uniforms];
-            num_uniforms++;
-        }
-        uni->type = type;
-        uni->location = location;
-        uni->val = val;
+    uniform *uni = findUniform(name);
+    if (!uni) {
+        if (num_uniforms == MATERIAL_MAX_UNIFORMS || strlen(name) >= MATERIAL_UNIFORM_NAME_LENGTH) return;
+        uni = &uniforms[num_uniforms];
+        num_uniforms++;
+        strcpy(uni->name, name);
+        uni->location = program && resolved_program == program ? glGetUniformLocation(program, name) : -1;
     }
+
+    uni->type = type;
+    uni->val = val;
+    // an unused name changes nothing the program sees
+    if (uni->location != -1 || resolved_program != program) version = next_version++;
 }
 
 void Material::setInt(const char *name, int val) {
@@ -107,3 +133,9 @@ void Material::setTexture(const char *name, uint32_t tex) {
     uni_val.in = tex;
     setUniformValue(name, UNIFORM_TYPE_SAMPLER_2D, uni_val);
 }
+
+void Material::setTextureArray(const char *name, uint32_t tex) {
+    uniform_value uni_val;
+    uni_val.in = tex;
+    setUniformValue(name, UNIFORM_TYPE_SAMPLER_2D_ARRAY, uni_val);
+}
@@ -5,7 +5,7 @@ class Material {
 public:
     void reset();
     void bind();
-    uniform *findUniform(int location);
+    uniform *findUniform(const char *name);
     void setUniformValue(const char *name, uniform_type type, uniform_value val);
     void setInt(const char *name, int val);
     void setFloat(const char *name, float val);
@@ -13,13 +13,19 @@ public:
     void setVec3(const char *name, glm::vec3 val);
     void setVec4(const char *name, glm::vec4 val);
     void setTexture(const char *name, uint32_t tex);
+    void setTextureArray(const char *name, uint32_t tex);
+    void resolveUniforms();
 
     uint32_t program;
+    uint32_t resolved_program; // the program the uniform locations belong to
     int32_t num_uniforms;
     uniform uniforms[MATERIAL_MAX_UNIFORMS];
     int32_t wireframe;
     int32_t depth_test;
     int32_t cull_face;
     int32_t blending;
+    // changes with every uniform set, lets bind skip uploading values the
+    // program still holds from the last bind of this material
+    uint32_t version;
 private:
 };
@@ -0,0 +1,87 @@
+#include "palette.h"
+#include "cpu.h"
+#include <cstring>
+
+void buildPaletteLUT(const uint8_t *rgb_palette, uint32_t *lut) {
+    for (int i = 0; i < 256; i++) {
+        const uint8_t *c = rgb_palette + i * 3;
+        lut[i] = (uint32_t)c[0] | (uint32_t)c[1] << 8 | (uint32_t)c[2] << 16;
+    }
+}
+
+// four lookups are packed into three words, the pad byte of each entry is
+// overwritten by the next color, assumes a little endian target
+static void expandFrom(int start, const uint8_t *indices, int count, const uint32_t *lut, uint8_t *rgb_out) {
+    int i = start;
+    for (; i + 4 <= count; i += 4) {
+        uint32_t quad;
+        memcpy(&quad, indices + i, sizeof(quad));
+        uint32_t a = lut[quad & 0xff];
+        uint32_t b = lut[(quad >> 8) & 0xff];
+        uint32_t c = lut[(quad >> 16) & 0xff];
+        uint32_t d = lut[quad >> 24];
+        uint32_t w0 = a | b << 24;
+        uint32_t w1 = b >> 8 | c << 16;
+        uint32_t w2 = c >> 16 | d << 8;
+        memcpy(rgb_out + i * 3 + 0, &w0, sizeof(w0));
+        memcpy(rgb_out + i * 3 + 4, &w1, sizeof(w1));
+        memcpy(rgb_out + i * 3 + 8, &w2, sizeof(w2));
+    }
+    for (; i < count; i++) {
+        uint32_t a = lut[indices[i]];
+        rgb_out[i * 3 + 0] = (uint8_t)a;
+        rgb_out[i * 3 + 1] = (uint8_t)(a >> 8);
+        rgb_out[i * 3 + 2] = (uint8_t)(a >> 16);
+    }
+}
+
+void expandPaletteGeneric(const uint8_t *indices, int count, const uint32_t *lut, uint8_t *rgb_out) {
+    expandFrom(0, indices, count, lut, rgb_out);
+}
+
+#ifdef CPU_X86
+// eight colors per step with a hardware gather, then a byte shuffle drops
+// the pad bytes leaving 12 packed bytes at the bottom of each 128 bit lane
+TARGET_AVX2 static void expandPaletteAVX2(const uint8_t *indices, int count, const uint32_t *lut, uint8_t *rgb_out) {
+    const __m256i compact = _mm256_setr_epi8(
+        0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+        0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+
+    // every 16 byte store carries 4 bytes of junk past its colors, the next
+    // store overwrites them, so leave two colors for the scalar tail
+    int i = 0;
+    for (; i + 10 <= count; i += 8) {
+        __m128i idx8 = _mm_loadl_epi64((const __m128i *)(indices + i));
+        __m256i idx = _mm256_cvtepu8_epi32(idx8);
+        __m256i rgbx = _mm256_i32gather_epi32((const int *)lut, idx, 4);
+        __m256i rgb = _mm256_shuffle_epi8(rgbx, compact);
+        _mm_storeu_si128((__m128i *)(rgb_out + i * 3), _mm256_castsi256_si128(rgb));
+        _mm_storeu_si128((__m128i *)(rgb_out + i * 3 + 12), _mm256_extracti128_si256(rgb, 1));
+    }
+    expandFrom(i, indices, count, lut, rgb_out);
+}
+#endif
+
+struct palette_kernel {
+    palette_expand_fn fn;
+    const char *name;
+};
+
+// picked once, the first time a texture is converted
+static const palette_kernel &getKernel() {
+    static const palette_kernel kernel = []() -> palette_kernel {
+#ifdef CPU_X86
+        if (cpuHasAVX2()) return { expandPaletteAVX2, "avx2" };
+#endif
+        return { expandPaletteGeneric, "generic" };
+    }();
+    return kernel;
+}
+
+void expandPalette(const uint8_t *indices, int count, const uint32_t *lut, uint8_t *rgb_out) {
+    getKernel().fn(indices, count, lut, rgb_out);
+}
+
+const char *getPaletteKernelName() {
+    return getKernel().name;
+}
@@ -0,0 +1,12 @@
+#pragma once
+#include <cstdint>
+
+// 8 bit palette indices to packed rgb, the lut holds each palette entry as
+// r | g << 8 | b << 16 so a single load fetches a whole color
+void buildPaletteLUT(const uint8_t *rgb_palette, uint32_t *lut);
+void expandPalette(const uint8_t *indices, int count, const uint32_t *lut, uint8_t *rgb_out);
+void expandPaletteGeneric(const uint8_t *indices, int count, const uint32_t *lut, uint8_t *rgb_out);
+const char *getPaletteKernelName();
+
+// the kernels expandPalette picks between at runtime
+typedef void (*palette_expand_fn)(const uint8_t *, int, const uint32_t *, uint8_t *);
@@ -7,11 +7,12 @@
 #include <sstream>
 
 Player::Player() {
-    bbox.min = glm::vec3(-16, -16, -32);
+    bbox.min = glm::vec3(-16, -16, -24);
     bbox.max = glm::vec3(16, 16, 32);
 
     vel = glm::vec3(0.0f);
     pos = glm::vec3(0.0f);
+    prevPos = pos;
     onGround = false;
 }
 
@@ -36,22 +37,23 @@ void Player::spawn() {
     pos.y = quake_z + 2.0f;        // Quake Z becomes Y in OpenGL
     pos.z = -quake_y;       // Negative Quake Y becomes Z in OpenGL
 
-    // Set camera position (eye position = player position + eye height)
-    cam.pos = pos;
-    cam.pos.y += 22;  // Eye height offset
-
-    // Reset physics state
+    // Reset physics state, nothing to draw in between yet
+    prevPos = pos;
     vel = glm::vec3(0.0f);
     onGround = false;
     cam.rotation = glm::vec3(0.0f, 180.0f, 0.0f);
+    updateCamera(1.0f);
 }
 
-glm::vec3 Player::handleInput(input *in, float dt) {
-    float sens = 70.0f;
+// every frame, the view follows the mouse at any frame rate and the next
+// tick moves along wherever it points by then
+void Player::look(input *in) {
     // Clamp pitch to prevent camera from flipping
-    cam.rotation.x = glm::clamp(cam.rotation.x + (float)in->mouseYRel * sens * dt, -89.0f, 89.0f);
-    cam.rotation.y -= (float)in->mouseXRel * sens * dt;
+    cam.rotation.x = glm::clamp(cam.rotation.x + (float)in->mouseYRel * MOUSE_SENSITIVITY, -89.0f, 89.0f);
+    cam.rotation.y -= (float)in->mouseXRel * MOUSE_SENSITIVITY;
+}
 
+glm::vec3 Player::handleInput(input *in) {
     // Create view matrix for correct movement
     glm::mat4 viewMatrix = glm::mat4(1.0f);
     viewMatrix = glm::rotate(viewMatrix, glm::radians(cam.rotation.y), glm::vec3(0, 1, 0)); // Yaw
@@ -92,48 +94,184 @@ glm::vec3 Player::handleInput(input *in, float dt) {
 }
 
 
-void Player::update(input *in, float dt) {
-    // update physics state
-    glm::vec3 wishDir = handleInput(in, dt);
-    applyFriction(dt);
+// movement runs in map coordinates against the player hull, the world is
+// pre expanded by bbox so every trace is a line through it
+static glm::vec3 toMapCoords(const glm::vec3 &v) {
+    return glm::vec3(v.x, -v.z, v.y);
+}
 
-    float currentSpeed = glm::dot(vel, wishDir);
-    float add_speed = glm::clamp(MAX_SPEED - currentSpeed, 0.0f, MAX_ACCEL * dt);
-    glm::vec3 hVel = vel;
-    hVel.y = 0;
-    hVel += add_speed * wishDir;
+static glm::vec3 fromMapCoords(const glm::vec3 &v) {
+    return glm::vec3(v.x, v.z, -v.y);
+}
 
-    // gravity
-    applyGravity(dt);
-    checkGroundStatus(dt);
+static trace_result tracePlayer(const glm::vec3 &start, const glm::vec3 &end) {
+    return traceHull(start, end, MAP_HULL_PLAYER);
+}
+
+// removes the part of the velocity going into the plane
+static glm::vec3 clipVelocity(const glm::vec3 &in, const glm::vec3 &normal) {
+    glm::vec3 out = in - normal * glm::dot(in, normal);
+    for (int i = 0; i < 3; i++) {
+        if (out[i] > -STOP_EPSILON && out[i] < STOP_EPSILON) out[i] = 0.0f;
+    }
+    return out;
+}
 
-    vel.x = vel.z = 0;
-    vel += hVel;
-    pos += slideMove(vel, dt);
+// quake's PM_FlyMove, moves until something is hit, clips the velocity
+// against every plane touched since the last progress and slides along
+// what is left, the crease of two planes or nothing at all
+static void flyMove(glm::vec3 *origin, glm::vec3 *velocity, float dt) {
+    glm::vec3 primal_velocity = *velocity;
+    glm::vec3 original_velocity = *velocity;
+    glm::vec3 planes[MAX_CLIP_PLANES];
+    int num_planes = 0;
+    float time_left = dt;
+
+    for (int bump = 0; bump < 4; bump++) {
+        trace_result trace = tracePlayer(*origin, *origin + *velocity * time_left);
+        if (trace.all_solid) {
+            *velocity = glm::vec3(0.0f);
+            return;
+        }
+        if (trace.fraction > 0.0f) {
+            *origin = trace.end_pos;
+            original_velocity = *velocity;
+            num_planes = 0;
+        }
+        if (trace.fraction == 1.0f) return;
 
-    // Update camera position to match player position
-    cam.pos = pos + glm::vec3(0, 22, 0); // Eye position slightly below top of bbox
+        time_left -= time_left * trace.fraction;
+        if (num_planes >= MAX_CLIP_PLANES) {
+            *velocity = glm::vec3(0.0f);
+            return;
+        }
+        planes[num_planes++] = trace.normal;
+
+        // a velocity along one plane that leaves all the others
+        int i = 0;
+        for (; i < num_planes; i++) {
+            *velocity = clipVelocity(original_velocity, planes[i]);
+            int j = 0;
+            for (; j < num_planes; j++) {
+                if (j != i && glm::dot(*velocity, planes[j]) < 0.0f) break;
+            }
+            if (j == num_planes) break;
+        }
+        if (i == num_planes) {
+            if (num_planes != 2) {
+                *velocity = glm::vec3(0.0f);
+                return;
+            }
+            glm::vec3 dir = glm::cross(planes[0], planes[1]);
+            *velocity = dir * glm::dot(dir, *velocity);
+        }
+        // turned back against where it started, stop instead of jittering
+        // in sloped corners
+        if (glm::dot(*velocity, primal_velocity) <= 0.0f) {
+            *velocity = glm::vec3(0.0f);
+            return;
+        }
+    }
 }
 
-void Player::checkGroundStatus(float dt) {
-    // Slightly extended ground check distance
-    float groundCheckDistance = 1.5f;
+// quake's PM_GroundMove, slides along the floor and also tries the same
+// move a step higher, whichever gets further wins so stairs just work
+static void groundMove(glm::vec3 *origin, glm::vec3 *velocity, float dt) {
+    velocity->z = 0.0f;
+    if (velocity->x == 0.0f && velocity->y == 0.0f) return;
 
-    // Check if any of the points detect ground
-    onGround = false;
-    glm::vec3 groundCheck = pos;
-    groundCheck.y -= groundCheckDistance;
+    glm::vec3 dest = *origin + glm::vec3(velocity->x, velocity->y, 0.0f) * dt;
+    trace_result trace = tracePlayer(*origin, dest);
+    if (trace.fraction == 1.0f) {
+        *origin = trace.end_pos;
+        return;
+    }
 
-    if (checkCollision(groundCheck, nullptr)) {
-        onGround = true;
+    glm::vec3 original = *origin;
+    glm::vec3 original_velocity = *velocity;
+    flyMove(origin, velocity, dt);
+    glm::vec3 down = *origin;
+    glm::vec3 down_velocity = *velocity;
+
+    *origin = original;
+    *velocity = original_velocity;
+    trace = tracePlayer(*origin, *origin + glm::vec3(0.0f, 0.0f, STEP_SIZE));
+    if (!trace.all_solid) *origin = trace.end_pos;
+    flyMove(origin, velocity, dt);
+    trace = tracePlayer(*origin, *origin - glm::vec3(0.0f, 0.0f, STEP_SIZE));
+    // stepping up onto something too steep to stand on does not count
+    if (trace.fraction == 1.0f || trace.normal.z < MIN_GROUND_NORMAL) {
+        *origin = down;
+        *velocity = down_velocity;
+        return;
+    }
+    if (!trace.all_solid) *origin = trace.end_pos;
+
+    glm::vec2 down_move = glm::vec2(down - original);
+    glm::vec2 up_move = glm::vec2(*origin - original);
+    if (glm::dot(down_move, down_move) > glm::dot(up_move, up_move)) {
+        *origin = down;
+        *velocity = down_velocity;
+    } else {
+        velocity->z = down_velocity.z;
+    }
+}
 
-        // Optional: Snap to ground if very close
-        if (std::abs(pos.y - groundCheck.y) < groundCheckDistance * 0.5f) {
-            pos.y = groundCheck.y + bbox.min.y;
-            vel.y = 0.0f;
+// quake's PM_NudgePosition, an origin that ended up inside the hull, from
+// rounding or a spawn point too close to a wall, gets pushed out by up to
+// an eighth of a unit on each axis
+static void nudgePosition(glm::vec3 *origin) {
+    static const float offsets[] = { 0.0f, -0.125f, 0.125f };
+    if (hullPointContents(*origin, MAP_HULL_PLAYER) != BSP_CONTENTS_SOLID) return;
+    for (float z : offsets) {
+        for (float y : offsets) {
+            for (float x : offsets) {
+                glm::vec3 test = *origin + glm::vec3(x, y, z);
+                if (hullPointContents(test, MAP_HULL_PLAYER) != BSP_CONTENTS_SOLID) {
+                    *origin = test;
+                    return;
+                }
+            }
         }
+    }
+}
+
+// one fixed step, the same inputs from the same state always end up in the
+// same place
+void Player::tick(input *in, float dt) {
+    prevPos = pos;
 
+    // update physics state
+    glm::vec3 wishDir = handleInput(in);
+    applyFriction(dt);
+
+    float currentSpeed = glm::dot(vel, wishDir);
+    float add_speed = glm::clamp(MAX_SPEED - currentSpeed, 0.0f, MAX_ACCEL * dt);
+    vel += add_speed * wishDir;
+    applyGravity(dt);
+
+    glm::vec3 origin = toMapCoords(pos);
+    glm::vec3 velocity = toMapCoords(vel);
+    nudgePosition(&origin);
+    if (onGround) {
+        groundMove(&origin, &velocity, dt);
+    } else {
+        flyMove(&origin, &velocity, dt);
     }
+
+    // standing on something is a walkable plane right below, moving up fast
+    // means a jump just left it
+    trace_result ground = tracePlayer(origin, origin - glm::vec3(0.0f, 0.0f, 1.0f));
+    onGround = ground.fraction < 1.0f && ground.normal.z >= MIN_GROUND_NORMAL && velocity.z <= 180.0f;
+    if (onGround && !ground.all_solid) origin = ground.end_pos;
+
+    pos = fromMapCoords(origin);
+    vel = fromMapCoords(velocity);
+}
+
+// alpha is how far the frame is from the last tick to the next one
+void Player::updateCamera(float alpha) {
+    cam.pos = glm::mix(prevPos, pos, alpha) + glm::vec3(0, 22, 0); // Eye position slightly below top of bbox
 }
 
 void Player::applyGravity(float dt) {
@@ -161,81 +299,3 @@ void Player::applyFriction(float dt) {
     float newSpeed = std::max(0.0f, speed - drop);
     vel *= (newSpeed / speed);
 }
-
-glm::vec3 Player::slideMove(const glm::vec3& wishDir, float dt) {
-    // Calculate movement
-    glm::vec3 moveAmount = wishDir * dt;
-    glm::vec3 normal;
-
-    // Check for collision
-    if (checkCollision(pos + moveAmount, &normal)) {
-        // Project movement onto the collision plane
-        float d = glm::dot(moveAmount, normal);
-        glm::vec3 slide = moveAmount - normal * d;
-
-        // Check if sliding movement is valid
-        if (!checkCollision(pos + slide, nullptr)) {
-            return slide;
-        }
-        return glm::vec3(0.0f);
-    }
-
-    return moveAmount;
-}
-
-bool Player::checkCollision(const glm::vec3& newPos, glm::vec3 *normal) {
-    glm::vec3 quakePos = glm::vec3(
-        newPos.x,
-        -newPos.z,
-        newPos.y
-    );
-
-    bsp_model worldModel = loaded_map.models[0];
-    int headNode = worldModel.head_nodes[0];
-
-    glm::vec3 mins = quakePos + bbox.min;
-    glm::vec3 maxs = quakePos + bbox.max;
-
-    return checkBSPCollision(headNode, mins, maxs, normal);
-}
-
-bool Player::checkBSPCollision(int nodeIndex, const glm::vec3 &mins, const glm::vec3 &maxs, glm::vec3 *normal) {
-    // Check if we've hit a leaf
-    if (nodeIndex < 0) {
-        bsp_leaf* leaf = &loaded_map.leafs[~nodeIndex];
-        // If it's solid, we have a collision
-        return (leaf->contents == BSP_CONTENTS_SOLID);
-    }
-
-    bsp_node* node = &loaded_map.nodes[nodeIndex];
-    bsp_plane* plane = &loaded_map.planes[node->plane];
-    if (normal) {
-        *normal = plane->normal;
-    }
-    // Classify box against plane
-    float d1 = classifyBox(plane, mins);
-    float d2 = classifyBox(plane, maxs);
-
-    // Check children based on classification
-    if (d1 >= 0 && d2 >= 0)
-        return checkBSPCollision(node->children[0], mins, maxs, normal);
-    if (d1 < 0 && d2 < 0)
-        return checkBSPCollision(node->children[1], mins, maxs, normal);
-
-    // Box spans the plane, must check both sides
-    return checkBSPCollision(node->children[0], mins, maxs, normal) ||
-           checkBSPCollision(node->children[1], mins, maxs, normal);
-}
-
-float Player::classifyBox(const bsp_plane* plane, const glm::vec3& point) {
-    switch (plane->type) {
-        case PLANE_X:
-            return point.x - plane->dist;
-        case PLANE_Y:
-            return point.y - plane->dist;
-        case PLANE_Z:
-            return point.z - plane->dist;
-        default:
-            return glm::dot(point, plane->normal) - plane->dist;
-    }
-}
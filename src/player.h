@@ -12,6 +12,20 @@
 #define GRAVITY 800.0f
 #define FRICTION 6.0f
 
+// quake's movement constants, in map units
+#define STEP_SIZE 18.0f
+#define MAX_CLIP_PLANES 5
+#define STOP_EPSILON 0.1f
+#define MIN_GROUND_NORMAL 0.7f // steeper planes are walls
+
+// physics steps at a fixed rate whatever the frame rate, frames draw the
+// player part way between the last two steps
+#define SIM_TICK_RATE 72
+#define SIM_MAX_TICKS_PER_FRAME 8 // a longer stall drops time instead of catching up
+
+// degrees the view turns per pixel of mouse motion
+#define MOUSE_SENSITIVITY 0.1f
+
 struct input {
     int mouseX;
     int mouseY;
@@ -25,24 +39,20 @@ class Player {
 public:
     Player();
     void spawn();
-    glm::vec3 handleInput(input *in, float dt);
-    void update(input *in, float dt);
+    void look(input *in);
+    glm::vec3 handleInput(input *in);
+    void tick(input *in, float dt);
+    void updateCamera(float alpha);
 
     Camera cam;
 
     // physics properties
     glm::vec3 vel;
     glm::vec3 pos;
+    glm::vec3 prevPos; // where the last tick started, drawn up to pos
     bool onGround;
-    float offGroundTimer;
-    aabb bbox;
+    aabb bbox; // the box of the player hull around pos, in map coordinates
 private:
     void applyFriction(float dt);
     void applyGravity(float dt);
-    void checkGroundStatus(float dt);
-    bool checkCollision(const glm::vec3 &newPos, glm::vec3 *normal);
-    bool checkBSPCollision(int nodeIndex, const glm::vec3 &newPos, const glm::vec3 &maxs, glm::vec3 *normal);
-    float classifyBox(const bsp_plane* plane, const glm::vec3& point);
-    glm::vec3 slideMove(const glm::vec3 &wishDir, float dt);
-    glm::vec3 computeSlide(const glm::vec3& move, const glm::vec3& normal);
 };
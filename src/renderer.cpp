@@ -2,81 +2,281 @@
 #include "SDL_log.h"
 #include "glm.hpp"
 #include <SDL.h>
+#include <cstring>
 
-bool pointInsideViewFrustum(glm::vec3 point, const glm::mat4 &mvp) {
-    glm::vec4 pointNDC = mvp * glm::vec4(point, 1.0f);
-    pointNDC = pointNDC / pointNDC.w;
-    for (int i = 0; i < 3; i++) {
-        if (pointNDC[i] > 1.0f) {
-            return false;
-        }
+// gribb and hartmann, each plane is the w row plus or minus another row of
+// the matrix, the frustum ends up in whatever space the matrix maps from
+void extractFrustumPlanes(const glm::mat4 &mvp, frustum *out) {
+    glm::vec4 rows[4];
+    for (int i = 0; i < 4; i++) {
+        rows[i] = glm::vec4(mvp[0][i], mvp[1][i], mvp[2][i], mvp[3][i]);
+    }
+    for (int i = 0; i < FRUSTUM_NUM_PLANES; i++) {
+        glm::vec4 p = (i & 1) ? rows[3] - rows[i >> 1] : rows[3] + rows[i >> 1];
+        float length = glm::length(glm::vec3(p));
+        out->planes[i].normal = glm::vec3(p) / length;
+        out->planes[i].distance = p.w / length;
+    }
+}
+
+bool pointInsideViewFrustum(glm::vec3 point, const frustum &view) {
+    for (const plane &p : view.planes) {
+        if (glm::dot(p.normal, point) + p.distance < 0.0f) return false;
     }
     return true;
 }
 
-// NOTE: Unused now but will be handy later
-int aabbInsideViewFrustum(aabb bbox, const glm::mat4 &mvp) {
-    glm::vec3 a = bbox.min + glm::vec3(0.0f, 0.0f, 0.0f);
-    glm::vec3 b = bbox.min + glm::vec3(bbox.max.x, 0.0f, 0.0f);
-    glm::vec3 c = bbox.min + glm::vec3(bbox.max.x, bbox.max.y, 0.0f);
-    glm::vec3 d = bbox.min + glm::vec3(0.0f, bbox.max.y, 0.0f);
-    glm::vec3 e = bbox.min + glm::vec3(0.0f, 0.0f, bbox.max.z);
-    glm::vec3 f = bbox.min + glm::vec3(bbox.max.x, 0.0f, bbox.max.z);
-    glm::vec3 g = bbox.min + glm::vec3(bbox.max.x, bbox.max.y, bbox.max.z);
-    glm::vec3 h = bbox.min + glm::vec3(0.0f, bbox.max.y, bbox.max.z);
-
-    if (pointInsideViewFrustum(a, mvp) ||
-        pointInsideViewFrustum(b, mvp) || 
-        pointInsideViewFrustum(c, mvp) || 
-        pointInsideViewFrustum(d, mvp) || 
-        pointInsideViewFrustum(e, mvp) || 
-        pointInsideViewFrustum(f, mvp) || 
-        pointInsideViewFrustum(g, mvp) || 
-        pointInsideViewFrustum(h, mvp))
-        return 1;
-    return 0;
-}
-
-mesh createMesh(const vertex *verts, int num_verts, const uint32_t *index_data, int num_idx) {
+// mask holds the planes still worth testing, a box entirely on the inside of
+// a plane clears its bit so everything inside the box can skip that plane
+bool aabbInsideViewFrustum(const aabb &bbox, const frustum &view, uint32_t *mask) {
+    for (int i = 0; i < FRUSTUM_NUM_PLANES; i++) {
+        if (!(*mask & (1u << i))) continue;
+        const plane &p = view.planes[i];
+        // the corners furthest along and against the normal
+        glm::vec3 far_corner = glm::vec3(
+            p.normal.x >= 0.0f ? bbox.max.x : bbox.min.x,
+            p.normal.y >= 0.0f ? bbox.max.y : bbox.min.y,
+            p.normal.z >= 0.0f ? bbox.max.z : bbox.min.z);
+        if (glm::dot(p.normal, far_corner) + p.distance < 0.0f) return false;
+
+        glm::vec3 near_corner = bbox.min + bbox.max - far_corner;
+        if (glm::dot(p.normal, near_corner) + p.distance >= 0.0f) *mask &= ~(1u << i);
+    }
+    return true;
+}
+
+#define RENDER_STATE_UNKNOWN 0xffffffffu
+
+// what the gl context is known to have bound and enabled, zeroed it matches
+// a fresh context. resetRenderState forgets everything, for when objects
+// get deleted and their names may come back
+struct render_state {
+    GLuint program;
+    GLuint vertex_array;
+    uint32_t active_unit;
+    GLuint textures[RENDER_MAX_TEXTURE_UNITS][2]; // 2d, then 2d array
+    int8_t wireframe;       // -1 when unknown
+    int8_t capabilities[3]; // depth test, face culling and blending
+    struct {
+        GLuint program;
+        uint32_t version; // of the material whose uniforms it holds
+    } uniform_owners[RENDER_MAX_PROGRAMS];
+    int32_t num_uniform_owners;
+    render_stats stats;
+};
+
+static render_state state;
+
+uint64_t makeRenderKey(render_pass pass, uint32_t program, uint32_t textures, uint32_t depth) {
+    return ((uint64_t)pass << RENDER_KEY_PASS_SHIFT) |
+           ((uint64_t)(program & 0xfff) << RENDER_KEY_PROGRAM_SHIFT) |
+           ((uint64_t)(textures & 0xffffff) << RENDER_KEY_TEXTURES_SHIFT) |
+           (uint64_t)(depth < RENDER_KEY_DEPTH_MAX ? depth : RENDER_KEY_DEPTH_MAX);
+}
+
+void pushRenderItem(render_queue *queue, uint64_t key, int32_t index) {
+    if (queue->num_items >= queue->capacity) return;
+    queue->items[queue->num_items++] = { key, index };
+}
+
+// lsd radix sort a byte at a time, stable so equal keys keep their order.
+// bytes every key shares, like most of the pass and program bits, cost a
+// counting pass and nothing else
+void sortRenderQueue(render_queue *queue) {
+    int num_items = queue->num_items;
+    uint32_t counts[8][256] = {};
+    for (int i = 0; i < num_items; i++) {
+        uint64_t key = queue->items[i].key;
+        for (int b = 0; b < 8; b++) {
+            counts[b][(key >> (b * 8)) & 0xff]++;
+        }
+    }
+
+    render_item *src = queue->items;
+    render_item *dst = queue->temp;
+    for (int b = 0; b < 8 && num_items > 1; b++) {
+        if (counts[b][(src[0].key >> (b * 8)) & 0xff] == (uint32_t)num_items) continue;
+        uint32_t offsets[256];
+        uint32_t offset = 0;
+        for (int i = 0; i < 256; i++) {
+            offsets[i] = offset;
+            offset += counts[b][i];
+        }
+        for (int i = 0; i < num_items; i++) {
+            dst[offsets[(src[i].key >> (b * 8)) & 0xff]++] = src[i];
+        }
+        render_item *swap = src;
+        src = dst;
+        dst = swap;
+    }
+    if (src != queue->items) memcpy(queue->items, src, sizeof(render_item) * num_items);
+}
+
+void useProgram(GLuint program) {
+    if (state.program == program) {
+        state.stats.state_changes_skipped++;
+        return;
+    }
+    glUseProgram(program);
+    state.program = program;
+    state.stats.state_changes++;
+}
+
+// uniforms are program state, a material whose values are still in the
+// program since it last bound it does not upload them again. records
+// version as the owner otherwise, 0 is never current
+bool uniformsCurrent(GLuint program, uint32_t version, int num_uniforms) {
+    int i = 0;
+    for (; i < state.num_uniform_owners; i++) {
+        if (state.uniform_owners[i].program == program) break;
+    }
+    if (i == state.num_uniform_owners) {
+        if (i == RENDER_MAX_PROGRAMS) return false;
+        state.num_uniform_owners++;
+        state.uniform_owners[i].program = program;
+        state.uniform_owners[i].version = 0;
+    }
+    if (version != 0 && state.uniform_owners[i].version == version) {
+        state.stats.state_changes_skipped += num_uniforms;
+        return true;
+    }
+    state.uniform_owners[i].version = version;
+    state.stats.state_changes += num_uniforms;
+    return false;
+}
+
+void bindTexture(int unit, GLenum target, GLuint tex) {
+    int slot = target == GL_TEXTURE_2D_ARRAY ? 1 : 0;
+    if (unit < RENDER_MAX_TEXTURE_UNITS && state.textures[unit][slot] == tex) {
+        state.stats.state_changes_skipped++;
+        return;
+    }
+    if (state.active_unit != (uint32_t)unit) {
+        glActiveTexture(GL_TEXTURE0 + unit);
+        state.active_unit = unit;
+        state.stats.state_changes++;
+    }
+    glBindTexture(target, tex);
+    if (unit < RENDER_MAX_TEXTURE_UNITS) state.textures[unit][slot] = tex;
+    state.stats.state_changes++;
+}
+
+void bindVertexArray(GLuint vao) {
+    if (state.vertex_array == vao) {
+        state.stats.state_changes_skipped++;
+        return;
+    }
+    glBindVertexArray(vao);
+    state.vertex_array = vao;
+    state.stats.state_changes++;
+}
+
+void setCapability(GLenum cap, bool enabled) {
+    int i = cap == GL_DEPTH_TEST ? 0 : cap == GL_CULL_FACE ? 1 : cap == GL_BLEND ? 2 : -1;
+    if (i >= 0 && state.capabilities[i] == (int8_t)enabled) {
+        state.stats.state_changes_skipped++;
+        return;
+    }
+    (enabled ? glEnable : glDisable)(cap);
+    if (i >= 0) state.capabilities[i] = (int8_t)enabled;
+    state.stats.state_changes++;
+}
+
+void setWireframe(bool enabled) {
+    if (state.wireframe == (int8_t)enabled) {
+        state.stats.state_changes_skipped++;
+        return;
+    }
+    glPolygonMode(GL_FRONT_AND_BACK, enabled ? GL_LINE : GL_FILL);
+    state.wireframe = (int8_t)enabled;
+    state.stats.state_changes++;
+}
+
+void resetRenderState() {
+    render_stats stats = state.stats;
+    state = {};
+    state.program = RENDER_STATE_UNKNOWN;
+    state.vertex_array = RENDER_STATE_UNKNOWN;
+    state.active_unit = RENDER_STATE_UNKNOWN;
+    for (int i = 0; i < RENDER_MAX_TEXTURE_UNITS; i++) {
+        state.textures[i][0] = RENDER_STATE_UNKNOWN;
+        state.textures[i][1] = RENDER_STATE_UNKNOWN;
+    }
+    state.wireframe = -1;
+    for (int8_t &cap : state.capabilities) {
+        cap = -1;
+    }
+    state.stats = stats;
+}
+
+void resetRenderStats() {
+    state.stats = {};
+}
+
+const render_stats &getRenderStats() {
+    return state.stats;
+}
+
+int getVertexSize(vertex_format format) {
+    return format == VERTEX_FORMAT_PACKED ? (int)sizeof(packed_vertex) : (int)sizeof(vertex);
+}
+
+static glm::vec3 getVertexPosition(const void *verts, vertex_format format, int i) {
+    if (format == VERTEX_FORMAT_PACKED) {
+        const packed_vertex &v = ((const packed_vertex *)verts)[i];
+        return glm::vec3(v.pos[0], v.pos[1], v.pos[2]);
+    }
+    return ((const vertex *)verts)[i].pos;
+}
+
+// both layouts feed the same shader inputs, packed positions and texcoords
+// arrive as plain integers and the lightmap coordinates as normalized shorts
+mesh createMesh(const void *verts, int num_verts, vertex_format format, const uint32_t *index_data, int num_idx) {
     mesh m = {};
     m.num_verts = num_verts;
     m.topology = GL_TRIANGLE_FAN;
 
     glGenVertexArrays(1, &m.VAO);
-    glBindVertexArray(m.VAO);
+    bindVertexArray(m.VAO);
     glGenBuffers(1, &m.VBO);
     glBindBuffer(GL_ARRAY_BUFFER, m.VBO);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(vertex) * num_verts, verts, GL_STATIC_DRAW);
+    glBufferData(GL_ARRAY_BUFFER, (GLsizeiptr)getVertexSize(format) * num_verts, verts, GL_STATIC_DRAW);
 
     glEnableVertexAttribArray(0);
     glEnableVertexAttribArray(1);
     glEnableVertexAttribArray(2);
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(vertex), (const void *)offsetof(vertex, pos));
-    glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, sizeof(vertex), (const void *)offsetof(vertex, texcoord));
-    glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(vertex), (const void *)offsetof(vertex, lightmap));
+    glEnableVertexAttribArray(3);
+    if (format == VERTEX_FORMAT_PACKED) {
+        GLsizei stride = sizeof(packed_vertex);
+        glVertexAttribPointer(0, 3, GL_SHORT, GL_FALSE, stride, (const void *)offsetof(packed_vertex, pos));
+        glVertexAttribPointer(1, 2, GL_SHORT, GL_FALSE, stride, (const void *)offsetof(packed_vertex, texcoord));
+        glVertexAttribPointer(2, 2, GL_UNSIGNED_SHORT, GL_TRUE, stride, (const void *)offsetof(packed_vertex, lightmap));
+        glVertexAttribIPointer(3, 1, GL_UNSIGNED_SHORT, stride, (const void *)offsetof(packed_vertex, info));
+    } else {
+        GLsizei stride = sizeof(vertex);
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, stride, (const void *)offsetof(vertex, pos));
+        glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, stride, (const void *)offsetof(vertex, texcoord));
+        glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, stride, (const void *)offsetof(vertex, lightmap));
+        glVertexAttribIPointer(3, 1, GL_UNSIGNED_INT, stride, (const void *)offsetof(vertex, info));
+    }
 
+    // the index buffer binding is part of the vertex array, drawing only
+    // needs the vertex array bound
     if (num_idx > 0) {
         glGenBuffers(1, &m.EBO);
         glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m.EBO);
         glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(uint32_t) * num_idx, index_data, GL_STATIC_DRAW);
-        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
         m.num_indices = num_idx;
     }
     glBindBuffer(GL_ARRAY_BUFFER, 0);
-    glBindVertexArray(0);
 
     m.bbox.min = glm::vec3(FLT_MAX);
     m.bbox.max = glm::vec3(-FLT_MAX);
 
     for (int i = 0; i < num_verts; i++) {
-        for (int j = 0; j < 3; j++) {
-            if (m.bbox.min[j] > verts[i].pos[j]) {
-                m.bbox.min[j] = verts[i].pos[j];
-            }
-            if (m.bbox.max[j] < verts[i].pos[j]) {
-                m.bbox.max[j] = verts[i].pos[j];
-            }
-        }
+        glm::vec3 pos = getVertexPosition(verts, format, i);
+        m.bbox.min = glm::min(m.bbox.min, pos);
+        m.bbox.max = glm::max(m.bbox.max, pos);
     }
 
     return m;
@@ -85,7 +285,7 @@ mesh createMesh(const vertex *verts, int num_verts, const uint32_t *index_data,
 GLuint createTexture(const void *data, int width, int height, GLenum format, GLenum filter, GLenum wrap, int gen_mipmap) {
     GLuint tex;
     glGenTextures(1, &tex);
-    glBindTexture(GL_TEXTURE_2D, tex);
+    bindTexture(0, GL_TEXTURE_2D, tex);
     glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, GL_NONE, format, GL_UNSIGNED_BYTE, data);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, filter);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, filter);
@@ -98,14 +298,98 @@ GLuint createTexture(const void *data, int width, int height, GLenum format, GLe
         }
         glGenerateMipmap(GL_TEXTURE_2D);
     }
-    glBindTexture(GL_TEXTURE_2D, 0);
     return tex;
 }
 
+static int bytesPerPixel(GLenum format) {
+    switch (format) {
+        case GL_RED: return 1;
+        case GL_RG: return 2;
+        case GL_RGB: return 3;
+        default: return 4;
+    }
+}
+
+// data holds every level back to back, largest first, each level halves the
+// previous one down to a minimum of 1 texel
+GLuint createTextureMips(const void *data, int width, int height, int num_levels, GLenum format, GLenum filter, GLenum wrap) {
+    GLuint tex;
+    glGenTextures(1, &tex);
+    bindTexture(0, GL_TEXTURE_2D, tex);
+
+    // the small levels have rows that are not 4 byte aligned
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    const uint8_t *level_data = (const uint8_t *)data;
+    for (int level = 0; level < num_levels; level++) {
+        int level_width = width >> level > 0 ? width >> level : 1;
+        int level_height = height >> level > 0 ? height >> level : 1;
+        glTexImage2D(GL_TEXTURE_2D, level, format, level_width, level_height, GL_NONE, format, GL_UNSIGNED_BYTE, level_data);
+        level_data += (size_t)level_width * level_height * bytesPerPixel(format);
+    }
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, num_levels - 1);
+    GLenum min_filter = filter;
+    if (num_levels > 1) {
+        min_filter = filter == GL_NEAREST ? GL_NEAREST_MIPMAP_NEAREST : GL_LINEAR_MIPMAP_LINEAR;
+    }
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, min_filter);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, filter);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, wrap);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, wrap);
+    return tex;
+}
+
+// storage for every layer and level, filled by updateTextureArrayLayer
+GLuint createTextureArray(int width, int height, int num_layers, int num_levels, GLenum format, GLenum filter, GLenum wrap) {
+    GLuint tex;
+    glGenTextures(1, &tex);
+    bindTexture(0, GL_TEXTURE_2D_ARRAY, tex);
+    for (int level = 0; level < num_levels; level++) {
+        int level_width = width >> level > 0 ? width >> level : 1;
+        int level_height = height >> level > 0 ? height >> level : 1;
+        glTexImage3D(GL_TEXTURE_2D_ARRAY, level, format, level_width, level_height, num_layers, GL_NONE, format, GL_UNSIGNED_BYTE, 0);
+    }
+
+    GLenum min_filter = filter;
+    if (num_levels > 1) {
+        min_filter = filter == GL_NEAREST ? GL_NEAREST_MIPMAP_NEAREST : GL_LINEAR_MIPMAP_LINEAR;
+    }
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL, num_levels - 1);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, min_filter);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, filter);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, wrap);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, wrap);
+    return tex;
+}
+
+// data is laid out like createTextureMips expects it
+void updateTextureArrayLayer(GLuint tex, int layer, int width, int height, int num_levels, GLenum format, const void *data) {
+    bindTexture(0, GL_TEXTURE_2D_ARRAY, tex);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    const uint8_t *level_data = (const uint8_t *)data;
+    for (int level = 0; level < num_levels; level++) {
+        int level_width = width >> level > 0 ? width >> level : 1;
+        int level_height = height >> level > 0 ? height >> level : 1;
+        glTexSubImage3D(GL_TEXTURE_2D_ARRAY, level, 0, 0, layer, level_width, level_height, 1, format, GL_UNSIGNED_BYTE, level_data);
+        level_data += (size_t)level_width * level_height * bytesPerPixel(format);
+    }
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+}
+
+// data points at the first texel of the rectangle inside rows pitch texels wide
+void updateTextureArrayRect(GLuint tex, int layer, int x, int y, int width, int height, int pitch, GLenum format, const void *data) {
+    bindTexture(0, GL_TEXTURE_2D_ARRAY, tex);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, pitch);
+    glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, x, y, layer, width, height, 1, format, GL_UNSIGNED_BYTE, data);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+}
+
 void updateTexture(uint32_t tex, int xoff, int yoff, int width, int height, int format, const void *pixels) {
-    glBindTexture(GL_TEXTURE_2D, tex);
+    bindTexture(0, GL_TEXTURE_2D, tex);
     glTexSubImage2D(GL_TEXTURE_2D, 0, xoff, yoff, width, height, format, GL_UNSIGNED_BYTE, pixels);
-    glBindTexture(GL_TEXTURE_2D, 0);
 }
 
 GLuint openGLCreateShaderProgram(const char *vert_code, const char *frag_code) {
@@ -149,18 +433,64 @@ GLuint openGLCreateShaderProgram(const char *vert_code, const char *frag_code) {
     return program;
 }
 
+GLuint createUniformBuffer(size_t size) {
+    GLuint buffer;
+    glGenBuffers(1, &buffer);
+    glBindBuffer(GL_UNIFORM_BUFFER, buffer);
+    glBufferData(GL_UNIFORM_BUFFER, size, 0, GL_DYNAMIC_DRAW);
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    return buffer;
+}
+
+// binds it to the block binding every shader declares and replaces the
+// contents, meant to happen once a frame before anything draws
+void updateUniformBuffer(GLuint buffer, int binding, const void *data, size_t size) {
+    glBindBufferBase(GL_UNIFORM_BUFFER, binding, buffer);
+    glBufferSubData(GL_UNIFORM_BUFFER, 0, size, data);
+}
+
 void meshDraw(mesh m) {
-    glBindVertexArray(m.VAO);
+    bindVertexArray(m.VAO);
     if (m.num_indices) {
-        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m.EBO);
         glDrawElements(m.topology, m.num_indices, GL_UNSIGNED_INT, 0);
     } else {
         glDrawArrays(m.topology, 0, m.num_verts);
     }
 }
 
+// offsets are byte offsets into the index buffer
+void meshDrawElementRanges(mesh m, const GLsizei *counts, const void *const *offsets, int num_ranges) {
+    bindVertexArray(m.VAO);
+    glMultiDrawElements(m.topology, counts, GL_UNSIGNED_INT, offsets, num_ranges);
+}
+
 void meshDrawIndexed(mesh m, int num_idx, uint64_t offset) {
-    glBindVertexArray(m.VAO);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m.EBO);
+    bindVertexArray(m.VAO);
     glDrawElements(m.topology, num_idx, GL_UNSIGNED_INT, (const void *)offset);
 }
+
+// plain scissored clears so it works before any shader or map is ready
+void drawProgressBar(float progress, int screen_width, int screen_height) {
+    int bar_width = screen_width / 2;
+    int bar_height = screen_height / 64 + 1;
+    int x = (screen_width - bar_width) / 2;
+    int y = (screen_height - bar_height) / 2;
+    int filled = (int)(glm::clamp(progress, 0.0f, 1.0f) * bar_width);
+
+    GLfloat clear_color[4];
+    glGetFloatv(GL_COLOR_CLEAR_VALUE, clear_color);
+    glEnable(GL_SCISSOR_TEST);
+
+    glScissor(x, y, bar_width, bar_height);
+    glClearColor(0.1f, 0.1f, 0.1f, 1.0f);
+    glClear(GL_COLOR_BUFFER_BIT);
+
+    if (filled > 0) {
+        glScissor(x, y, filled, bar_height);
+        glClearColor(0.8f, 0.5f, 0.2f, 1.0f);
+        glClear(GL_COLOR_BUFFER_BIT);
+    }
+
+    glDisable(GL_SCISSOR_TEST);
+    glClearColor(clear_color[0], clear_color[1], clear_color[2], clear_color[3]);
+}
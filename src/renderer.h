@@ -3,6 +3,7 @@
 #include "glad/glad.h"
 
 #define MATERIAL_MAX_UNIFORMS 8
+#define MATERIAL_UNIFORM_NAME_LENGTH 32
 #define MATERIAL_MAX_TEXTURES 4
 
 struct plane {
@@ -15,10 +16,44 @@ struct aabb {
     glm::vec3 max;
 };
 
+// left, right, bottom, top, near and far, normals point inwards
+#define FRUSTUM_NUM_PLANES 6
+#define FRUSTUM_ALL_PLANES ((1u << FRUSTUM_NUM_PLANES) - 1)
+
+struct frustum {
+    plane planes[FRUSTUM_NUM_PLANES];
+};
+
+// world vertices come in one of two layouts, picked per map at load time
+enum vertex_format : int32_t {
+    VERTEX_FORMAT_FULL,
+    VERTEX_FORMAT_PACKED
+};
+
+// the texture layer, lightmap page and styles are the same over a whole
+// face, vertices point into a table of them instead of carrying them
 struct vertex {
     glm::vec3 pos;
-    glm::vec2 texcoord;
-    glm::vec2 lightmap;
+    glm::vec2 texcoord; // in texels
+    glm::vec2 lightmap; // normalized atlas coordinates
+    uint32_t info;      // entry in the surface info table
+};
+
+// fixed point steps per texel of packed texcoords
+#define PACKED_TEXCOORD_STEPS 8
+
+// positions get as many steps per unit as the map's size leaves room for,
+// a power of two inside these bounds
+#define PACKED_POSITION_MAX_STEPS 16
+#define PACKED_POSITION_MIN_STEPS 2
+
+// half the size for maps that fit, positions are fixed point around the
+// map's center and the model matrix scales them back
+struct packed_vertex {
+    int16_t pos[3];
+    int16_t texcoord[2];  // in texels times PACKED_TEXCOORD_STEPS
+    uint16_t lightmap[2]; // normalized
+    uint16_t info;
 };
 
 struct mesh {
@@ -32,13 +67,51 @@ struct mesh {
     aabb bbox;
 };
 
+// draws go through a queue sorted by these keys, pass first, then program,
+// then the textures and last the depth inside the pass. blended draws leave
+// the textures out and invert the depth so only the distance orders them
+enum render_pass {
+    RENDER_PASS_OPAQUE,
+    RENDER_PASS_SKY,    // after the world so most of it fails the depth test
+    RENDER_PASS_BLENDED // back to front
+};
+
+#define RENDER_KEY_PASS_SHIFT 60
+#define RENDER_KEY_PROGRAM_SHIFT 48
+#define RENDER_KEY_TEXTURES_SHIFT 24
+#define RENDER_KEY_DEPTH_MAX ((1u << 24) - 1)
+
+struct render_item {
+    uint64_t key;
+    int32_t index; // whatever the submitter needs to find the draw again
+};
+
+struct render_queue {
+    int32_t capacity;
+    int32_t num_items;
+    render_item *items;
+    render_item *temp; // the other half of the radix sort
+};
+
+// gl calls that went through the state cache since the last reset, the
+// skipped ones would have set what was already current
+struct render_stats {
+    int32_t state_changes;
+    int32_t state_changes_skipped;
+};
+
+// texture units and programs the state cache keeps track of
+#define RENDER_MAX_TEXTURE_UNITS 16
+#define RENDER_MAX_PROGRAMS 32
+
 enum uniform_type {
     UNIFORM_TYPE_INT,
     UNIFORM_TYPE_FLOAT,
     UNIFORM_TYPE_VEC2,
     UNIFORM_TYPE_VEC3,
     UNIFORM_TYPE_VEC4,
-    UNIFORM_TYPE_SAMPLER_2D
+    UNIFORM_TYPE_SAMPLER_2D,
+    UNIFORM_TYPE_SAMPLER_2D_ARRAY
 };
 
 union uniform_value {
@@ -50,16 +123,39 @@ union uniform_value {
 };
 
 struct uniform {
-    int32_t location;
+    char name[MATERIAL_UNIFORM_NAME_LENGTH];
+    int32_t location; // -1 when the program does not use it
     uniform_type type;
     uniform_value val;
 };
 
-bool pointInsideViewFrustum(glm::vec3 point, const glm::mat4 &mvp);
-int aabbInsideViewFrustum(aabb bbox, const glm::mat4 &mvp);
-mesh createMesh(const vertex *verts, int num_verts, const uint32_t *index_data, int num_idx);
+void extractFrustumPlanes(const glm::mat4 &mvp, frustum *out);
+bool pointInsideViewFrustum(glm::vec3 point, const frustum &view);
+bool aabbInsideViewFrustum(const aabb &bbox, const frustum &view, uint32_t *mask);
+int getVertexSize(vertex_format format);
+mesh createMesh(const void *verts, int num_verts, vertex_format format, const uint32_t *index_data, int num_idx);
 GLuint createTexture(const void *data, int width, int height, GLenum format, GLenum filter, GLenum wrap, int gen_mipmap = 0);
+GLuint createTextureArray(int width, int height, int num_layers, int num_levels, GLenum format, GLenum filter, GLenum wrap);
+void updateTextureArrayLayer(GLuint tex, int layer, int width, int height, int num_levels, GLenum format, const void *data);
+GLuint createTextureMips(const void *data, int width, int height, int num_levels, GLenum format, GLenum filter, GLenum wrap);
+void updateTextureArrayRect(GLuint tex, int layer, int x, int y, int width, int height, int pitch, GLenum format, const void *data);
 void updateTexture(uint32_t tex, int xoff, int yoff, int width, int height, int format, const void *pixels);
 GLuint openGLCreateShaderProgram(const char *vert, const char *frag);
+GLuint createUniformBuffer(size_t size);
+void updateUniformBuffer(GLuint buffer, int binding, const void *data, size_t size);
+uint64_t makeRenderKey(render_pass pass, uint32_t program, uint32_t textures, uint32_t depth);
+void pushRenderItem(render_queue *queue, uint64_t key, int32_t index);
+void sortRenderQueue(render_queue *queue);
+void useProgram(GLuint program);
+bool uniformsCurrent(GLuint program, uint32_t version, int num_uniforms);
+void bindTexture(int unit, GLenum target, GLuint tex);
+void bindVertexArray(GLuint vao);
+void setCapability(GLenum cap, bool enabled);
+void setWireframe(bool enabled);
+void resetRenderState();
+void resetRenderStats();
+const render_stats &getRenderStats();
 void meshDraw(mesh m);
+void meshDrawElementRanges(mesh m, const GLsizei *counts, const void *const *offsets, int num_ranges);
 void meshDrawIndexed(mesh m, int num_idx, uint64_t offset);
+void drawProgressBar(float progress, int screen_width, int screen_height);
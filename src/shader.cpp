@@ -1,9 +1,9 @@
 #include <cstdint>
 #include <cstring>
-#include <fstream>
 #include <sstream>
 #include "glm.hpp"
 #include "renderer.h"
+#include "vfs.h"
 
 #define SHADER_STORAGE_MAX 32
 
@@ -48,11 +48,14 @@ uint32_t loadShader(const char *filename, const char *name) {
         return entry->program;
     }
 
-    std::ifstream file(filename);
-    if (!file.is_open()) {
+    vfs_file source;
+    if (!vfsOpen(filename, &source)) {
         return 0;
     }
 
+    std::istringstream file(std::string((const char *)source.data, source.size));
+    vfsClose(&source);
+
     std::string line;
     std::ostringstream vertexShaderCode, fragmentShaderCode;
     std::ostringstream *currentShaderCode = nullptr;
@@ -69,7 +72,6 @@ uint32_t loadShader(const char *filename, const char *name) {
         }
     }
 
-    file.close();
     uint32_t program = openGLCreateShaderProgram(vertexShaderCode.str().c_str(), fragmentShaderCode.str().c_str());
     addShaderToStorage(name, program);
     return program;
@@ -0,0 +1,382 @@
+#include "trace.h"
+#include "cpu.h"
+#include <cstddef>
+#include <memory>
+
+// the boxes qbsp expanded hulls 1 and 2 by, the point hull has none
+static const glm::vec3 hull_mins[3] = {
+    glm::vec3(0.0f),
+    glm::vec3(-16.0f, -16.0f, -24.0f),
+    glm::vec3(-32.0f, -32.0f, -24.0f),
+};
+
+// quake's SV_HullForBox, the box's width picks the hull
+trace_request makeBoxTrace(const glm::vec3 &start, const glm::vec3 &end, const glm::vec3 &mins, const glm::vec3 &maxs) {
+    float width = maxs.x - mins.x;
+    int hull = width < 3.0f ? MAP_HULL_POINT : width <= 32.0f ? MAP_HULL_PLAYER : MAP_HULL_LARGE;
+    trace_request request;
+    request.start = start;
+    request.end = end;
+    request.offset = mins - hull_mins[hull];
+    request.hull = hull;
+    return request;
+}
+
+static trace_result traceRequest(const trace_request &request) {
+    trace_result result = traceHull(request.start + request.offset, request.end + request.offset, request.hull);
+    result.end_pos -= request.offset;
+    return result;
+}
+
+void traceHullBatchGeneric(const trace_request *requests, int count, trace_result *results) {
+    for (int i = 0; i < count; i++) {
+        results[i] = traceRequest(requests[i]);
+    }
+}
+
+#ifdef CPU_X86
+// collision nodes as flat arrays of 8 ints, normal and dist first
+#define TRACE_NODE_STRIDE (sizeof(collision_node) / 4)
+#define TRACE_NODE_CHILDREN (offsetof(collision_node, children) / 4)
+
+// the far side of a split, and the split that leads into it
+struct trace_piece {
+    int32_t node;
+    float start;
+    float end;
+    int32_t entry_node; // -1 for the piece the trace starts in
+    int32_t entry_side;
+    float entry_start;  // the part of the line the split node saw
+    float entry_end;
+};
+
+struct trace_lane {
+    int32_t depth;
+    int32_t contents;
+    bool start_solid;
+    bool all_solid;
+    bool hit;
+    bool overflow;
+    trace_piece stack[TRACE_MAX_DEPTH];
+};
+
+// the per lane state the vector step reads and writes, one array each
+struct trace_packet {
+    alignas(32) int32_t node[TRACE_BATCH_WIDTH];
+    alignas(32) int32_t active[TRACE_BATCH_WIDTH]; // all bits set while walking
+    alignas(32) int32_t entry_node[TRACE_BATCH_WIDTH];
+    alignas(32) int32_t entry_side[TRACE_BATCH_WIDTH];
+    alignas(32) float start[TRACE_BATCH_WIDTH];
+    alignas(32) float end[TRACE_BATCH_WIDTH];
+    alignas(32) float entry_start[TRACE_BATCH_WIDTH];
+    alignas(32) float entry_end[TRACE_BATCH_WIDTH];
+    alignas(32) float origin[3][TRACE_BATCH_WIDTH];
+    alignas(32) float delta[3][TRACE_BATCH_WIDTH];
+    trace_lane lanes[TRACE_BATCH_WIDTH];
+};
+
+// a lane reached contents, solid after open space is the hit, otherwise it
+// carries on with the next far side. returns false once the lane is done
+static bool leaveContents(trace_packet *packet, int lane) {
+    trace_lane &state = packet->lanes[lane];
+    int contents = packet->node[lane];
+    if (contents != BSP_CONTENTS_SOLID) {
+        state.all_solid = false;
+        state.contents = contents;
+    } else if (packet->entry_node[lane] >= 0) {
+        // crossing from solid into solid never got out, like quake's walk
+        state.hit = !state.all_solid;
+        return false;
+    } else {
+        state.start_solid = true;
+    }
+
+    if (state.depth == 0) return false;
+    const trace_piece &piece = state.stack[--state.depth];
+    packet->node[lane] = piece.node;
+    packet->start[lane] = piece.start;
+    packet->end[lane] = piece.end;
+    packet->entry_node[lane] = piece.entry_node;
+    packet->entry_side[lane] = piece.entry_side;
+    packet->entry_start[lane] = piece.entry_start;
+    packet->entry_end[lane] = piece.entry_end;
+    return true;
+}
+
+// leaf children become their contents
+TARGET_AVX2 static __m256i resolveLeaves(__m256i child) {
+    __m256i leaves = _mm256_cmpgt_epi32(_mm256_setzero_si256(), child);
+    __m256i bits = _mm256_andnot_si256(child, _mm256_set1_epi32(COLLISION_CONTENTS_MASK));
+    __m256i contents = _mm256_sub_epi32(_mm256_setzero_si256(), bits);
+    return _mm256_blendv_epi8(child, contents, leaves);
+}
+
+// every lane sits on a node, one step down for all of them. the plane
+// distances of both ends pick the child, lanes whose piece crosses the
+// plane keep the near side and push the far one
+TARGET_AVX2 static void stepPacket(const collision_hull &hull, trace_packet *packet) {
+    __m256i active = _mm256_load_si256((const __m256i *)packet->active);
+    __m256i node = _mm256_load_si256((const __m256i *)packet->node);
+    __m256i node_index = _mm256_mullo_epi32(node, _mm256_set1_epi32(TRACE_NODE_STRIDE));
+    const float *floats = (const float *)hull.nodes;
+    const int32_t *ints = (const int32_t *)hull.nodes;
+    __m256 active_ps = _mm256_castsi256_ps(active);
+    __m256 zero = _mm256_setzero_ps();
+    __m256 nx = _mm256_mask_i32gather_ps(zero, floats + 0, node_index, active_ps, 4);
+    __m256 ny = _mm256_mask_i32gather_ps(zero, floats + 1, node_index, active_ps, 4);
+    __m256 nz = _mm256_mask_i32gather_ps(zero, floats + 2, node_index, active_ps, 4);
+    __m256 dist = _mm256_mask_i32gather_ps(zero, floats + 3, node_index, active_ps, 4);
+
+    __m256 start = _mm256_load_ps(packet->start);
+    __m256 end = _mm256_load_ps(packet->end);
+    __m256 d1 = _mm256_sub_ps(_mm256_setzero_ps(), dist);
+    __m256 d2 = d1;
+    const __m256 normal[3] = { nx, ny, nz };
+    for (int i = 0; i < 3; i++) {
+        __m256 origin = _mm256_load_ps(packet->origin[i]);
+        __m256 delta = _mm256_load_ps(packet->delta[i]);
+        __m256 p1 = _mm256_add_ps(origin, _mm256_mul_ps(delta, start));
+        __m256 p2 = _mm256_add_ps(origin, _mm256_mul_ps(delta, end));
+        d1 = _mm256_add_ps(d1, _mm256_mul_ps(normal[i], p1));
+        d2 = _mm256_add_ps(d2, _mm256_mul_ps(normal[i], p2));
+    }
+
+    // the near side is the one the piece starts on
+    __m256i back1 = _mm256_castps_si256(_mm256_cmp_ps(d1, zero, _CMP_LT_OQ));
+    __m256i back2 = _mm256_castps_si256(_mm256_cmp_ps(d2, zero, _CMP_LT_OQ));
+    __m256i side = _mm256_and_si256(back1, _mm256_set1_epi32(1));
+    __m256i child_index = _mm256_add_epi32(_mm256_add_epi32(node_index, _mm256_set1_epi32(TRACE_NODE_CHILDREN)), side);
+    __m256i near_child = resolveLeaves(_mm256_mask_i32gather_epi32(node, ints, child_index, active, 4));
+
+    __m256i split = _mm256_and_si256(active, _mm256_xor_si256(back1, back2));
+    int split_mask = _mm256_movemask_ps(_mm256_castsi256_ps(split));
+    if (split_mask) {
+        // exactly on the plane, see traceHullNode
+        __m256 t = _mm256_div_ps(d1, _mm256_sub_ps(d1, d2));
+        t = _mm256_min_ps(_mm256_max_ps(t, zero), _mm256_set1_ps(1.0f));
+        __m256 cross = _mm256_add_ps(start, _mm256_mul_ps(_mm256_sub_ps(end, start), t));
+        __m256i far_index = _mm256_sub_epi32(_mm256_add_epi32(child_index, _mm256_set1_epi32(1)), _mm256_add_epi32(side, side));
+        __m256i far_child = resolveLeaves(_mm256_mask_i32gather_epi32(node, ints, far_index, split, 4));
+
+        alignas(32) int32_t far[TRACE_BATCH_WIDTH];
+        alignas(32) int32_t sides[TRACE_BATCH_WIDTH];
+        alignas(32) float crosses[TRACE_BATCH_WIDTH];
+        _mm256_store_si256((__m256i *)far, far_child);
+        _mm256_store_si256((__m256i *)sides, side);
+        _mm256_store_ps(crosses, cross);
+        for (int lane = 0; lane < TRACE_BATCH_WIDTH; lane++) {
+            if (!(split_mask & (1 << lane))) continue;
+            trace_lane &state = packet->lanes[lane];
+            if (state.depth == TRACE_MAX_DEPTH) {
+                state.overflow = true;
+                packet->active[lane] = 0;
+                continue;
+            }
+            trace_piece &piece = state.stack[state.depth++];
+            piece.node = far[lane];
+            piece.start = crosses[lane];
+            piece.end = packet->end[lane];
+            piece.entry_node = packet->node[lane];
+            piece.entry_side = sides[lane];
+            piece.entry_start = packet->start[lane];
+            piece.entry_end = packet->end[lane];
+        }
+        _mm256_store_ps(packet->end, _mm256_blendv_ps(end, cross, _mm256_castsi256_ps(split)));
+    }
+
+    // lanes that overflowed just now keep their node, they are done anyway
+    active = _mm256_load_si256((const __m256i *)packet->active);
+    _mm256_store_si256((__m256i *)packet->node, _mm256_blendv_epi8(node, near_child, active));
+}
+
+// how far a hit lane got, the same epsilon and back off as traceHullNode
+// but from the line as a whole
+static void finishHit(const trace_packet &packet, int lane, int hull, const glm::vec3 &start, const glm::vec3 &end, trace_result *result) {
+    const collision_node &node = loaded_map.collision[hull].nodes[packet.entry_node[lane]];
+    bool side = packet.entry_side[lane] != 0;
+    result->normal = side ? -node.normal : node.normal;
+    result->dist = side ? -node.dist : node.dist;
+    result->contents = BSP_CONTENTS_SOLID;
+
+    float entry_start = packet.entry_start[lane];
+    float entry_end = packet.entry_end[lane];
+    glm::vec3 p1 = start + (end - start) * entry_start;
+    glm::vec3 p2 = start + (end - start) * entry_end;
+    float d1 = glm::dot(node.normal, p1) - node.dist;
+    float d2 = glm::dot(node.normal, p2) - node.dist;
+    float frac = glm::max(side ? (d1 + MAP_TRACE_EPSILON) / (d1 - d2) : (d1 - MAP_TRACE_EPSILON) / (d1 - d2), 0.0f);
+    float mid_frac = entry_start + (entry_end - entry_start) * frac;
+    glm::vec3 mid = p1 + (p2 - p1) * frac;
+    while (hullPointContents(mid, hull) == BSP_CONTENTS_SOLID) {
+        frac -= 0.1f;
+        if (frac < 0.0f) break;
+        mid_frac = entry_start + (entry_end - entry_start) * frac;
+        mid = p1 + (p2 - p1) * frac;
+    }
+    result->fraction = mid_frac;
+    result->end_pos = mid;
+}
+
+// a packet that stays open for one hull, lanes that finish take the next
+// request for it so divergent traces don't leave the rest of the lanes idle
+struct trace_stream {
+    const collision_hull *collision;
+    int32_t hull;
+    int32_t request[TRACE_BATCH_WIDTH]; // -1 for a free lane
+    trace_packet packet;
+};
+
+static void startLane(trace_stream *stream, int lane, const trace_request *requests, int index) {
+    trace_packet &packet = stream->packet;
+    const trace_request &request = requests[index];
+    glm::vec3 start = request.start + request.offset;
+    glm::vec3 delta = request.end - request.start;
+    stream->request[lane] = index;
+    // a hull that is one leaf starts on its contents
+    int head = stream->collision->head;
+    packet.node[lane] = head >= 0 ? head : -(~head & COLLISION_CONTENTS_MASK);
+    packet.active[lane] = -1;
+    packet.entry_node[lane] = -1;
+    packet.entry_side[lane] = 0;
+    packet.start[lane] = 0.0f;
+    packet.end[lane] = 1.0f;
+    packet.entry_start[lane] = 0.0f;
+    packet.entry_end[lane] = 1.0f;
+    for (int i = 0; i < 3; i++) {
+        packet.origin[i][lane] = start[i];
+        packet.delta[i][lane] = delta[i];
+    }
+    trace_lane &state = packet.lanes[lane];
+    state.depth = 0;
+    state.contents = BSP_CONTENTS_EMPTY;
+    state.start_solid = false;
+    state.all_solid = true;
+    state.hit = false;
+    state.overflow = false;
+}
+
+static void finishLane(trace_stream *stream, int lane, const trace_request *requests, trace_result *results) {
+    const trace_packet &packet = stream->packet;
+    const trace_request &request = requests[stream->request[lane]];
+    trace_result &result = results[stream->request[lane]];
+    const trace_lane &state = packet.lanes[lane];
+    stream->request[lane] = -1;
+    if (state.overflow) {
+        result = traceRequest(request);
+        return;
+    }
+    glm::vec3 start = request.start + request.offset;
+    glm::vec3 end = request.end + request.offset;
+    result = {};
+    result.fraction = 1.0f;
+    result.end_pos = end;
+    result.contents = state.contents;
+    result.start_solid = state.start_solid;
+    if (state.hit) finishHit(packet, lane, stream->hull, start, end, &result);
+    if (state.all_solid) {
+        result.all_solid = true;
+        result.start_solid = true;
+        result.fraction = 0.0f;
+        result.end_pos = start;
+        result.contents = BSP_CONTENTS_SOLID;
+    }
+    result.end_pos -= request.offset;
+}
+
+// lanes on contents finish them here until they are back on a node, done
+// lanes write their result. returns the lanes still walking
+static int settleLanes(trace_stream *stream, const trace_request *requests, trace_result *results) {
+    trace_packet &packet = stream->packet;
+    int num_active = 0;
+    for (int lane = 0; lane < TRACE_BATCH_WIDTH; lane++) {
+        if (stream->request[lane] < 0) continue;
+        if (packet.active[lane]) {
+            while (packet.node[lane] < 0) {
+                if (!leaveContents(&packet, lane)) {
+                    packet.active[lane] = 0;
+                    break;
+                }
+            }
+        }
+        if (packet.active[lane]) {
+            num_active++;
+        } else {
+            finishLane(stream, lane, requests, results);
+        }
+    }
+    return num_active;
+}
+
+// the lane stacks make these tens of kilobytes, too much for the stack of a
+// worker thread, so each thread allocates its own on its first batch
+static trace_stream *getStreams() {
+    static thread_local std::unique_ptr<trace_stream[]> streams(new trace_stream[3]);
+    return streams.get();
+}
+
+TARGET_AVX2 static void traceHullBatchAVX2(const trace_request *requests, int count, trace_result *results) {
+    trace_stream *streams = getStreams();
+    for (int hull = 0; hull < 3; hull++) {
+        trace_stream &stream = streams[hull];
+        stream.collision = &loaded_map.collision[hull];
+        stream.hull = hull;
+        for (int lane = 0; lane < TRACE_BATCH_WIDTH; lane++) {
+            stream.request[lane] = -1;
+            stream.packet.active[lane] = 0;
+            stream.packet.node[lane] = 0;
+        }
+    }
+
+    for (int i = 0; i < count; i++) {
+        int hull = requests[i].hull;
+        if (hull < MAP_HULL_POINT || hull > MAP_HULL_LARGE) {
+            results[i] = traceRequest(requests[i]);
+            continue;
+        }
+        // walk the hull's packet until a lane frees up for this request
+        trace_stream &stream = streams[hull];
+        int lane = -1;
+        for (;;) {
+            settleLanes(&stream, requests, results);
+            for (int j = 0; j < TRACE_BATCH_WIDTH && lane < 0; j++) {
+                if (stream.request[j] < 0) lane = j;
+            }
+            if (lane >= 0) break;
+            stepPacket(*stream.collision, &stream.packet);
+        }
+        startLane(&stream, lane, requests, i);
+    }
+
+    for (int hull = 0; hull < 3; hull++) {
+        trace_stream &stream = streams[hull];
+        while (settleLanes(&stream, requests, results)) {
+            stepPacket(*stream.collision, &stream.packet);
+        }
+    }
+}
+#endif
+
+struct trace_kernel {
+    trace_batch_fn fn;
+    const char *name;
+};
+
+// picked once, the first time a batch is traced
+static const trace_kernel &getKernel() {
+    static const trace_kernel kernel = []() -> trace_kernel {
+#ifdef CPU_X86
+        if (cpuHasAVX2()) return { traceHullBatchAVX2, "avx2" };
+#endif
+        return { traceHullBatchGeneric, "generic" };
+    }();
+    return kernel;
+}
+
+// results come out in request order whatever order the lanes finish in
+void traceHullBatch(const trace_request *requests, int count, trace_result *results) {
+    getKernel().fn(requests, count, results);
+}
+
+const char *getTraceKernelName() {
+    return getKernel().name;
+}
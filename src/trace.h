@@ -0,0 +1,25 @@
+#pragma once
+#include "map.h"
+
+// traces walked side by side by the simd kernel, all in the same hull
+#define TRACE_BATCH_WIDTH 8
+
+// far sides a trace can have waiting, deeper trees fall back to traceHull
+#define TRACE_MAX_DEPTH 128
+
+// a line through one of the world hulls, a box is traced as the point of
+// the hull its size fits, moved by offset on the way in and back out
+struct trace_request {
+    glm::vec3 start;
+    glm::vec3 end;
+    glm::vec3 offset;
+    int32_t hull;
+};
+
+// a whole batch of traces, the kernels picked between at runtime share it
+typedef void (*trace_batch_fn)(const trace_request *, int, trace_result *);
+
+trace_request makeBoxTrace(const glm::vec3 &start, const glm::vec3 &end, const glm::vec3 &mins, const glm::vec3 &maxs);
+void traceHullBatch(const trace_request *requests, int count, trace_result *results);
+void traceHullBatchGeneric(const trace_request *requests, int count, trace_result *results);
+const char *getTraceKernelName();
@@ -0,0 +1,156 @@
+#include "vcache.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+// scoring constants from forsyth's paper
+#define VCACHE_DECAY_POWER 1.5f
+#define VCACHE_LAST_TRIANGLE_SCORE 0.75f
+#define VCACHE_VALENCE_SCALE 2.0f
+#define VCACHE_VALENCE_POWER 0.5f
+
+// valences past this share the last score
+#define VCACHE_MAX_VALENCE 64
+
+// the pow calls dominate otherwise, every emitted triangle rescores the
+// whole cache
+struct vcache_scores {
+    float cache[VCACHE_SIZE + 1]; // by cache position plus one, 0 is uncached
+    float valence[VCACHE_MAX_VALENCE + 1];
+};
+
+static vcache_scores buildScoreTables() {
+    vcache_scores scores = {};
+    for (int i = 0; i < VCACHE_SIZE; i++) {
+        // the last triangle's vertices are scored flat so it is not simply
+        // continued as a strip
+        if (i < 3) scores.cache[i + 1] = VCACHE_LAST_TRIANGLE_SCORE;
+        else scores.cache[i + 1] = powf(1.0f - (float)(i - 3) / (float)(VCACHE_SIZE - 3), VCACHE_DECAY_POWER);
+    }
+    for (int i = 1; i <= VCACHE_MAX_VALENCE; i++) {
+        scores.valence[i] = VCACHE_VALENCE_SCALE * powf((float)i, -VCACHE_VALENCE_POWER);
+    }
+    return scores;
+}
+
+// recently used vertices score high, and so do vertices with few triangles
+// left so they get finished off instead of lingering
+static float vertexScore(const vcache_scores &scores, int cache_pos, int remaining) {
+    if (remaining == 0) return -1.0f;
+    return scores.cache[cache_pos + 1] + scores.valence[remaining < VCACHE_MAX_VALENCE ? remaining : VCACHE_MAX_VALENCE];
+}
+
+void optimizeVertexCache(uint32_t *indices, int num_indices, arena *scratch) {
+    int num_tris = num_indices / 3;
+    if (num_tris < 2) return;
+    static const vcache_scores scores = buildScoreTables();
+
+    // local vertex ids so the work follows the list, not the whole buffer
+    uint32_t *verts = arenaPush<uint32_t>(scratch, num_indices);
+    memcpy(verts, indices, sizeof(uint32_t) * num_tris * 3);
+    std::sort(verts, verts + num_tris * 3);
+    int num_verts = (int)(std::unique(verts, verts + num_tris * 3) - verts);
+    uint32_t *tri_verts = arenaPush<uint32_t>(scratch, num_tris * 3);
+    for (int i = 0; i < num_tris * 3; i++) {
+        tri_verts[i] = (uint32_t)(std::lower_bound(verts, verts + num_verts, indices[i]) - verts);
+    }
+
+    // nothing beats transforming every vertex once, fans over corners no
+    // other face shares already do
+    if (simulateVertexCache(tri_verts, num_tris * 3, num_verts, VCACHE_SIZE, scratch) == num_verts) return;
+
+    // triangles using each vertex, emitted ones are swapped out of the end
+    int *remaining = arenaPush<int>(scratch, num_verts);
+    int *first_tri = arenaPush<int>(scratch, num_verts + 1);
+    int *vert_tris = arenaPush<int>(scratch, num_tris * 3);
+    for (int i = 0; i < num_tris * 3; i++) {
+        remaining[tri_verts[i]]++;
+    }
+    for (int i = 0; i < num_verts; i++) {
+        first_tri[i + 1] = first_tri[i] + remaining[i];
+        remaining[i] = 0;
+    }
+    for (int i = 0; i < num_tris * 3; i++) {
+        int v = tri_verts[i];
+        vert_tris[first_tri[v] + remaining[v]++] = i / 3;
+    }
+
+    int *cache_pos = arenaPush<int>(scratch, num_verts);
+    float *vert_scores = arenaPush<float>(scratch, num_verts);
+    for (int i = 0; i < num_verts; i++) {
+        cache_pos[i] = -1;
+        vert_scores[i] = vertexScore(scores, -1, remaining[i]);
+    }
+
+    bool *emitted = arenaPush<bool>(scratch, num_tris);
+    uint32_t *out = arenaPush<uint32_t>(scratch, num_tris * 3);
+    int cache[VCACHE_SIZE + 3];
+    int cache_len = 0;
+    int best = -1;
+    int cursor = 0;
+    for (int n = 0; n < num_tris; n++) {
+        if (best < 0) {
+            // nothing in the cache has triangles left, go on in input order
+            while (emitted[cursor]) cursor++;
+            best = cursor;
+        }
+        emitted[best] = true;
+        const uint32_t *tri = tri_verts + best * 3;
+        memcpy(out + n * 3, indices + best * 3, sizeof(uint32_t) * 3);
+
+        int new_cache[VCACHE_SIZE + 3];
+        int new_len = 0;
+        for (int k = 0; k < 3; k++) {
+            int v = tri[k];
+            int *tris = vert_tris + first_tri[v];
+            for (int i = 0; i < remaining[v]; i++) {
+                if (tris[i] != best) continue;
+                tris[i] = tris[--remaining[v]];
+                break;
+            }
+            if (std::find(new_cache, new_cache + new_len, v) == new_cache + new_len) new_cache[new_len++] = v;
+        }
+        for (int i = 0; i < cache_len; i++) {
+            int v = cache[i];
+            if (v != (int)tri[0] && v != (int)tri[1] && v != (int)tri[2]) new_cache[new_len++] = v;
+        }
+
+        // whatever fell off the end scores as uncached again
+        for (int i = 0; i < new_len; i++) {
+            int v = new_cache[i];
+            cache_pos[v] = i < VCACHE_SIZE ? i : -1;
+            vert_scores[v] = vertexScore(scores, cache_pos[v], remaining[v]);
+        }
+        cache_len = std::min(new_len, VCACHE_SIZE);
+        memcpy(cache, new_cache, sizeof(int) * cache_len);
+
+        // only triangles touching the cache changed score
+        best = -1;
+        float best_score = -1.0f;
+        for (int i = 0; i < cache_len; i++) {
+            int v = cache[i];
+            for (int j = 0; j < remaining[v]; j++) {
+                int t = vert_tris[first_tri[v] + j];
+                const uint32_t *t_verts = tri_verts + t * 3;
+                float score = vert_scores[t_verts[0]] + vert_scores[t_verts[1]] + vert_scores[t_verts[2]];
+                if (score > best_score) {
+                    best_score = score;
+                    best = t;
+                }
+            }
+        }
+    }
+    memcpy(indices, out, sizeof(uint32_t) * num_tris * 3);
+}
+
+int64_t simulateVertexCache(const uint32_t *indices, int num_indices, int num_verts, int cache_size, arena *scratch) {
+    // the miss count at which each vertex last entered the cache, 0 for never
+    int64_t *entered = arenaPush<int64_t>(scratch, num_verts);
+    int64_t misses = 0;
+    for (int i = 0; i < num_indices; i++) {
+        int64_t &e = entered[indices[i]];
+        if (e && misses - e < cache_size) continue;
+        e = ++misses;
+    }
+    return misses;
+}
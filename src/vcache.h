@@ -0,0 +1,13 @@
+#pragma once
+#include "arena.h"
+#include <cstdint>
+
+// entries of the modeled post transform cache, lru for the optimizer
+#define VCACHE_SIZE 32
+
+// reorders the triangles of an index list after tom forsyth's linear speed
+// vertex cache optimization, the list may use any vertex ids
+void optimizeVertexCache(uint32_t *indices, int num_indices, arena *scratch);
+
+// vertex shader runs a fifo cache of cache_size entries would need
+int64_t simulateVertexCache(const uint32_t *indices, int num_indices, int num_verts, int cache_size, arena *scratch);
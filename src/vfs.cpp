@@ -0,0 +1,175 @@
+#include "vfs.h"
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+
+// quake .pak layout
+#define PAK_MAGIC (('K' << 24) | ('C' << 16) | ('A' << 8) | 'P')
+
+struct pak_header {
+    int32_t magic;
+    int32_t dir_offset;
+    int32_t dir_length;
+};
+
+struct pak_entry {
+    char name[VFS_MAX_PATH];
+    int32_t offset;
+    int32_t length;
+};
+
+// open addressed table over every file of every mounted pak, built once per
+// mount so a lookup is a hash and usually a single probe
+struct vfs_entry {
+    uint64_t hash;
+    char name[VFS_MAX_PATH];
+    const uint8_t *data;
+    uint32_t size;
+};
+
+static int32_t num_paks;
+static mapped_file paks[VFS_MAX_PAKS];
+
+static int32_t num_entries;
+static uint32_t table_capacity;
+static vfs_entry *table;
+
+// paths are matched case insensitively with forward slashes
+static bool normalizePath(const char *path, size_t max_len, char *out) {
+    size_t i = 0;
+    for (; path[i] && i < max_len; i++) {
+        char c = path[i];
+        if (c == '\\') c = '/';
+        if (c >= 'A' && c <= 'Z') c = c - 'A' + 'a';
+        out[i] = c;
+    }
+    if (i == VFS_MAX_PATH) return false;
+    memset(out + i, 0, VFS_MAX_PATH - i);
+    return i > 0;
+}
+
+static uint64_t hashPath(const char *name) {
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (int i = 0; i < VFS_MAX_PATH && name[i]; i++) {
+        h = (h ^ (uint8_t)name[i]) * 0x100000001b3ull;
+    }
+    return h;
+}
+
+static vfs_entry *findSlot(uint64_t hash, const char *name) {
+    uint32_t mask = table_capacity - 1;
+    for (uint32_t i = (uint32_t)hash & mask;; i = (i + 1) & mask) {
+        vfs_entry *entry = table + i;
+        if (!entry->data) return entry;
+        if (entry->hash == hash && memcmp(entry->name, name, VFS_MAX_PATH) == 0) return entry;
+    }
+}
+
+static void growTable(uint32_t min_entries) {
+    // keep the load factor at or below one half
+    uint32_t capacity = table_capacity ? table_capacity : 256;
+    while (capacity < min_entries * 2) capacity <<= 1;
+    if (capacity == table_capacity) return;
+
+    vfs_entry *old_table = table;
+    uint32_t old_capacity = table_capacity;
+    table = (vfs_entry *)calloc(capacity, sizeof(vfs_entry));
+    table_capacity = capacity;
+
+    for (uint32_t i = 0; i < old_capacity; i++) {
+        if (old_table[i].data) *findSlot(old_table[i].hash, old_table[i].name) = old_table[i];
+    }
+    free(old_table);
+}
+
+// later mounts override files of earlier ones, like quake's search path
+bool vfsMount(const char *pak_path) {
+    if (num_paks == VFS_MAX_PAKS) return false;
+
+    mapped_file pak;
+    if (!mapFile(pak_path, &pak)) return false;
+
+    const pak_header *header = (const pak_header *)pak.data;
+    bool ok = pak.size >= sizeof(pak_header) &&
+              header->magic == PAK_MAGIC &&
+              header->dir_offset >= 0 && header->dir_length >= 0 &&
+              header->dir_length % sizeof(pak_entry) == 0 &&
+              (uint64_t)header->dir_offset + header->dir_length <= pak.size;
+    if (!ok) {
+        std::cerr << "vfs: " << pak_path << " is not a valid pak" << std::endl;
+        unmapFile(&pak);
+        return false;
+    }
+
+    int num_files = header->dir_length / sizeof(pak_entry);
+    growTable(num_entries + num_files);
+
+    int num_mounted = 0;
+    for (int i = 0; i < num_files; i++) {
+        pak_entry entry;
+        memcpy(&entry, pak.data + header->dir_offset + i * sizeof(pak_entry), sizeof(entry));
+        if (entry.offset < 0 || entry.length < 0 || (uint64_t)entry.offset + entry.length > pak.size) continue;
+
+        char name[VFS_MAX_PATH];
+        if (!normalizePath(entry.name, VFS_MAX_PATH, name)) continue;
+
+        uint64_t hash = hashPath(name);
+        vfs_entry *slot = findSlot(hash, name);
+        if (!slot->data) num_entries++;
+        slot->hash = hash;
+        memcpy(slot->name, name, VFS_MAX_PATH);
+        // empty files still need a non null pointer to mark the slot used
+        slot->data = pak.data + entry.offset;
+        slot->size = entry.length;
+        num_mounted++;
+    }
+
+    paks[num_paks++] = pak;
+    std::cout << "vfs: mounted " << pak_path << " (" << num_mounted << " files)" << std::endl;
+    return true;
+}
+
+// pak0.pak, pak1.pak, ... from the working directory, stops at the first gap
+void vfsMountDefaultPaks() {
+    for (int i = 0; i < 10; i++) {
+        char path[16];
+        snprintf(path, sizeof(path), "pak%d.pak", i);
+        if (!vfsMount(path)) break;
+    }
+}
+
+void vfsShutdown() {
+    for (int i = 0; i < num_paks; i++) {
+        unmapFile(&paks[i]);
+    }
+    num_paks = 0;
+    free(table);
+    table = 0;
+    table_capacity = 0;
+    num_entries = 0;
+}
+
+bool vfsOpen(const char *path, vfs_file *out) {
+    *out = {};
+
+    char name[VFS_MAX_PATH];
+    if (table && normalizePath(path, VFS_MAX_PATH, name)) {
+        vfs_entry *entry = findSlot(hashPath(name), name);
+        if (entry->data) {
+            out->data = entry->data;
+            out->size = entry->size;
+            return true;
+        }
+    }
+
+    // not in any pak, fall back to the file system
+    if (!mapFile(path, &out->loose)) return false;
+    out->data = out->loose.data;
+    out->size = out->loose.size;
+    return true;
+}
+
+void vfsClose(vfs_file *file) {
+    unmapFile(&file->loose);
+    *file = {};
+}
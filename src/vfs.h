@@ -0,0 +1,19 @@
+#pragma once
+#include "file.h"
+
+#define VFS_MAX_PAKS 16
+#define VFS_MAX_PATH 56
+
+// a file served by the vfs, data points straight into a mapped pak or into
+// a mapping of a loose file when no mounted pak has it
+struct vfs_file {
+    const uint8_t *data;
+    size_t size;
+    mapped_file loose;
+};
+
+bool vfsMount(const char *pak_path);
+void vfsMountDefaultPaks();
+void vfsShutdown();
+bool vfsOpen(const char *path, vfs_file *out);
+void vfsClose(vfs_file *file);